@@ -0,0 +1,543 @@
+/*-
+ * Copyright (c) 2024-2025 Rozhuk Ivan <rozhuk.im@gmail.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE REGENTS AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE REGENTS OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ * Author: Rozhuk Ivan <rozhuk.im@gmail.com>
+ *
+ */
+
+
+#include <sys/param.h>
+#include <sys/types.h>
+#include <sys/queue.h>
+#if defined(__FreeBSD__) || defined(__DragonFly__)
+#	include <sys/cpuset.h>
+#	include <pthread_np.h>
+#	define CUSE_POOL_AFFINITY	1
+typedef cpuset_t cp_cpuset_t;
+#elif defined(__linux__)
+#	include <sched.h>
+#	define CUSE_POOL_AFFINITY	1
+typedef cpu_set_t cp_cpuset_t;
+#endif
+
+#include <inttypes.h>
+#include <stdlib.h> /* malloc, exit */
+#include <string.h> /* bcopy, bzero, memcpy, memmove, memset, strerror... */
+#include <errno.h>
+#include <time.h>
+#include <sched.h>
+#include <signal.h>
+#include <pthread.h>
+#include <syslog.h>
+#include <cuse.h>
+
+#include "cuse_pool.h"
+
+
+#define CUSE_POOL_MNG_INTERVAL	1 /* Manager check interval, seconds. */
+#define CUSE_POOL_IDLE_SPARE	1 /* Idle workers to keep above min_threads. */
+#define CUSE_POOL_IDLE_TIMEOUT	30 /* Default idle_timeout, seconds. */
+#define CUSE_POOL_WAKE_SIG	SIGUSR2 /* Interrupt idle worker wait. */
+
+#define CUSE_POOL_W_IDLE	0 /* Wait for request. */
+#define CUSE_POOL_W_BUSY	1 /* In method, never signaled. */
+#define CUSE_POOL_W_EXIT	2 /* Selected by manager to exit. */
+
+typedef struct cuse_pool_worker_s {
+	TAILQ_ENTRY(cuse_pool_worker_s) next;
+	pthread_t		td;
+	volatile int		state; /* CUSE_POOL_W_*. */
+	int			rt; /* rt_prio and cpus applied. */
+} cuse_pool_worker_t, *cuse_pool_worker_p;
+
+typedef struct cuse_pool_s {
+	pthread_mutex_t		mtx;
+	pthread_cond_t		cond; /* Manager wakeup. */
+	volatile size_t		threads; /* Running workers. */
+	volatile size_t		busy; /* Workers in methods. */
+	volatile size_t		busy_max;
+	size_t			exiting; /* Selected to exit, not exited yet. */
+	size_t			rt_workers; /* Workers with rt set. */
+	TAILQ_HEAD(, cuse_pool_worker_s) workers;
+	volatile uint64_t	requests;
+	volatile uint64_t	spawned;
+	volatile uint64_t	exited;
+	time_t			spare_time; /* Last time when pool had no spare workers. */
+	cuse_pool_options_t	opts;
+#ifdef CUSE_POOL_AFFINITY
+	cp_cpuset_t		cpus;
+	int			cpus_set;
+#endif
+	const struct cuse_methods *methods; /* Original methods. */
+	struct cuse_methods	wrap;
+} cuse_pool_t;
+
+static cuse_pool_t cpool = {
+	.mtx = PTHREAD_MUTEX_INITIALIZER,
+	.workers = TAILQ_HEAD_INITIALIZER(cpool.workers),
+};
+static _Thread_local cuse_pool_worker_p cpool_worker = NULL;
+
+
+static time_t
+cuse_pool_time_get(void) {
+	struct timespec now;
+
+	if (0 != clock_gettime(CLOCK_MONOTONIC, &now))
+		return (0);
+	return (now.tv_sec);
+}
+
+static void
+cuse_pool_busy(void) {
+	size_t busy;
+	int state = CUSE_POOL_W_IDLE;
+	sigset_t sig_set;
+
+	if (NULL != cpool_worker &&
+	    0 == __atomic_compare_exchange_n(&cpool_worker->state, &state,
+	    CUSE_POOL_W_BUSY, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+		/* Selected to exit: do not let signal interrupt method. */
+		sigemptyset(&sig_set);
+		sigaddset(&sig_set, CUSE_POOL_WAKE_SIG);
+		pthread_sigmask(SIG_BLOCK, &sig_set, NULL);
+	}
+
+	busy = __atomic_add_fetch(&cpool.busy, 1, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&cpool.requests, 1, __ATOMIC_RELAXED);
+	if (busy > cpool.busy_max) { /* Not exact, only for stats. */
+		cpool.busy_max = busy;
+	}
+	if (busy < __atomic_load_n(&cpool.threads, __ATOMIC_RELAXED))
+		return;
+	/* All workers busy: wakeup manager to add one. */
+	pthread_mutex_lock(&cpool.mtx);
+	pthread_cond_signal(&cpool.cond);
+	pthread_mutex_unlock(&cpool.mtx);
+}
+
+static void
+cuse_pool_idle(void) {
+	int state = CUSE_POOL_W_BUSY;
+	sigset_t sig_set;
+
+	__atomic_sub_fetch(&cpool.busy, 1, __ATOMIC_RELAXED);
+	if (NULL == cpool_worker ||
+	    0 != __atomic_compare_exchange_n(&cpool_worker->state, &state,
+	    CUSE_POOL_W_IDLE, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+		return;
+	/* Manager hold mtx until signal sent: get it now, not in wait. */
+	pthread_mutex_lock(&cpool.mtx);
+	pthread_mutex_unlock(&cpool.mtx);
+	sigemptyset(&sig_set);
+	sigaddset(&sig_set, CUSE_POOL_WAKE_SIG);
+	pthread_sigmask(SIG_UNBLOCK, &sig_set, NULL);
+}
+
+
+static int
+cuse_pool_open(struct cuse_dev *pdev, int fflags) {
+	int ret;
+
+	cuse_pool_busy();
+	ret = cpool.methods->cm_open(pdev, fflags);
+	cuse_pool_idle();
+
+	return (ret);
+}
+
+static int
+cuse_pool_close(struct cuse_dev *pdev, int fflags) {
+	int ret;
+
+	cuse_pool_busy();
+	ret = cpool.methods->cm_close(pdev, fflags);
+	cuse_pool_idle();
+
+	return (ret);
+}
+
+static int
+cuse_pool_read(struct cuse_dev *pdev, int fflags, void *peer_ptr, int len) {
+	int ret;
+
+	cuse_pool_busy();
+	ret = cpool.methods->cm_read(pdev, fflags, peer_ptr, len);
+	cuse_pool_idle();
+
+	return (ret);
+}
+
+static int
+cuse_pool_write(struct cuse_dev *pdev, int fflags, const void *peer_ptr,
+    int len) {
+	int ret;
+
+	cuse_pool_busy();
+	ret = cpool.methods->cm_write(pdev, fflags, peer_ptr, len);
+	cuse_pool_idle();
+
+	return (ret);
+}
+
+static int
+cuse_pool_ioctl(struct cuse_dev *pdev, int fflags, unsigned long cmd,
+    void *peer_data) {
+	int ret;
+
+	cuse_pool_busy();
+	ret = cpool.methods->cm_ioctl(pdev, fflags, cmd, peer_data);
+	cuse_pool_idle();
+
+	return (ret);
+}
+
+static int
+cuse_pool_poll(struct cuse_dev *pdev, int fflags, int events) {
+	int ret;
+
+	cuse_pool_busy();
+	ret = cpool.methods->cm_poll(pdev, fflags, events);
+	cuse_pool_idle();
+
+	return (ret);
+}
+
+const struct cuse_methods *
+cuse_pool_methods(const struct cuse_methods *methods) {
+
+	if (NULL == methods)
+		return (NULL);
+	pthread_mutex_lock(&cpool.mtx);
+	if (NULL != cpool.methods &&
+	    methods != cpool.methods) {
+		pthread_mutex_unlock(&cpool.mtx);
+		return (methods); /* Only one table supported. */
+	}
+	if (NULL == cpool.methods) {
+		cpool.methods = methods;
+		cpool.wrap.cm_open = ((NULL != methods->cm_open) ?
+		    cuse_pool_open : NULL);
+		cpool.wrap.cm_close = ((NULL != methods->cm_close) ?
+		    cuse_pool_close : NULL);
+		cpool.wrap.cm_read = ((NULL != methods->cm_read) ?
+		    cuse_pool_read : NULL);
+		cpool.wrap.cm_write = ((NULL != methods->cm_write) ?
+		    cuse_pool_write : NULL);
+		cpool.wrap.cm_ioctl = ((NULL != methods->cm_ioctl) ?
+		    cuse_pool_ioctl : NULL);
+		cpool.wrap.cm_poll = ((NULL != methods->cm_poll) ?
+		    cuse_pool_poll : NULL);
+	}
+	pthread_mutex_unlock(&cpool.mtx);
+
+	return (&cpool.wrap);
+}
+
+
+#ifdef CUSE_POOL_AFFINITY
+/* Parse "0,2-3" CPU list. */
+static int
+cuse_pool_cpus_parse(const char *str, cp_cpuset_t *cpus) {
+	char *end;
+	unsigned long first, last;
+
+	CPU_ZERO(cpus);
+	while (0 != str[0]) {
+		first = strtoul(str, &end, 10);
+		if (end == str)
+			return (EINVAL);
+		last = first;
+		if ('-' == end[0]) {
+			str = (end + 1);
+			last = strtoul(str, &end, 10);
+			if (end == str || last < first)
+				return (EINVAL);
+		}
+		if (CPU_SETSIZE <= last)
+			return (EINVAL);
+		for (; first <= last; first ++) {
+			CPU_SET(first, cpus);
+		}
+		if (',' == end[0]) {
+			end ++;
+		} else if (0 != end[0]) {
+			return (EINVAL);
+		}
+		str = end;
+	}
+
+	return (0);
+}
+#endif
+
+static void
+cuse_pool_wake_handler(int sig __unused) {
+	/* Only interrupt cuse_wait_and_process(). */
+}
+
+static void *
+cuse_pool_worker_proc(void *arg) {
+	cuse_pool_worker_p w = arg;
+	int error, state;
+
+	cpool_worker = w;
+	for (;;) {
+		error = cuse_wait_and_process();
+		state = __atomic_load_n(&w->state, __ATOMIC_ACQUIRE);
+		if (CUSE_POOL_W_EXIT == state)
+			break;
+		if (0 != error && EINTR != errno)
+			break;
+	}
+	pthread_mutex_lock(&cpool.mtx);
+	TAILQ_REMOVE(&cpool.workers, w, next);
+	__atomic_sub_fetch(&cpool.threads, 1, __ATOMIC_RELAXED);
+	if (0 != w->rt) {
+		cpool.rt_workers --;
+	}
+	if (CUSE_POOL_W_EXIT == state) {
+		cpool.exiting --;
+		cpool.exited ++;
+	}
+	pthread_mutex_unlock(&cpool.mtx);
+	free(w);
+
+	return (NULL);
+}
+
+/* cpool.mtx must be locked. */
+static int
+cuse_pool_worker_add(void) {
+	int error;
+	cuse_pool_worker_p w;
+	pthread_attr_t attr;
+	struct sched_param sp;
+	static int rt_warned = 0;
+
+	w = calloc(1, sizeof(cuse_pool_worker_t));
+	if (NULL == w)
+		return (ENOMEM);
+	/* Only rt_workers get real-time priority and CPUs. */
+	w->rt = (cpool.rt_workers < cpool.opts.rt_threads);
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	if (0 != w->rt &&
+	    0 != cpool.opts.rt_prio) {
+		memset(&sp, 0x00, sizeof(sp));
+		sp.sched_priority = cpool.opts.rt_prio;
+		pthread_attr_setinheritsched(&attr, PTHREAD_EXPLICIT_SCHED);
+		pthread_attr_setschedpolicy(&attr, SCHED_FIFO);
+		pthread_attr_setschedparam(&attr, &sp);
+	}
+	/* Worker locks mtx before use w. */
+	error = pthread_create(&w->td, &attr, cuse_pool_worker_proc, w);
+	if (0 != error &&
+	    0 != w->rt &&
+	    0 != cpool.opts.rt_prio) {
+		/* No rights for real-time scheduling: run as usual. */
+		if (0 == rt_warned) {
+			rt_warned = 1;
+			syslog(LOG_WARNING, "CUSE pool: can not set SCHED_FIFO "
+			    "priority %i: %i - %s",
+			    cpool.opts.rt_prio, error, strerror(error));
+		}
+		pthread_attr_setinheritsched(&attr, PTHREAD_INHERIT_SCHED);
+		error = pthread_create(&w->td, &attr, cuse_pool_worker_proc, w);
+	}
+	pthread_attr_destroy(&attr);
+	if (0 != error) {
+		free(w);
+		return (error);
+	}
+#ifdef CUSE_POOL_AFFINITY
+	if (0 != w->rt &&
+	    0 != cpool.cpus_set) {
+		pthread_setaffinity_np(w->td, sizeof(cp_cpuset_t), &cpool.cpus);
+	}
+#endif
+	TAILQ_INSERT_TAIL(&cpool.workers, w, next);
+	if (0 != w->rt) {
+		cpool.rt_workers ++;
+	}
+	__atomic_add_fetch(&cpool.threads, 1, __ATOMIC_RELAXED);
+	cpool.spawned ++;
+
+	return (0);
+}
+
+/* Select up to count idle workers, not real-time first, and wake them
+ * to exit. cpool.mtx must be locked. */
+static void
+cuse_pool_workers_exit(size_t count) {
+	int state;
+	cuse_pool_worker_p w;
+
+	for (int rt = 0; rt < 2 && 0 != count; rt ++) {
+		TAILQ_FOREACH(w, &cpool.workers, next) {
+			if (0 == count)
+				break;
+			state = CUSE_POOL_W_IDLE;
+			if (rt != w->rt ||
+			    0 == __atomic_compare_exchange_n(&w->state, &state,
+			    CUSE_POOL_W_EXIT, 0, __ATOMIC_ACQ_REL,
+			    __ATOMIC_ACQUIRE))
+				continue;
+			pthread_kill(w->td, CUSE_POOL_WAKE_SIG);
+			cpool.exiting ++;
+			count --;
+		}
+	}
+}
+
+static void *
+cuse_pool_manager_proc(void *arg __unused) {
+	size_t threads, idle;
+	time_t now;
+	struct timespec ts;
+
+	pthread_mutex_lock(&cpool.mtx);
+	for (;;) {
+		clock_gettime(CLOCK_MONOTONIC, &ts);
+		ts.tv_sec += CUSE_POOL_MNG_INTERVAL;
+		pthread_cond_timedwait(&cpool.cond, &cpool.mtx, &ts);
+		/* Selected to exit are not counted. */
+		threads = (__atomic_load_n(&cpool.threads, __ATOMIC_RELAXED) -
+		    cpool.exiting);
+		idle = (threads - MIN(threads,
+		    __atomic_load_n(&cpool.busy, __ATOMIC_RELAXED)));
+		now = cuse_pool_time_get();
+		/* Grow: no one wait for new request. */
+		if (0 == idle) {
+			cpool.spare_time = now;
+			if (threads < cpool.opts.max_threads) {
+				cuse_pool_worker_add();
+			}
+			continue;
+		}
+		if (CUSE_POOL_IDLE_SPARE >= idle ||
+		    cpool.opts.min_threads >= threads) {
+			cpool.spare_time = now;
+			continue;
+		}
+		/* Shrink: extra workers was idle for idle_timeout. */
+		if ((now - cpool.spare_time) < (time_t)cpool.opts.idle_timeout)
+			continue;
+		cuse_pool_workers_exit(MIN((idle - CUSE_POOL_IDLE_SPARE),
+		    (threads - cpool.opts.min_threads)));
+	}
+	pthread_mutex_unlock(&cpool.mtx);
+
+	return (NULL);
+}
+
+int
+cuse_pool_start(cuse_pool_options_p opts) {
+	int error;
+	pthread_t td;
+	pthread_condattr_t cattr;
+	struct sigaction sa;
+
+	if (NULL == opts ||
+	    0 == opts->max_threads)
+		return (EINVAL);
+	pthread_mutex_lock(&cpool.mtx);
+	cpool.opts = (*opts);
+	cpool.opts.min_threads = MAX(1, MIN(opts->min_threads, opts->max_threads));
+	if (0 == cpool.opts.idle_timeout) {
+		cpool.opts.idle_timeout = CUSE_POOL_IDLE_TIMEOUT;
+	}
+	if (0 == cpool.opts.rt_threads) {
+		cpool.opts.rt_threads = cpool.opts.min_threads;
+	}
+	/* No SA_RESTART: signal must interrupt wait for request. */
+	memset(&sa, 0x00, sizeof(sa));
+	sa.sa_handler = cuse_pool_wake_handler;
+	sigemptyset(&sa.sa_mask);
+	if (0 != sigaction(CUSE_POOL_WAKE_SIG, &sa, NULL)) {
+		error = errno;
+		goto err_out;
+	}
+#ifdef CUSE_POOL_AFFINITY
+	if (NULL != opts->cpus) {
+		error = cuse_pool_cpus_parse(opts->cpus, &cpool.cpus);
+		if (0 != error)
+			goto err_out;
+		cpool.cpus_set = 1;
+	}
+#else
+	if (NULL != opts->cpus) {
+		error = EOPNOTSUPP;
+		goto err_out;
+	}
+#endif
+	pthread_condattr_init(&cattr);
+	pthread_condattr_setclock(&cattr, CLOCK_MONOTONIC);
+	error = pthread_cond_init(&cpool.cond, &cattr);
+	pthread_condattr_destroy(&cattr);
+	if (0 != error)
+		goto err_out;
+	cpool.spare_time = cuse_pool_time_get();
+	for (size_t i = 0; i < cpool.opts.min_threads; i ++) {
+		error = cuse_pool_worker_add();
+		if (0 != error)
+			goto err_out;
+	}
+	error = pthread_create(&td, NULL, cuse_pool_manager_proc, NULL);
+	if (0 != error)
+		goto err_out;
+	pthread_detach(td);
+
+err_out:
+	pthread_mutex_unlock(&cpool.mtx);
+
+	return (error);
+}
+
+void
+cuse_pool_stats_get(cuse_pool_stats_p stats) {
+
+	if (NULL == stats)
+		return;
+	pthread_mutex_lock(&cpool.mtx);
+	stats->threads = cpool.threads;
+	stats->busy = cpool.busy;
+	stats->busy_max = cpool.busy_max;
+	stats->requests = cpool.requests;
+	stats->spawned = cpool.spawned;
+	stats->exited = cpool.exited;
+	pthread_mutex_unlock(&cpool.mtx);
+}
+
+void
+cuse_pool_stats_log(void) {
+	cuse_pool_stats_t st;
+
+	cuse_pool_stats_get(&st);
+	syslog(LOG_INFO, "CUSE pool: workers: %zu, busy: %zu, busy max: %zu, "
+	    "requests: %"PRIu64", spawned: %"PRIu64", exited: %"PRIu64,
+	    st.threads, st.busy, st.busy_max, st.requests, st.spawned,
+	    st.exited);
+}
@@ -0,0 +1,77 @@
+/*-
+ * Copyright (c) 2024-2025 Rozhuk Ivan <rozhuk.im@gmail.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE REGENTS AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE REGENTS OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ * Author: Rozhuk Ivan <rozhuk.im@gmail.com>
+ *
+ */
+
+#ifndef __CUSE_POOL_H__
+#define __CUSE_POOL_H__
+
+#include <sys/param.h>
+#include <sys/types.h>
+#include <inttypes.h>
+#include <cuse.h>
+
+
+typedef struct cuse_pool_options_s {
+	size_t		min_threads; /* Always running workers. */
+	size_t		max_threads;
+	uint32_t	idle_timeout; /* Seconds before extra idle workers exit, 0 - default. */
+	const char	*cpus; /* Workers CPU affinity: "0,2-3", NULL - any. */
+	int		rt_prio; /* SCHED_FIFO priority, 0 - disabled. */
+	size_t		rt_threads; /* Workers with cpus and rt_prio, 0 - min_threads. */
+} cuse_pool_options_t, *cuse_pool_options_p;
+
+typedef struct cuse_pool_stats_s {
+	size_t		threads; /* Running workers. */
+	size_t		busy; /* Workers that handle request now. */
+	size_t		busy_max; /* Peak of busy. */
+	uint64_t	requests; /* Handled requests. */
+	uint64_t	spawned; /* Created workers. */
+	uint64_t	exited; /* Workers exited on idle. */
+} cuse_pool_stats_t, *cuse_pool_stats_p;
+
+
+/* Return methods table that track workers load and call methods.
+ * Only one methods table per process is tracked, for other
+ * methods is returned as is. */
+const struct cuse_methods *
+cuse_pool_methods(const struct cuse_methods *methods);
+
+/* Start min_threads workers and pool manager thread.
+ * Call after cuse_init() and devices create.
+ * SIGUSR2 is used to wake up idle workers to exit. */
+int
+cuse_pool_start(cuse_pool_options_p opts);
+
+void
+cuse_pool_stats_get(cuse_pool_stats_p stats);
+/* Write pool statistics to syslog. */
+void
+cuse_pool_stats_log(void);
+
+
+#endif /* __CUSE_POOL_H__ */
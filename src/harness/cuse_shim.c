@@ -0,0 +1,294 @@
+/*-
+ * Copyright (c) 2024-2025 Rozhuk Ivan <rozhuk.im@gmail.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE REGENTS AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE REGENTS OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ * Author: Rozhuk Ivan <rozhuk.im@gmail.com>
+ *
+ */
+
+/*
+ * libcuse replacement: device methods are called directly from harness
+ * threads, "user" memory is process memory.
+ */
+
+#include <sys/param.h>
+#include <sys/types.h>
+
+#include <inttypes.h>
+#include <stdlib.h> /* malloc, exit */
+#include <stdio.h> /* snprintf, fprintf */
+#include <string.h> /* bcopy, bzero, memcpy, memmove, memset, strerror... */
+#include <stdarg.h>
+#include <unistd.h> /* sleep */
+#include <errno.h>
+#include <cuse.h>
+
+#include "cuse_shim.h"
+
+
+struct cuse_dev {
+	const struct cuse_methods *methods;
+	void		*priv0;
+	void		*priv1;
+	char		name[64];
+};
+
+/* File that current thread work with. */
+static _Thread_local cuse_shim_file_p cuse_shim_cur = NULL;
+
+
+int
+cuse_init(void) {
+
+	return (0);
+}
+
+int
+cuse_uninit(void) {
+
+	return (0);
+}
+
+void *
+cuse_vmalloc(int size) {
+
+	if (0 >= size)
+		return (NULL);
+	return (calloc(1, (size_t)size));
+}
+
+int
+cuse_is_vmalloc_addr(void *ptr __unused) {
+
+	return (0);
+}
+
+void
+cuse_vmfree(void *ptr) {
+
+	free(ptr);
+}
+
+unsigned long
+cuse_vmoffset(void *ptr __unused) {
+
+	return (0); /* Can not be mapped by peer. */
+}
+
+struct cuse_dev *
+cuse_dev_create(const struct cuse_methods *methods, void *priv0, void *priv1,
+    uid_t uid __unused, gid_t gid __unused, int mode __unused,
+    const char *fmt, ...) {
+	struct cuse_dev *pdev;
+	va_list ap;
+
+	if (NULL == methods)
+		return (NULL);
+	pdev = calloc(1, sizeof(struct cuse_dev));
+	if (NULL == pdev)
+		return (NULL);
+	pdev->methods = methods;
+	pdev->priv0 = priv0;
+	pdev->priv1 = priv1;
+	va_start(ap, fmt);
+	vsnprintf(pdev->name, sizeof(pdev->name), fmt, ap);
+	va_end(ap);
+
+	return (pdev);
+}
+
+void
+cuse_dev_destroy(struct cuse_dev *pdev) {
+
+	free(pdev);
+}
+
+void *
+cuse_dev_get_priv0(struct cuse_dev *pdev) {
+
+	return (pdev->priv0);
+}
+
+void *
+cuse_dev_get_priv1(struct cuse_dev *pdev) {
+
+	return (pdev->priv1);
+}
+
+void
+cuse_dev_set_priv0(struct cuse_dev *pdev, void *priv) {
+
+	pdev->priv0 = priv;
+}
+
+void
+cuse_dev_set_priv1(struct cuse_dev *pdev, void *priv) {
+
+	pdev->priv1 = priv;
+}
+
+int
+cuse_wait_and_process(void) {
+
+	sleep(1); /* No requests from kernel. */
+	return (0);
+}
+
+void
+cuse_dev_set_per_file_handle(struct cuse_dev *pdev __unused, void *handle) {
+
+	if (NULL == cuse_shim_cur)
+		return;
+	cuse_shim_cur->handle = handle;
+}
+
+void *
+cuse_dev_get_per_file_handle(struct cuse_dev *pdev __unused) {
+
+	if (NULL == cuse_shim_cur)
+		return (NULL);
+	return (cuse_shim_cur->handle);
+}
+
+int
+cuse_copy_out(const void *src, void *user_dst, int len) {
+
+	if (0 > len)
+		return (CUSE_ERR_INVALID);
+	memcpy(user_dst, src, (size_t)len);
+	return (0);
+}
+
+int
+cuse_copy_in(const void *user_src, void *dst, int len) {
+
+	if (0 > len)
+		return (CUSE_ERR_INVALID);
+	memcpy(dst, user_src, (size_t)len);
+	return (0);
+}
+
+int
+cuse_got_peer_signal(void) {
+
+	return (-1); /* No signal. */
+}
+
+void
+cuse_poll_wakeup(void) {
+}
+
+
+int
+cuse_shim_open(struct cuse_dev *pdev, int fflags, cuse_shim_file_p file) {
+	int error;
+
+	if (NULL == pdev || NULL == file)
+		return (CUSE_ERR_INVALID);
+	memset(file, 0x00, sizeof(cuse_shim_file_t));
+	file->pdev = pdev;
+	file->fflags = fflags;
+	if (NULL == pdev->methods->cm_open)
+		return (0);
+	cuse_shim_cur = file;
+	error = pdev->methods->cm_open(pdev, fflags);
+	cuse_shim_cur = NULL;
+
+	return (error);
+}
+
+int
+cuse_shim_close(cuse_shim_file_p file) {
+	int error;
+
+	if (NULL == file || NULL == file->pdev)
+		return (CUSE_ERR_INVALID);
+	if (NULL == file->pdev->methods->cm_close)
+		return (0);
+	cuse_shim_cur = file;
+	error = file->pdev->methods->cm_close(file->pdev, file->fflags);
+	cuse_shim_cur = NULL;
+
+	return (error);
+}
+
+int
+cuse_shim_read(cuse_shim_file_p file, void *buf, int len) {
+	int ret;
+
+	if (NULL == file || NULL == file->pdev)
+		return (CUSE_ERR_INVALID);
+	if (NULL == file->pdev->methods->cm_read)
+		return (CUSE_ERR_INVALID);
+	cuse_shim_cur = file;
+	ret = file->pdev->methods->cm_read(file->pdev, file->fflags, buf, len);
+	cuse_shim_cur = NULL;
+
+	return (ret);
+}
+
+int
+cuse_shim_write(cuse_shim_file_p file, const void *buf, int len) {
+	int ret;
+
+	if (NULL == file || NULL == file->pdev)
+		return (CUSE_ERR_INVALID);
+	if (NULL == file->pdev->methods->cm_write)
+		return (CUSE_ERR_INVALID);
+	cuse_shim_cur = file;
+	ret = file->pdev->methods->cm_write(file->pdev, file->fflags, buf, len);
+	cuse_shim_cur = NULL;
+
+	return (ret);
+}
+
+int
+cuse_shim_ioctl(cuse_shim_file_p file, unsigned long cmd, void *data) {
+	int ret;
+
+	if (NULL == file || NULL == file->pdev)
+		return (CUSE_ERR_INVALID);
+	if (NULL == file->pdev->methods->cm_ioctl)
+		return (CUSE_ERR_INVALID);
+	cuse_shim_cur = file;
+	ret = file->pdev->methods->cm_ioctl(file->pdev, file->fflags, cmd, data);
+	cuse_shim_cur = NULL;
+
+	return (ret);
+}
+
+int
+cuse_shim_poll(cuse_shim_file_p file, int events) {
+	int ret;
+
+	if (NULL == file || NULL == file->pdev)
+		return (CUSE_POLL_ERROR);
+	if (NULL == file->pdev->methods->cm_poll)
+		return (CUSE_POLL_NONE);
+	cuse_shim_cur = file;
+	ret = file->pdev->methods->cm_poll(file->pdev, file->fflags, events);
+	cuse_shim_cur = NULL;
+
+	return (ret);
+}
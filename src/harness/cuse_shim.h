@@ -0,0 +1,61 @@
+/*-
+ * Copyright (c) 2024-2025 Rozhuk Ivan <rozhuk.im@gmail.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE REGENTS AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE REGENTS OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ * Author: Rozhuk Ivan <rozhuk.im@gmail.com>
+ *
+ */
+
+#ifndef __CUSE_SHIM_H__
+#define __CUSE_SHIM_H__
+
+#include <sys/param.h>
+#include <sys/types.h>
+#include <inttypes.h>
+#include <cuse.h>
+
+
+/* Opened file: calls device methods like CUSE do for peer fd. */
+typedef struct cuse_shim_file_s {
+	struct cuse_dev	*pdev;
+	void		*handle; /* Per file handle, set by device. */
+	int		fflags;
+} cuse_shim_file_t, *cuse_shim_file_p;
+
+
+int
+cuse_shim_open(struct cuse_dev *pdev, int fflags, cuse_shim_file_p file);
+int
+cuse_shim_close(cuse_shim_file_p file);
+int
+cuse_shim_read(cuse_shim_file_p file, void *buf, int len);
+int
+cuse_shim_write(cuse_shim_file_p file, const void *buf, int len);
+int
+cuse_shim_ioctl(cuse_shim_file_p file, unsigned long cmd, void *data);
+int
+cuse_shim_poll(cuse_shim_file_p file, int events);
+
+
+#endif /* __CUSE_SHIM_H__ */
@@ -0,0 +1,360 @@
+/*-
+ * Copyright (c) 2024-2025 Rozhuk Ivan <rozhuk.im@gmail.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE REGENTS AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE REGENTS OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ * Author: Rozhuk Ivan <rozhuk.im@gmail.com>
+ *
+ */
+
+/*
+ * Call device methods directly from many threads, without kernel CUSE
+ * module and audio hardware.  Build with -DENABLE_HARNESS=ON.
+ */
+
+#include <sys/param.h>
+#include <sys/types.h>
+
+#include <inttypes.h>
+#include <stdlib.h> /* malloc, exit */
+#include <stdio.h> /* snprintf, fprintf */
+#include <string.h> /* bcopy, bzero, memcpy, memmove, memset, strerror... */
+#include <errno.h>
+#include <err.h>
+#include <sysexits.h>
+#include <time.h>
+#include <pthread.h>
+#include <getopt.h>
+#include <cuse.h>
+
+#include "cuse_shim.h"
+#include "midi_event.h"
+#include "sys_utils.h"
+#if defined(HARNESS_MIDI)
+#	include "dev_midi.h"
+#	define HARNESS_NAME		"harness_midi"
+#	define HARNESS_EVT_SIZE		3 /* Note on/off. */
+#elif defined(HARNESS_OSS_SEQUENCER)
+#	include <sys/soundcard.h>
+#	include "dev_oss_sequencer.h"
+#	define HARNESS_NAME		"harness_oss_sequencer"
+#	define HARNESS_EVT_SIZE		8 /* EV_CHN_VOICE. */
+#	define HARNESS_TICK_NS		10000000ull /* Default tempo and timebase. */
+#else
+#	error "Define HARNESS_MIDI or HARNESS_OSS_SEQUENCER"
+#endif
+
+#define HARNESS_DESCRIPTION	"Benchmark device methods without CUSE"
+#define HARNESS_WRITE_SZ	4096
+
+
+typedef struct command_line_options_s {
+	int		threads;
+	int		count; /* Events per thread. */
+	const char	*odrv;
+	const char	*odev;
+	const char	*soundfont;
+	const char	*prefix;
+	uint32_t	wait; /* Ticks after each note on. */
+	int		sim_clock;
+} cmd_opts_t, *cmd_opts_p;
+
+typedef struct harness_thread_s {
+	pthread_t	td;
+	struct cuse_dev	*pdev;
+	size_t		count;
+	uint64_t	bytes; /* Accepted by write(). */
+	uint64_t	events; /* Note on/off fully written. */
+	int		error;
+} harness_thread_t, *harness_thread_p;
+
+
+static struct option long_options[] = {
+	{ "help",	no_argument,		NULL,	'?'	},
+	{ "threads",	required_argument,	NULL,	't'	},
+	{ "count",	required_argument,	NULL,	'n'	},
+	{ "odrv",	required_argument,	NULL,	'o'	},
+	{ "odev",	required_argument,	NULL,	'O'	},
+	{ "soundfont",	required_argument,	NULL,	's'	},
+	{ "prefix",	required_argument,	NULL,	'P'	},
+	{ "wait",	required_argument,	NULL,	'w'	},
+	{ "simclock",	no_argument,		NULL,	'S'	},
+	{ NULL,		0,			NULL,	0	}
+};
+
+static const char *long_options_descr[] = {
+	"				Show help",
+	"<threads>			Writer threads, each open own fd. Default: 4",
+	"<count>			Events per thread. Default: 100000",
+	"<output_driver_name>		virtual_midi: output driver name. Default: file",
+	"<output_device_name>		virtual_midi: output device name. Default: /dev/null",
+	"<soundfont>		virtual_midi: soundfont file. Default: none",
+	"<out_device_name_prefix>	virtual_oss_sequencer: output devices name prefix. Default: null",
+	"<ticks>			virtual_oss_sequencer: TMR_WAIT_REL after each note on, 1 tick = 10 ms. Default: 0",
+	"				virtual_oss_sequencer: simulated clock, waits end instantly",
+	NULL
+};
+
+
+static int
+cmd_opts_parse(int argc, char **argv, struct option *opts,
+    cmd_opts_p cmd_opts) {
+	int ch, opt_idx;
+
+	memset(cmd_opts, 0x00, sizeof(cmd_opts_t));
+	cmd_opts->threads = 4;
+	cmd_opts->count = 100000;
+	cmd_opts->odrv = "file";
+	cmd_opts->odev = "/dev/null";
+	cmd_opts->prefix = "null";
+
+	opt_idx = -1;
+	while ((ch = getopt_long_only(argc, argv, "?t:n:o:O:s:P:w:S", opts,
+	    &opt_idx)) != -1) {
+		switch (ch) {
+		case 't':
+			cmd_opts->threads = atoi(optarg);
+			break;
+		case 'n':
+			cmd_opts->count = atoi(optarg);
+			break;
+		case 'o':
+			cmd_opts->odrv = optarg;
+			break;
+		case 'O':
+			cmd_opts->odev = optarg;
+			break;
+		case 's':
+			cmd_opts->soundfont = optarg;
+			break;
+		case 'P':
+			cmd_opts->prefix = optarg;
+			break;
+		case 'w':
+			cmd_opts->wait = (uint32_t)MAX(0, atoi(optarg));
+			break;
+		case 'S':
+			cmd_opts->sim_clock = 1;
+			break;
+		default:
+			return (EINVAL);
+		}
+	}
+	if (0 >= cmd_opts->threads || 0 >= cmd_opts->count)
+		return (EINVAL);
+
+	return (0);
+}
+
+
+static uint32_t harness_wait = 0;
+
+#if defined(HARNESS_OSS_SEQUENCER)
+/* Output devices writes time range, fd clock. */
+static pthread_mutex_t harness_emit_mtx = PTHREAD_MUTEX_INITIALIZER;
+static uint64_t harness_emit_first = 0;
+static uint64_t harness_emit_last = 0;
+
+static void
+harness_emit_cb(void *udata __unused, const uint64_t time,
+    const char *dev_name __unused, const uint8_t *buf __unused,
+    const size_t size __unused) {
+
+	pthread_mutex_lock(&harness_emit_mtx);
+	if (0 == harness_emit_first || time < harness_emit_first) {
+		harness_emit_first = time;
+	}
+	if (time > harness_emit_last) {
+		harness_emit_last = time;
+	}
+	pthread_mutex_unlock(&harness_emit_mtx);
+}
+#endif
+
+/* Fill buf with note on/off events up to count, return used size. */
+static size_t
+harness_events_gen(uint8_t *buf, size_t buf_size, size_t *idx,
+    const size_t count) {
+	size_t off = 0;
+	uint8_t chan, note, type;
+
+	for (; (*idx) < count &&
+	    (off + (2 * HARNESS_EVT_SIZE)) <= buf_size; (*idx) ++) {
+		chan = (uint8_t)((*idx) & 0x0f);
+		note = (uint8_t)(36 + (((*idx) >> 1) % 48));
+		type = ((0 == ((*idx) & 0x01)) ? MIDI_NOTEON : MIDI_NOTEOFF);
+#if defined(HARNESS_MIDI)
+		buf[off ++] = (type | chan);
+		buf[off ++] = note;
+		buf[off ++] = 100;
+#else
+		buf[off ++] = EV_CHN_VOICE;
+		buf[off ++] = 0; /* dev */
+		buf[off ++] = type;
+		buf[off ++] = chan;
+		buf[off ++] = note;
+		buf[off ++] = 100;
+		buf[off ++] = 0;
+		buf[off ++] = 0;
+		if (0 == harness_wait || MIDI_NOTEON != type)
+			continue;
+		buf[off ++] = EV_TIMING;
+		buf[off ++] = TMR_WAIT_REL;
+		buf[off ++] = 0;
+		buf[off ++] = 0;
+		memcpy(&buf[off], &harness_wait, sizeof(harness_wait));
+		off += sizeof(harness_wait);
+#endif
+	}
+
+	return (off);
+}
+
+static void *
+harness_thread_proc(void *arg) {
+	harness_thread_p ht = arg;
+	cuse_shim_file_t file;
+	uint8_t buf[HARNESS_WRITE_SZ];
+	size_t idx = 0, idx_prev, buf_size;
+	int rc;
+
+	ht->error = cuse_shim_open(ht->pdev,
+	    (CUSE_FFLAG_READ | CUSE_FFLAG_WRITE), &file);
+	if (0 != ht->error)
+		return (NULL);
+	while (idx < ht->count) {
+		idx_prev = idx;
+		buf_size = harness_events_gen(buf, sizeof(buf), &idx,
+		    ht->count);
+		for (size_t off = 0; off < buf_size; off += (size_t)rc) {
+			rc = cuse_shim_write(&file, &buf[off],
+			    (int)(buf_size - off));
+			if (0 > rc) {
+				ht->error = rc;
+				goto out;
+			}
+			ht->bytes += (uint64_t)rc;
+		}
+		/* Waits are not counted: only note on/off. */
+		ht->events += (uint64_t)(idx - idx_prev);
+	}
+out:
+	cuse_shim_close(&file);
+
+	return (NULL);
+}
+
+
+int
+main(int argc, char **argv) {
+	int error;
+	cmd_opts_t cmd_opts;
+	struct cuse_dev *pdev;
+	harness_thread_p ht;
+	uint64_t bytes = 0, events = 0;
+	double tm;
+	struct timespec ts_start, ts_end;
+#if defined(HARNESS_MIDI)
+	vmb_options_t vmb_opts;
+	vm_dev_options_t dev_opts;
+#else
+	vm_seq_dev_options_t dev_opts;
+#endif
+
+	error = cmd_opts_parse(argc, argv, long_options, &cmd_opts);
+	if (0 != error) {
+		print_usage(argv[0], HARNESS_NAME, HARNESS_DESCRIPTION,
+		    long_options, long_options_descr);
+		return (error);
+	}
+
+#if defined(HARNESS_MIDI)
+	memset(&vmb_opts, 0x00, sizeof(vmb_options_t));
+	vmb_opts.driver = cmd_opts.odrv;
+	vmb_opts.device = cmd_opts.odev;
+	vmb_opts.soundfont = cmd_opts.soundfont;
+	memset(&dev_opts, 0x00, sizeof(vm_dev_options_t));
+	pdev = vm_dev_midi_create("midi", &vmb_opts, &dev_opts);
+#else
+	harness_wait = cmd_opts.wait;
+	memset(&dev_opts, 0x00, sizeof(vm_seq_dev_options_t));
+	dev_opts.sim_clock = cmd_opts.sim_clock;
+	dev_opts.emit_cb = harness_emit_cb;
+	pdev = vm_dev_oss_sequencer_create("sequencer", &cmd_opts.prefix, 1,
+	    &dev_opts);
+#endif
+	if (NULL == pdev) {
+		errx(EX_SOFTWARE, "Could not create device - %i: %s",
+		    errno, strerror(errno));
+	}
+
+	ht = calloc((size_t)cmd_opts.threads, sizeof(harness_thread_t));
+	if (NULL == ht) {
+		errx(EX_OSERR, "Could not allocate memory.");
+	}
+	clock_gettime(CLOCK_MONOTONIC, &ts_start);
+	for (int i = 0; i < cmd_opts.threads; i ++) {
+		ht[i].pdev = pdev;
+		ht[i].count = (size_t)cmd_opts.count;
+		if (0 != pthread_create(&ht[i].td, NULL, harness_thread_proc,
+		    &ht[i])) {
+			errx(EX_OSERR, "Could not create thread.");
+		}
+	}
+	for (int i = 0; i < cmd_opts.threads; i ++) {
+		pthread_join(ht[i].td, NULL);
+		bytes += ht[i].bytes;
+		events += ht[i].events;
+		if (0 != ht[i].error) {
+			fprintf(stderr, "Thread %i: error: %i\n", i, ht[i].error);
+			error = -1;
+		}
+	}
+	clock_gettime(CLOCK_MONOTONIC, &ts_end);
+	timespecsub(&ts_end, &ts_start, &ts_end);
+	tm = ((double)ts_end.tv_sec + ((double)ts_end.tv_nsec / 1000000000.0));
+
+	fprintf(stdout, "%s: threads: %i, bytes: %"PRIu64", events: %"PRIu64", "
+	    "time: %.3f s, %.0f events/s\n",
+	    HARNESS_NAME, cmd_opts.threads, bytes,
+	    events, tm, ((0.0 < tm) ? ((double)events / tm) : 0.0));
+#if defined(HARNESS_OSS_SEQUENCER)
+	if (0 != harness_wait) { /* Song time by fd clock. */
+		fprintf(stdout, "%s: played: %.3f s, expected: %.3f s\n",
+		    HARNESS_NAME,
+		    ((double)(harness_emit_last - harness_emit_first) /
+		    1000000000.0),
+		    ((double)(((uint64_t)cmd_opts.count / 2) * harness_wait *
+		    HARNESS_TICK_NS) / 1000000000.0));
+	}
+#endif
+
+#if defined(HARNESS_MIDI)
+	vm_dev_midi_destroy(pdev);
+#else
+	vm_dev_oss_sequencer_destroy(pdev);
+#endif
+	free(ht);
+
+	return (error);
+}
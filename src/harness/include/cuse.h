@@ -0,0 +1,105 @@
+/*-
+ * Copyright (c) 2024-2025 Rozhuk Ivan <rozhuk.im@gmail.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE REGENTS AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE REGENTS OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ * Author: Rozhuk Ivan <rozhuk.im@gmail.com>
+ *
+ */
+
+/* Linux: FreeBSD libcuse API, implemented by cuse_shim.c. */
+
+#ifndef __HARNESS_CUSE_H__
+#define __HARNESS_CUSE_H__
+
+#include <sys/types.h>
+
+
+#define CUSE_ERR_NONE		0
+#define CUSE_ERR_BUSY		-1
+#define CUSE_ERR_WOULDBLOCK	-2
+#define CUSE_ERR_INVALID	-3
+#define CUSE_ERR_NO_MEMORY	-4
+#define CUSE_ERR_FAULT		-5
+#define CUSE_ERR_SIGNAL		-6
+#define CUSE_ERR_OTHER		-7
+
+#define CUSE_POLL_NONE		0
+#define CUSE_POLL_READ		1
+#define CUSE_POLL_WRITE		2
+#define CUSE_POLL_ERROR		4
+
+#define CUSE_FFLAG_NONE		0
+#define CUSE_FFLAG_READ		1
+#define CUSE_FFLAG_WRITE	2
+#define CUSE_FFLAG_NONBLOCK	4
+#define CUSE_FFLAG_COMPAT32	8
+
+struct cuse_dev;
+
+typedef int (cuse_open_t)(struct cuse_dev *, int fflags);
+typedef int (cuse_close_t)(struct cuse_dev *, int fflags);
+typedef int (cuse_read_t)(struct cuse_dev *, int fflags, void *user_ptr, int len);
+typedef int (cuse_write_t)(struct cuse_dev *, int fflags, const void *user_ptr, int len);
+typedef int (cuse_ioctl_t)(struct cuse_dev *, int fflags, unsigned long cmd, void *user_data);
+typedef int (cuse_poll_t)(struct cuse_dev *, int fflags, int events);
+
+struct cuse_methods {
+	cuse_open_t	*cm_open;
+	cuse_close_t	*cm_close;
+	cuse_read_t	*cm_read;
+	cuse_write_t	*cm_write;
+	cuse_ioctl_t	*cm_ioctl;
+	cuse_poll_t	*cm_poll;
+};
+
+
+int	cuse_init(void);
+int	cuse_uninit(void);
+
+void	*cuse_vmalloc(int);
+int	cuse_is_vmalloc_addr(void *);
+void	cuse_vmfree(void *);
+unsigned long cuse_vmoffset(void *ptr);
+
+struct cuse_dev *cuse_dev_create(const struct cuse_methods *, void *, void *,
+	    uid_t, gid_t, int, const char *, ...);
+void	cuse_dev_destroy(struct cuse_dev *);
+
+void	*cuse_dev_get_priv0(struct cuse_dev *);
+void	*cuse_dev_get_priv1(struct cuse_dev *);
+void	cuse_dev_set_priv0(struct cuse_dev *, void *);
+void	cuse_dev_set_priv1(struct cuse_dev *, void *);
+
+int	cuse_wait_and_process(void);
+
+void	cuse_dev_set_per_file_handle(struct cuse_dev *, void *);
+void	*cuse_dev_get_per_file_handle(struct cuse_dev *);
+
+int	cuse_copy_out(const void *src, void *user_dst, int len);
+int	cuse_copy_in(const void *user_src, void *dst, int len);
+int	cuse_got_peer_signal(void);
+void	cuse_poll_wakeup(void);
+
+
+#endif /* __HARNESS_CUSE_H__ */
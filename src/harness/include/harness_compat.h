@@ -0,0 +1,113 @@
+/*-
+ * Copyright (c) 2024-2025 Rozhuk Ivan <rozhuk.im@gmail.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE REGENTS AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE REGENTS OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ * Author: Rozhuk Ivan <rozhuk.im@gmail.com>
+ *
+ */
+
+/* Linux: BSD definitions used by sources, force included by harness build. */
+
+#ifndef __HARNESS_COMPAT_H__
+#define __HARNESS_COMPAT_H__
+
+#ifndef _GNU_SOURCE
+#	define _GNU_SOURCE	1
+#endif
+
+#include <sys/param.h>
+#include <sys/types.h>
+#include <sys/ioctl.h>
+#include <string.h>
+#include <time.h>
+
+
+#ifndef __unused
+#	define __unused		__attribute__((unused))
+#endif
+#ifndef __aligned
+#	define __aligned(x)	__attribute__((aligned(x)))
+#endif
+#ifndef roundup2
+#	define roundup2(x, y)	(((x) + ((y) - 1)) & (~((y) - 1)))
+#endif
+
+#ifndef timespecisset
+#define timespecisset(tvp)	((tvp)->tv_sec || (tvp)->tv_nsec)
+#define timespecclear(tvp)	((tvp)->tv_sec = (tvp)->tv_nsec = 0)
+#define timespecadd(tsp, usp, vsp) do {					\
+	(vsp)->tv_sec = ((tsp)->tv_sec + (usp)->tv_sec);		\
+	(vsp)->tv_nsec = ((tsp)->tv_nsec + (usp)->tv_nsec);		\
+	if (1000000000L <= (vsp)->tv_nsec) {				\
+		(vsp)->tv_sec ++;					\
+		(vsp)->tv_nsec -= 1000000000L;				\
+	}								\
+} while (0)
+#define timespecsub(tsp, usp, vsp) do {					\
+	(vsp)->tv_sec = ((tsp)->tv_sec - (usp)->tv_sec);		\
+	(vsp)->tv_nsec = ((tsp)->tv_nsec - (usp)->tv_nsec);		\
+	if (0 > (vsp)->tv_nsec) {					\
+		(vsp)->tv_sec --;					\
+		(vsp)->tv_nsec += 1000000000L;				\
+	}								\
+} while (0)
+#define timespeccmp(tvp, uvp, cmp)					\
+	(((tvp)->tv_sec == (uvp)->tv_sec) ?				\
+	    ((tvp)->tv_nsec cmp (uvp)->tv_nsec) :			\
+	    ((tvp)->tv_sec cmp (uvp)->tv_sec))
+#endif
+
+/* ioctl() command encoding. */
+#ifndef IOCPARM_LEN
+#	define IOCPARM_LEN(x)	_IOC_SIZE(x)
+#	define IOC_IN		(_IOC_WRITE << _IOC_DIRSHIFT)
+#	define IOC_OUT		(_IOC_READ << _IOC_DIRSHIFT)
+#endif
+#ifndef FIONWRITE
+#	define FIONWRITE	_IOR('f', 119, int)
+#endif
+#ifndef FIONSPACE
+#	define FIONSPACE	_IOR('f', 118, int)
+#endif
+#ifndef FWRITE
+#	define FWRITE		0x0002
+#endif
+
+#if !defined(__GLIBC__) || !__GLIBC_PREREQ(2, 38)
+static inline size_t
+strlcpy(char *dst, const char *src, size_t size) {
+	size_t len = strlen(src);
+
+	if (0 != size) {
+		size --;
+		size = ((len < size) ? len : size);
+		memcpy(dst, src, size);
+		dst[size] = 0;
+	}
+	return (len);
+}
+#endif
+
+
+#endif /* __HARNESS_COMPAT_H__ */
@@ -31,6 +31,8 @@
 #include <sys/types.h>
 
 #include <inttypes.h>
+#include <stddef.h> /* offsetof */
+#include <stdlib.h> /* strtoul */
 #include <string.h> /* bcopy, bzero, memcpy, memmove, memset, strerror... */
 #include <errno.h>
 
@@ -74,6 +76,14 @@ static const size_t midi_systype2len_tbl[16] = {
 #define MIDI_SYSTYPE2LEN(_b)	(midi_systype2len_tbl[(_b) & 0x0F])
 
 
+size_t
+vm_event_status_data_len(const uint8_t status) {
+
+	if (MIDI_SYSEX > status)
+		return (MIDI_TYPE2LEN(status));
+	return (MIDI_SYSTYPE2LEN(status));
+}
+
 int
 vm_event_sysex_data_chk(const uint8_t *buf, const size_t buf_size) {
 
@@ -86,6 +96,87 @@ vm_event_sysex_data_chk(const uint8_t *buf, const size_t buf_size) {
 	return (0);
 }
 
+void
+vm_event_filter_init(vm_evt_filter_p filter, const int accept) {
+
+	if (NULL == filter)
+		return;
+	memset(filter, ((0 != accept) ? 0xFF : 0x00), sizeof(vm_evt_filter_t));
+}
+
+void
+vm_event_filter_set(vm_evt_filter_p filter, const uint8_t first,
+    const uint8_t last, const int accept) {
+
+	if (NULL == filter)
+		return;
+	for (size_t i = first; i <= last; i ++) {
+		if (0 != accept) {
+			filter->bits[VM_EVT_FILTER_IDX(i)] |= VM_EVT_FILTER_BIT(i);
+		} else {
+			filter->bits[VM_EVT_FILTER_IDX(i)] &= ~VM_EVT_FILTER_BIT(i);
+		}
+	}
+}
+
+int
+vm_event_filter_parse(vm_evt_filter_p filter, const char *str) {
+	int accept;
+	unsigned long first, last;
+	char *end;
+
+	if (NULL == filter || NULL == str)
+		return (EINVAL);
+
+	while (0 != str[0]) {
+		accept = 1;
+		switch (str[0]) {
+		case '-':
+			accept = 0;
+			__attribute__((fallthrough)); /* PASSTROUTH. */
+		case '+':
+			str ++;
+			break;
+		}
+		first = strtoul(str, &end, 16);
+		if (str == end || 0xFF < first)
+			return (EINVAL);
+		last = first;
+		if ('-' == end[0]) {
+			str = (end + 1);
+			last = strtoul(str, &end, 16);
+			if (str == end || 0xFF < last || first > last)
+				return (EINVAL);
+		}
+		switch (end[0]) {
+		case ',':
+			end ++;
+			break;
+		case 0:
+			break;
+		default:
+			return (EINVAL);
+		}
+		vm_event_filter_set(filter, (uint8_t)first, (uint8_t)last, accept);
+		str = end;
+	}
+
+	return (0);
+}
+
+void
+vm_event_parser_init(vm_ep_p ep, const vm_evt_filter_p filter) {
+
+	if (NULL == ep)
+		return;
+	memset(ep, 0x00, offsetof(vm_ep_t, data));
+	if (NULL == filter) {
+		vm_event_filter_init(&ep->filter, 1);
+	} else {
+		memcpy(&ep->filter, filter, sizeof(vm_evt_filter_t));
+	}
+}
+
 vm_evt_p
 vm_event_parse(vm_ep_p ep, const uint8_t c) {
 	vm_evt_p evt = NULL;
@@ -94,6 +185,10 @@ vm_event_parse(vm_ep_p ep, const uint8_t c) {
 	if (0x80 & c) {
 		/* 0xF8-0xFF: Real-time message. */
 		if (0xF8 <= c) {
+			/* Filtered out real-time message does not break
+			 * incomplete event. */
+			if (!VM_EVT_FILTER_ISSET(&ep->filter, c))
+				return (NULL);
 flush_sys_event:
 			ep->type = 0; /* Drop prev incomplete event. */
 			memset(&ep->event, 0x00, sizeof(ep->event));
@@ -112,6 +207,10 @@ flush_sys_event:
 		}
 		/* Restart parser. */
 		ep->data_used = 0; /* Mark buffer as empty. */
+		if (!VM_EVT_FILTER_ISSET(&ep->filter, c)) {
+			ep->type = 0; /* Discard event and its data bytes. */
+			return (evt);
+		}
 		if (MIDI_SYSEX > c) { /* 0x80 <= c < 0xF0: Channel messages. */
 			ep->type = (0xF0 & c);
 			ep->chan = (0x0F & c);
@@ -140,7 +239,7 @@ flush_sys_event:
 	}
 
 	/* Data/parameter byte.
-	 * All bytes here without hi bit set: & 0xF7 masked. */
+	 * All bytes here without hi bit set: & 0x7F masked. */
 
 	/* Discard data bytes for events we don't care about */
 	if (0 == ep->type)
@@ -193,6 +292,230 @@ flush_sys_event:
 }
 
 
+void
+vm_event_aggregator_init(vm_eagg_p agg, const int passthrough) {
+
+	if (NULL == agg)
+		return;
+	memset(agg, 0x00, sizeof(vm_eagg_t));
+	agg->passthrough = passthrough;
+}
+
+static void
+vm_event_aggregate_param(vm_eagg_chan_p ch, const uint8_t chan,
+    vm_evt_p out) {
+
+	memset(out, 0x00, sizeof(vm_evt_t));
+	out->type = ch->param_type;
+	out->chan = chan;
+	out->p1 = ch->param;
+	out->p2 = ch->value;
+}
+
+/* Select parameter only: consumer apply next as is data entry to it. */
+static void
+vm_event_aggregate_select(const uint8_t type, const uint16_t param,
+    const uint8_t chan, vm_evt_p out) {
+
+	memset(out, 0x00, sizeof(vm_evt_t));
+	out->type = type;
+	out->chan = chan;
+	out->p1 = param;
+	out->p2 = VM_EVT_PARAM_SELECT;
+}
+
+size_t
+vm_event_aggregate_flush(vm_eagg_p agg, vm_evt_t out[VM_EVT_AGG_OUT_MAX]) {
+	vm_eagg_chan_p ch;
+
+	if (NULL == agg || NULL == out ||
+	    0 == agg->pending.type)
+		return (0);
+	agg->pending.type = 0;
+	ch = &agg->chan[agg->pending.chan];
+	if (MIDI_CTL_DATA_ENTRY == agg->pending.p1) {
+		/* Data entry MSB without LSB: LSB is zero. */
+		ch->value = (uint16_t)(agg->pending.p2 << 7);
+		ch->value_known = 1;
+		vm_event_aggregate_param(ch, agg->pending.chan, &out[0]);
+	} else { /* Controller MSB without LSB: return as is. */
+		memcpy(&out[0], &agg->pending, sizeof(vm_evt_t));
+		out[0].type = MIDI_CTL_CHANGE;
+	}
+
+	return (1);
+}
+
+size_t
+vm_event_aggregate(vm_eagg_p agg, const vm_evt_p evt,
+    vm_evt_t out[VM_EVT_AGG_OUT_MAX]) {
+	size_t ret = 0;
+	vm_eagg_chan_p ch;
+
+	if (NULL == agg || NULL == evt || NULL == out)
+		return (0);
+	if (0 != agg->passthrough)
+		goto out_as_is;
+
+	ch = &agg->chan[(evt->chan & 0x0F)];
+	if (0 != agg->pending.type) {
+		/* Is it LSB for pending MSB? */
+		if (MIDI_CTL_CHANGE == evt->type &&
+		    agg->pending.chan == evt->chan &&
+		    (agg->pending.p1 + MIDI_CTL_LSB_OFFSET) == evt->p1) {
+			agg->pending.type = 0;
+			if (MIDI_CTL_DATA_ENTRY == agg->pending.p1) {
+				ch->value = (uint16_t)((agg->pending.p2 << 7) | evt->p2);
+				ch->value_known = 1;
+				vm_event_aggregate_param(ch, evt->chan, &out[0]);
+			} else {
+				memset(&out[0], 0x00, sizeof(vm_evt_t));
+				out[0].type = VM_EVT_CTL_CHANGE14;
+				out[0].chan = evt->chan;
+				out[0].p1 = agg->pending.p1;
+				out[0].p2 = ((agg->pending.p2 << 7) | evt->p2);
+			}
+			return (1);
+		}
+		ret = vm_event_aggregate_flush(agg, out);
+	}
+	if (MIDI_CTL_CHANGE != evt->type)
+		goto out_as_is;
+
+	switch (evt->p1) {
+	case MIDI_CTL_NRPN_MSB: /* 99. */
+	case MIDI_CTL_RPN_MSB: /* 101. */
+		ch->param = (uint16_t)((evt->p2 << 7) | (ch->param & 0x7F));
+		goto param_select;
+	case MIDI_CTL_NRPN_LSB: /* 98. */
+	case MIDI_CTL_RPN_LSB: /* 100. */
+		ch->param = (uint16_t)((ch->param & 0x3F80) | evt->p2);
+param_select:
+		ch->param_type = ((MIDI_CTL_NRPN_MSB >= evt->p1) ?
+		    VM_EVT_NRPN : VM_EVT_RPN);
+		ch->value_known = 0;
+		if (MIDI_RPN_NULL == ch->param) {
+			/* Deselect: later data entry must not change
+			 * previous parameter in consumer. */
+			ch->param_type = 0;
+			vm_event_aggregate_select(VM_EVT_RPN, MIDI_RPN_NULL,
+			    evt->chan, &out[ret]);
+			return (ret + 1);
+		}
+		/* Parameter number is stored and returned with data. */
+		return (ret);
+	case MIDI_CTL_DATA_ENTRY: /* 6. */
+		if (0 == ch->param_type)
+			goto out_as_is;
+		goto pending_msb;
+	case MIDI_CTL_DATA_ENTRY_LSB: /* 38. */
+		if (0 == ch->param_type)
+			goto out_as_is;
+		if (0 == ch->value_known)
+			goto out_selected;
+		ch->value = (uint16_t)((ch->value & 0x3F80) | evt->p2);
+		goto out_param;
+	case MIDI_CTL_DATA_INCREMENT: /* 96. */
+		if (0 == ch->param_type)
+			goto out_as_is;
+		if (0 == ch->value_known)
+			goto out_selected;
+		if (0x3FFF > ch->value) {
+			ch->value ++;
+		}
+		goto out_param;
+	case MIDI_CTL_DATA_DECREMENT: /* 97. */
+		if (0 == ch->param_type)
+			goto out_as_is;
+		if (0 == ch->value_known)
+			goto out_selected;
+		if (0 < ch->value) {
+			ch->value --;
+		}
+out_param:
+		vm_event_aggregate_param(ch, evt->chan, &out[ret]);
+		return (ret + 1);
+	default:
+		if (MIDI_CTL_BANK_SELECT == evt->p1 ||
+		    MIDI_CTL_MSB_MAX < evt->p1)
+			goto out_as_is;
+pending_msb:
+		/* Controller MSB: wait for LSB. */
+		memcpy(&agg->pending, evt, sizeof(vm_evt_t));
+		return (ret);
+	}
+
+out_selected:
+	/* Current value is unknown: let consumer apply it. */
+	vm_event_aggregate_select(ch->param_type, ch->param, evt->chan,
+	    &out[ret]);
+	ret ++;
+out_as_is:
+	memcpy(&out[ret], evt, sizeof(vm_evt_t));
+	return (ret + 1);
+}
+
+
+static size_t
+vm_event_serialize_cc(uint8_t *buf, const uint8_t chan, const uint8_t ctl,
+    const uint32_t value) {
+
+	buf[0] = (MIDI_CTL_CHANGE | chan);
+	buf[1] = ctl;
+	buf[2] = (0x7F & value);
+
+	return (3);
+}
+
+static int
+vm_event_serialize_internal(vm_evt_p evt, uint8_t *buf, const size_t buf_size,
+    size_t *buf_size_ret) {
+	size_t off = 0;
+	uint8_t ctl_msb, ctl_lsb;
+
+	switch (evt->type) {
+	case VM_EVT_CTL_CHANGE14:
+		if (MIDI_CTL_MSB_MAX < evt->p1)
+			return (EINVAL);
+		(*buf_size_ret) = 6;
+		break;
+	case VM_EVT_RPN:
+	case VM_EVT_NRPN:
+		(*buf_size_ret) = ((VM_EVT_PARAM_SELECT == evt->p2) ? 6 : 12);
+		break;
+	default:
+		return (EINVAL);
+	}
+	if (buf_size < (*buf_size_ret)) /* Is buf space enough? */
+		return (ENOBUFS);
+
+	if (VM_EVT_CTL_CHANGE14 == evt->type) {
+		off += vm_event_serialize_cc(&buf[off], evt->chan,
+		    (uint8_t)evt->p1, (evt->p2 >> 7));
+		vm_event_serialize_cc(&buf[off], evt->chan,
+		    (uint8_t)(evt->p1 + MIDI_CTL_LSB_OFFSET), evt->p2);
+		return (0);
+	}
+	/* Parameter number select and data entry. */
+	if (VM_EVT_RPN == evt->type) {
+		ctl_msb = MIDI_CTL_RPN_MSB;
+		ctl_lsb = MIDI_CTL_RPN_LSB;
+	} else {
+		ctl_msb = MIDI_CTL_NRPN_MSB;
+		ctl_lsb = MIDI_CTL_NRPN_LSB;
+	}
+	off += vm_event_serialize_cc(&buf[off], evt->chan, ctl_msb, (evt->p1 >> 7));
+	off += vm_event_serialize_cc(&buf[off], evt->chan, ctl_lsb, evt->p1);
+	if (VM_EVT_PARAM_SELECT == evt->p2)
+		return (0);
+	off += vm_event_serialize_cc(&buf[off], evt->chan,
+	    MIDI_CTL_DATA_ENTRY, (evt->p2 >> 7));
+	vm_event_serialize_cc(&buf[off], evt->chan,
+	    MIDI_CTL_DATA_ENTRY_LSB, evt->p2);
+
+	return (0);
+}
+
 int
 vm_event_serialize(vm_evt_p evt, uint8_t *buf, const size_t buf_size,
     size_t *buf_size_ret) {
@@ -204,6 +527,9 @@ vm_event_serialize(vm_evt_p evt, uint8_t *buf, const size_t buf_size,
 	    (MIDI_SYSEX == evt->type && (NULL == evt->ex_data || 0 == evt->p1)) ||
 	    MIDI_SYSEX_EOX == evt->type)
 		return (EINVAL);
+	if (VM_EVT_IS_INTERNAL(evt->type))
+		return (vm_event_serialize_internal(evt, buf, buf_size,
+		    buf_size_ret));
 
 	/* Required buff size calculation. */
 	if (MIDI_SYSEX > evt->type) { /* 0x80 <= type < 0xF0: Channel messages. */
@@ -224,7 +550,7 @@ vm_event_serialize(vm_evt_p evt, uint8_t *buf, const size_t buf_size,
 	/* Do serialization... */
 	if (MIDI_SYSEX > evt->type) { /* 0x80 <= type < 0xF0: Channel messages. */
 		buf[0] = (evt->type | evt->chan);
-		buf[1] = (0xF7 & evt->p1);
+		buf[1] = (0x7F & evt->p1);
 		switch (evt->type) {
 		case MIDI_PGM_CHANGE: /* 0xC0. */
 		case MIDI_CHN_PRESSURE: /* 0xD0. */
@@ -232,10 +558,10 @@ vm_event_serialize(vm_evt_p evt, uint8_t *buf, const size_t buf_size,
 			break;
 		case MIDI_PITCH_BEND: /* 0xE0. */
 			/* 14-bit precision. */
-			buf[2] = (0xF7 & (evt->p1 >> 7));
+			buf[2] = (0x7F & (evt->p1 >> 7));
 			break;
 		default: /* All other types except SYSEX. */
-			buf[2] = (0xF7 & evt->p2);
+			buf[2] = (0x7F & evt->p2);
 			break;
 		}
 	} else { /* System messages. */
@@ -247,11 +573,11 @@ vm_event_serialize(vm_evt_p evt, uint8_t *buf, const size_t buf_size,
 			break;
 		case MIDI_TIME_CODE: /* 0xF1. */
 		case MIDI_SONG_SELECT: /* 0xF3. */
-			buf[1] = (0xF7 & evt->p1);
+			buf[1] = (0x7F & evt->p1);
 			break;
 		case MIDI_SONG_POSITION: /* 0xF2. */
-			buf[1] = (0xF7 & evt->p1);
-			buf[2] = (0xF7 & (evt->p1 >> 7));
+			buf[1] = (0x7F & evt->p1);
+			buf[2] = (0x7F & (evt->p1 >> 7));
 			break;
 		default: /* 0xF4+: other.*/
 			break;
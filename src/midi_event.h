@@ -72,6 +72,28 @@
 #define MIDI_ACTIVE_SENSING	0xFE
 #define MIDI_SYSTEM_RESET	0xFF
 
+/* Controllers used by aggregator. */
+#define MIDI_CTL_MSB_MAX		0x1F /* 0-31: MSB, 32-63: LSB. */
+#define MIDI_CTL_LSB_OFFSET		0x20
+#define MIDI_CTL_BANK_SELECT		0x00
+#define MIDI_CTL_DATA_ENTRY		0x06
+#define MIDI_CTL_DATA_ENTRY_LSB		0x26
+#define MIDI_CTL_DATA_INCREMENT		0x60
+#define MIDI_CTL_DATA_DECREMENT		0x61
+#define MIDI_CTL_NRPN_LSB		0x62
+#define MIDI_CTL_NRPN_MSB		0x63
+#define MIDI_CTL_RPN_LSB		0x64
+#define MIDI_CTL_RPN_MSB		0x65
+#define MIDI_RPN_NULL			0x3FFF
+
+/* Internal events types, not MIDI status bytes.
+ * Produced by aggregator, all have channel and 14-bit value in p2. */
+#define VM_EVT_CTL_CHANGE14	0x01 /* p1: MSB controller number (1-31). */
+#define VM_EVT_RPN		0x02 /* p1: RPN number (14 bit). */
+#define VM_EVT_NRPN		0x03 /* p1: NRPN number (14 bit). */
+#define VM_EVT_PARAM_SELECT	0xFFFFFFFF /* (N)RPN p2: only select p1, no data. */
+#define VM_EVT_IS_INTERNAL(_t)	(MIDI_NOTEOFF > (_t))
+
 
 typedef union midi_event_u {
 	uint8_t		u8[8];
@@ -89,19 +111,84 @@ typedef struct virt_midi_event_s {
 } vm_evt_t, *vm_evt_p;
 
 
+/* Status bytes filter: 1 bit per status byte.
+ * Set bit - parser returns events with this status byte,
+ * cleared bit - status byte and its data bytes are discarded. */
+typedef struct virt_midi_event_filter_s {
+	uint64_t	bits[4];
+} vm_evt_filter_t, *vm_evt_filter_p;
+
+#define VM_EVT_FILTER_IDX(_s)		(((_s) >> 6) & 0x03)
+#define VM_EVT_FILTER_BIT(_s)		(((uint64_t)1) << ((_s) & 0x3F))
+#define VM_EVT_FILTER_ISSET(_f, _s)					\
+	(0 != ((_f)->bits[VM_EVT_FILTER_IDX((_s))] & VM_EVT_FILTER_BIT((_s))))
+
+
 typedef struct virt_midi_event_parser_s {
 	uint8_t		type; /* MIDI event type. */
 	uint8_t		chan; /* MIDI channel. */
 	size_t		data_used; /* Number of event bytes stored in data. */
 	size_t		data_required; /* How many bytes does the current event type include? */
+	vm_evt_filter_t	filter; /* Accepted status bytes. */
 	vm_evt_t	event; /* The event, that is returned to the MIDI driver. */
 	uint8_t		data[MIDI_SYSEX_MAX_MSG_SIZE]; /* SYSEX data or p1, p2 data. */
 } vm_ep_t, *vm_ep_p;
 
 
+void
+vm_event_filter_init(vm_evt_filter_p filter, const int accept);
+void
+vm_event_filter_set(vm_evt_filter_p filter, const uint8_t first,
+    const uint8_t last, const int accept);
+/* String format: comma separated list of "[+|-]status[-status]",
+ * status is hex byte: "+F8,-A0-AF".
+ * "+" (default) - accept, "-" - discard. */
+int
+vm_event_filter_parse(vm_evt_filter_p filter, const char *str);
+
+/* filter: NULL - accept all events. */
+void
+vm_event_parser_init(vm_ep_p ep, const vm_evt_filter_p filter);
+
 vm_evt_p
 vm_event_parse(vm_ep_p ep, const uint8_t c);
 
+
+/* Aggregator: collects RPN/NRPN data entry and 14-bit controllers
+ * MSB/LSB pairs into single VM_EVT_* event.
+ * Data entry that depends on unknown current value (LSB only, increment,
+ * decrement) is returned as is after VM_EVT_PARAM_SELECT event.
+ * Controller MSB is hold until next event, so caller must call
+ * vm_event_aggregate_flush() after each processed data portion. */
+#define VM_EVT_AGG_OUT_MAX	3
+
+typedef struct virt_midi_event_aggregator_chan_s {
+	uint8_t		param_type; /* 0, VM_EVT_RPN or VM_EVT_NRPN. */
+	uint8_t		value_known; /* value set by data entry after select. */
+	uint16_t	param; /* Selected (N)RPN number. */
+	uint16_t	value; /* Last (N)RPN data entry value. */
+} vm_eagg_chan_t, *vm_eagg_chan_p;
+
+typedef struct virt_midi_event_aggregator_s {
+	int		passthrough; /* Return events as is. */
+	vm_evt_t	pending; /* Controller MSB, waiting for LSB. */
+	vm_eagg_chan_t	chan[16];
+} vm_eagg_t, *vm_eagg_p;
+
+void
+vm_event_aggregator_init(vm_eagg_p agg, const int passthrough);
+
+/* Returns number of events stored in out. */
+size_t
+vm_event_aggregate(vm_eagg_p agg, const vm_evt_p evt,
+    vm_evt_t out[VM_EVT_AGG_OUT_MAX]);
+size_t
+vm_event_aggregate_flush(vm_eagg_p agg, vm_evt_t out[VM_EVT_AGG_OUT_MAX]);
+
+/* Data bytes count after status byte, SYSEX: 0 - ends by MIDI_SYSEX_EOX. */
+size_t
+vm_event_status_data_len(const uint8_t status);
+
 int
 vm_event_sysex_data_chk(const uint8_t *buf, const size_t buf_size);
 
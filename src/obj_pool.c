@@ -0,0 +1,146 @@
+/*-
+ * Copyright (c) 2024-2025 Rozhuk Ivan <rozhuk.im@gmail.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE REGENTS AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE REGENTS OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ * Author: Rozhuk Ivan <rozhuk.im@gmail.com>
+ *
+ */
+
+
+#include <sys/param.h>
+#include <sys/types.h>
+
+#include <inttypes.h>
+#include <stdlib.h> /* malloc, exit */
+#include <string.h> /* bcopy, bzero, memcpy, memmove, memset, strerror... */
+#include <errno.h>
+#include <pthread.h>
+
+#include "obj_pool.h"
+
+
+/* Slab header takes first cache line, objects follow. */
+#define OBJ_POOL_SLAB_HDR_SZ	CACHE_LINE_SIZE
+
+typedef struct obj_pool_slab_s {
+	struct obj_pool_slab_s *next;
+} obj_pool_slab_t, *obj_pool_slab_p;
+
+/* Free object: first bytes used as list link. */
+typedef struct obj_pool_obj_s {
+	struct obj_pool_obj_s *next;
+} obj_pool_obj_t, *obj_pool_obj_p;
+
+
+/* Called with pool->mtx held. */
+static int
+obj_pool_slab_add(obj_pool_p pool) {
+	void *ptr;
+	uint8_t *objs;
+	obj_pool_slab_p slab;
+	obj_pool_obj_p obj;
+
+	if (0 != posix_memalign(&ptr, CACHE_LINE_SIZE,
+	    (OBJ_POOL_SLAB_HDR_SZ + (pool->obj_size * pool->slab_objs))))
+		return (ENOMEM);
+	slab = ptr;
+	slab->next = pool->slabs;
+	pool->slabs = slab;
+	objs = (((uint8_t*)ptr) + OBJ_POOL_SLAB_HDR_SZ);
+	for (size_t i = pool->slab_objs; 0 < i; i --) {
+		obj = (obj_pool_obj_p)(void*)(objs + (pool->obj_size * (i - 1)));
+		obj->next = pool->free_list;
+		pool->free_list = obj;
+	}
+	pool->allocated += pool->slab_objs;
+
+	return (0);
+}
+
+void *
+obj_pool_alloc(obj_pool_p pool) {
+	obj_pool_obj_p obj;
+
+	if (NULL == pool)
+		return (NULL);
+	pthread_mutex_lock(&pool->mtx);
+	if (NULL == pool->free_list &&
+	    0 != obj_pool_slab_add(pool)) {
+		pthread_mutex_unlock(&pool->mtx);
+		return (NULL);
+	}
+	obj = pool->free_list;
+	pool->free_list = obj->next;
+	pool->used ++;
+	pthread_mutex_unlock(&pool->mtx);
+	memset(obj, 0x00, MAX(sizeof(obj_pool_obj_t), pool->zero_size));
+
+	return (obj);
+}
+
+void
+obj_pool_free(obj_pool_p pool, void *obj) {
+	obj_pool_obj_p pobj = obj;
+
+	if (NULL == pool || NULL == obj)
+		return;
+	pthread_mutex_lock(&pool->mtx);
+	pobj->next = pool->free_list;
+	pool->free_list = pobj;
+	pool->used --;
+	pthread_mutex_unlock(&pool->mtx);
+}
+
+void
+obj_pool_destroy(obj_pool_p pool) {
+	obj_pool_slab_p slab, slab_next;
+
+	if (NULL == pool)
+		return;
+	pthread_mutex_lock(&pool->mtx);
+	for (slab = pool->slabs; NULL != slab; slab = slab_next) {
+		slab_next = slab->next;
+		free(slab);
+	}
+	pool->slabs = NULL;
+	pool->free_list = NULL;
+	pool->allocated = 0;
+	pool->used = 0;
+	pthread_mutex_unlock(&pool->mtx);
+}
+
+void
+obj_pool_stats_get(obj_pool_p pool, size_t *allocated, size_t *used) {
+
+	if (NULL == pool)
+		return;
+	pthread_mutex_lock(&pool->mtx);
+	if (NULL != allocated) {
+		(*allocated) = pool->allocated;
+	}
+	if (NULL != used) {
+		(*used) = pool->used;
+	}
+	pthread_mutex_unlock(&pool->mtx);
+}
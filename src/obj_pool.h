@@ -0,0 +1,81 @@
+/*-
+ * Copyright (c) 2024-2025 Rozhuk Ivan <rozhuk.im@gmail.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE REGENTS AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE REGENTS OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ * Author: Rozhuk Ivan <rozhuk.im@gmail.com>
+ *
+ */
+
+#ifndef __OBJ_POOL_H__
+#define __OBJ_POOL_H__
+
+#include <sys/param.h>
+#include <sys/types.h>
+#include <inttypes.h>
+#include <pthread.h>
+
+#ifndef CACHE_LINE_SIZE
+#	define CACHE_LINE_SIZE	64
+#endif
+
+
+/* Fixed size objects, allocated by slabs and recycled on free.
+ * Objects are CACHE_LINE_SIZE aligned.
+ * Memory returned to system only by obj_pool_destroy(). */
+typedef struct obj_pool_s {
+	pthread_mutex_t	mtx;
+	size_t		obj_size; /* Rounded up to CACHE_LINE_SIZE. */
+	size_t		zero_size; /* Bytes zeroed on alloc. */
+	size_t		slab_objs; /* Objects per slab. */
+	void		*free_list;
+	void		*slabs; /* Allocated slabs list. */
+	size_t		allocated; /* Objects in all slabs. */
+	size_t		used;
+} obj_pool_t, *obj_pool_p;
+
+#define OBJ_POOL_INITIALIZER(__obj_size, __zero_size, __slab_objs) {	\
+	.mtx = PTHREAD_MUTEX_INITIALIZER,				\
+	.obj_size = roundup2((__obj_size), CACHE_LINE_SIZE),		\
+	.zero_size = (__zero_size),					\
+	.slab_objs = (__slab_objs),					\
+	.free_list = NULL,						\
+	.slabs = NULL,							\
+	.allocated = 0,							\
+	.used = 0							\
+}
+
+
+/* Return object with first zero_size bytes zeroed, NULL on error. */
+void *
+obj_pool_alloc(obj_pool_p pool);
+void
+obj_pool_free(obj_pool_p pool, void *obj);
+/* Free all slabs, objects must be returned before. */
+void
+obj_pool_destroy(obj_pool_p pool);
+void
+obj_pool_stats_get(obj_pool_p pool, size_t *allocated, size_t *used);
+
+
+#endif /* __OBJ_POOL_H__ */
@@ -0,0 +1,178 @@
+/*-
+ * Copyright (c) 2024-2025 Rozhuk Ivan <rozhuk.im@gmail.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE REGENTS AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE REGENTS OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ * Author: Rozhuk Ivan <rozhuk.im@gmail.com>
+ *
+ */
+
+
+#include <sys/param.h>
+#include <sys/types.h>
+#include <sys/queue.h>
+
+#include <inttypes.h>
+#include <errno.h>
+
+#include "timer_wheel.h"
+
+
+#define TW_L0_MASK	(TW_L0_SIZE - 1)
+#define TW_LN_MASK	(TW_LN_SIZE - 1)
+/* First tick bit of level: 0 - level 1. */
+#define TW_LN_SHIFT(__lvl)	(TW_L0_BITS + ((__lvl) * TW_LN_BITS))
+#define TW_MAX_DELTA	((1ull << TW_LN_SHIFT(TW_LN_COUNT)) - 1)
+
+
+void
+tw_init(tw_p tw, const uint64_t now) {
+
+	if (NULL == tw)
+		return;
+	tw->now = now;
+	tw->count = 0;
+	for (size_t i = 0; i < TW_L0_SIZE; i ++) {
+		TAILQ_INIT(&tw->l0[i]);
+	}
+	for (size_t i = 0; i < TW_LN_COUNT; i ++) {
+		for (size_t j = 0; j < TW_LN_SIZE; j ++) {
+			TAILQ_INIT(&tw->ln[i][j]);
+		}
+	}
+}
+
+static void
+tw_insert(tw_p tw, tw_node_p node) {
+	uint64_t expire = node->expire, delta;
+	tw_list_p list;
+
+	if (expire <= tw->now) {
+		expire = (tw->now + 1);
+	}
+	delta = (expire - tw->now);
+	if (TW_MAX_DELTA < delta) { /* Re-added on cascade. */
+		delta = TW_MAX_DELTA;
+		expire = (tw->now + delta);
+	}
+	if (TW_L0_SIZE > delta) {
+		list = &tw->l0[(expire & TW_L0_MASK)];
+	} else {
+		for (size_t i = 0;; i ++) {
+			if ((TW_LN_COUNT - 1) == i ||
+			    (1ull << TW_LN_SHIFT((i + 1))) > delta) {
+				list = &tw->ln[i][((expire >> TW_LN_SHIFT(i)) & TW_LN_MASK)];
+				break;
+			}
+		}
+	}
+	TAILQ_INSERT_TAIL(list, node, next);
+	node->list = list;
+}
+
+void
+tw_add(tw_p tw, tw_node_p node, const uint64_t expire) {
+
+	if (NULL == tw || NULL == node)
+		return;
+	if (NULL != node->list) {
+		tw_del(tw, node);
+	}
+	node->expire = expire;
+	tw_insert(tw, node);
+	tw->count ++;
+}
+
+void
+tw_del(tw_p tw, tw_node_p node) {
+
+	if (NULL == tw || NULL == node || NULL == node->list)
+		return;
+	TAILQ_REMOVE(node->list, node, next);
+	node->list = NULL;
+	tw->count --;
+}
+
+/* Move timers from upper level slot to lower levels. */
+static void
+tw_cascade(tw_p tw, tw_list_p list) {
+	tw_node_p node;
+
+	while (NULL != (node = TAILQ_FIRST(list))) {
+		TAILQ_REMOVE(list, node, next);
+		tw_insert(tw, node);
+	}
+}
+
+void
+tw_advance(tw_p tw, const uint64_t now, tw_list_p expired) {
+	tw_list_p list;
+	tw_node_p node;
+	size_t idx;
+
+	if (NULL == tw || NULL == expired)
+		return;
+	if (0 == tw->count) { /* Nothing to walk through. */
+		tw->now = MAX(tw->now, now);
+		return;
+	}
+	while (tw->now < now) {
+		tw->now ++;
+		for (size_t i = 0; i < TW_LN_COUNT; i ++) {
+			if (0 != (tw->now & ((1ull << TW_LN_SHIFT(i)) - 1)))
+				break;
+			idx = ((tw->now >> TW_LN_SHIFT(i)) & TW_LN_MASK);
+			tw_cascade(tw, &tw->ln[i][idx]);
+		}
+		list = &tw->l0[(tw->now & TW_L0_MASK)];
+		while (NULL != (node = TAILQ_FIRST(list))) {
+			TAILQ_REMOVE(list, node, next);
+			node->list = NULL;
+			tw->count --;
+			TAILQ_INSERT_TAIL(expired, node, next);
+		}
+		if (0 == tw->count) {
+			tw->now = now;
+			break;
+		}
+	}
+}
+
+int
+tw_next(tw_p tw, uint64_t *next) {
+	uint64_t tick;
+
+	if (NULL == tw || NULL == next)
+		return (EINVAL);
+	if (0 == tw->count)
+		return (ENOENT);
+	/* Level 0 slots until next cascade. */
+	for (tick = (tw->now + 1);; tick ++) {
+		if (!TAILQ_EMPTY(&tw->l0[(tick & TW_L0_MASK)]) ||
+		    0 == (tick & TW_L0_MASK))
+			break;
+	}
+	(*next) = tick;
+
+	return (0);
+}
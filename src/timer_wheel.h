@@ -0,0 +1,83 @@
+/*-
+ * Copyright (c) 2024-2025 Rozhuk Ivan <rozhuk.im@gmail.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE REGENTS AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE REGENTS OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ * Author: Rozhuk Ivan <rozhuk.im@gmail.com>
+ *
+ */
+
+#ifndef __TIMER_WHEEL_H__
+#define __TIMER_WHEEL_H__
+
+#include <sys/param.h>
+#include <sys/types.h>
+#include <sys/queue.h>
+#include <inttypes.h>
+
+
+/* Hierarchical timer wheel: level 0 has 256 slots of 1 tick,
+ * levels 1-3 have 64 slots each, 64 times longer than previous level.
+ * Timers after ~2^26 ticks placed to last level slot and re-added on
+ * cascade.  Add, delete: O(1), advance: O(1) per tick + expired timers.
+ * Not thread safe, caller must lock it. */
+#define TW_L0_BITS	8
+#define TW_LN_BITS	6
+#define TW_LN_COUNT	3
+#define TW_L0_SIZE	(1 << TW_L0_BITS)
+#define TW_LN_SIZE	(1 << TW_LN_BITS)
+
+typedef struct timer_wheel_node_s {
+	TAILQ_ENTRY(timer_wheel_node_s) next;
+	struct timer_wheel_list_s *list; /* NULL - not in wheel. */
+	uint64_t	expire; /* Tick. */
+	void		*udata;
+} tw_node_t, *tw_node_p;
+
+typedef TAILQ_HEAD(timer_wheel_list_s, timer_wheel_node_s) tw_list_t, *tw_list_p;
+
+typedef struct timer_wheel_s {
+	uint64_t	now; /* Last processed tick. */
+	size_t		count; /* Timers in wheel. */
+	tw_list_t	l0[TW_L0_SIZE];
+	tw_list_t	ln[TW_LN_COUNT][TW_LN_SIZE];
+} tw_t, *tw_p;
+
+
+void
+tw_init(tw_p tw, const uint64_t now);
+/* Timers that expire before tw->now + 1 fired on next advance. */
+void
+tw_add(tw_p tw, tw_node_p node, const uint64_t expire);
+void
+tw_del(tw_p tw, tw_node_p node);
+/* Move timers that expire at or before now to expired list. */
+void
+tw_advance(tw_p tw, const uint64_t now, tw_list_p expired);
+/* Return 0 and set next to nearest tick when advance should be called:
+ * timer expire or next cascade, ENOENT if wheel is empty. */
+int
+tw_next(tw_p tw, uint64_t *next);
+
+
+#endif /* __TIMER_WHEEL_H__ */
@@ -31,6 +31,8 @@
 #include <sys/param.h>
 #include <sys/types.h>
 #include <sys/ioctl.h>
+#include <sys/queue.h>
+#include <sys/uio.h> /* struct iovec */
 /* Required for: SNDCTL_MIDI_INFO. */
 #if defined(__OpenBSD__)
 	#include <soundcard.h>
@@ -39,68 +41,394 @@
 #endif
 
 #include <inttypes.h>
+#include <stddef.h> /* offsetof */
 #include <stdlib.h> /* malloc, exit */
 #include <stdio.h> /* snprintf, fprintf */
 #include <string.h> /* bcopy, bzero, memcpy, memmove, memset, strerror... */
 #include <errno.h>
+#include <time.h>
 #include <pthread.h>
 #include <cuse.h>
 #include <libgen.h> /* basename */
+#include <syslog.h>
 
 #include "midi_event.h"
+#include "cuse_pool.h"
+#include "obj_pool.h"
 #include "dev_midi.h"
+#include "vm_shm.h"
+#include "vm_timed.h"
 
 
 #define VM_MAX_DEV_UNIT		16
 #define VM_WRITE_BUF_SZ		4096
+#define VM_TX_RING_SZ		(4 * VM_WRITE_BUF_SZ) /* Power of 2. */
+#define VM_TX_WAIT_NS		100000000 /* Check for peer signal interval. */
+#define VM_HK_INTERVAL		1 /* Housekeeping interval, seconds. */
+#define VM_SCHED_RETRY_NS	5000000 /* Scheduled events queue full, retry interval. */
+#define VM_CLOSE_SCHED_WAIT	10 /* Max seconds to wait for scheduled events on close. */
+#define VM_SHM_SIZE		(sizeof(vm_shm_hdr_t) + VM_SHM_DATA_SZ)
+#define VM_LB_Q_SZ		1024 /* Timed loopback messages, power of 2. */
 
+/* Audio driver state: worker use driver only while it is active. */
+#define VM_DRV_ACTIVE		0
+#define VM_DRV_IDLE		1 /* Suspended by worker. */
+#define VM_DRV_RESUME		2 /* Resumer thread own driver and synth. */
+
+
+typedef struct virt_midi_fd_ctx_s *vm_fd_p;
+
+/* Timed mode loopback message, sent to readers at play time. */
+typedef struct virt_midi_lb_msg_s {
+	uint64_t		time;
+	uint8_t			size;
+	uint8_t			data[3];
+} vm_lb_msg_t, *vm_lb_msg_p;
 
 typedef struct virt_midi_dev_ctx_s {
 	struct cuse_dev *	pdev;
-	vmb_settings_p		settings;
+	vmb_options_t		opts; /* To create settings again on reload. */
+	vmb_settings_p		settings; /* Protected by mtx. */
+	uint32_t		settings_gen; /* Incremented on settings reload. */
+	vm_evt_filter_t		evt_filter; /* Accepted events for parser. */
+	int			passthrough; /* Do not aggregate controllers. */
 	volatile ssize_t	ref_cnt;
+	pthread_mutex_t		mtx; /* Protect fd_list. */
+	TAILQ_HEAD(, virt_midi_fd_ctx_s) fd_list; /* Opened fds. */
+	TAILQ_HEAD(, virt_midi_fd_ctx_s) rd_list; /* Opened loopback fds. */
+	pthread_mutex_t		wk_mtx; /* Protect wk_pending. */
+	pthread_cond_t		wk_cond; /* Worker thread wakeup. */
+	volatile int		wk_pending; /* Some fd have data in tx ring. */
+	pthread_t		worker; /* Events dispatch, idle check. */
+	pthread_mutex_t		rs_mtx; /* Held while driver resumed or synths swapped. */
+	pthread_cond_t		rs_cond; /* Resumer wakeup, with wk_mtx. */
+	volatile int		rs_pending; /* Some fd wait for resume. */
+	pthread_t		resumer; /* Resume idle drivers. */
+	volatile int		running;
+	struct cuse_dev *	pdev_lb; /* Loopback unit. */
 	char			descr[32]; /* Device description. */
 } vm_dev_t, *vm_dev_p;
 
+/* Allocated from vm_fd_pool, hot fields first: write(), poll() and
+ * worker pass touch only first cache line and parser head. */
 typedef struct virt_midi_fd_ctx_s {
+	/* Protected by mtx. */
 	pthread_mutex_t		mtx; /* Multiple threads may use fd in same time. */
-	vm_dev_p		dev;
+	pthread_cond_t		cond; /* Signaled on ring space free / data available. */
+	volatile int		tx_busy; /* Some thread write now. */
+	int			nonblock; /* Set by FIONBIO. */
+	int			poll_wait; /* Poll found tx ring full / rx ring empty. */
+	int			rx_wait; /* Reader wait on cond for data. */
+	size_t			tx_head; /* Write offset, free running. */
+	size_t			tx_tail; /* Read offset, free running. */
+	vm_shm_hdr_p		shm; /* Client mapped ring. */
+	uint32_t		shm_tail; /* Do not trust shm->tail. */
+	int			timed; /* Write frames: vm_timed_hdr_t + MIDI bytes. */
+	int			drv_state; /* VM_DRV_*, set to RESUME with dev->mtx held. */
+	/* Only worker thread use fields below. */
+	vm_ep_t			parser; /* State first, SYSEX buffer at end. */
+	vm_eagg_t		aggregator;
 	vmb_synth_p		synth;
 	vmb_a_drv_p		adriver;
+	uint64_t		frm_time; /* Current frame events time. */
+	size_t			frm_left; /* Current frame MIDI bytes left. */
+	size_t			frm_hdr_used;
+	uint8_t			frm_hdr[sizeof(vm_timed_hdr_t)];
+	vm_lb_msg_p		lb_q; /* Timed loopback, allocated on first use. */
+	size_t			lb_head; /* Free running. */
+	size_t			lb_tail;
+	/* Cold. */
+	TAILQ_ENTRY(virt_midi_fd_ctx_s) next;
+	vm_dev_p		dev;
 	int			open_fflags;
-	volatile int		tx_busy;
-	vm_ep_t		parser;
-} vm_fd_t, *vm_fd_p;
+	int			reader; /* Loopback unit fd, uses tx ring to receive. */
+	uint32_t		settings_gen; /* Synth settings, protected by dev->mtx. */
+	/* Not zeroed on alloc. */
+	uint8_t			tx_ring[VM_TX_RING_SZ] __aligned(CACHE_LINE_SIZE);
+} vm_fd_t;
+
+/* Contexts recycled across open/close of all devices. */
+static obj_pool_t vm_fd_pool = OBJ_POOL_INITIALIZER(sizeof(vm_fd_t),
+    offsetof(vm_fd_t, tx_ring), 4);
+
+#define VM_FD_TX_COUNT(__fd)	((__fd)->tx_head - (__fd)->tx_tail)
+#define VM_FD_TX_FREE(__fd)	(VM_TX_RING_SZ - VM_FD_TX_COUNT((__fd)))
+/* Loopback reader: worker put data, read() get, both without lock. */
+#define VM_FD_RX_COUNT(__fd)						\
+    (__atomic_load_n(&(__fd)->tx_head, __ATOMIC_SEQ_CST) -		\
+    __atomic_load_n(&(__fd)->tx_tail, __ATOMIC_ACQUIRE))
+#define VM_FD_SHM_COUNT(__fd)						\
+    ((NULL == (__fd)->shm) ? 0 :					\
+    MIN(VM_SHM_DATA_SZ, (__atomic_load_n(&(__fd)->shm->head,		\
+    __ATOMIC_ACQUIRE) - (__fd)->shm_tail)))
+
+/* vm_fd_tx_process() return flags. */
+#define VM_TX_MORE		0x01 /* More data left in ring. */
+#define VM_TX_RETRY		0x02 /* Data left, but can not be handled now. */
 
 
 static void	vm_dev_free(vm_dev_p dev);
 
 
+static void
+vm_dev_wakeup(vm_dev_p dev) {
+
+	pthread_mutex_lock(&dev->wk_mtx);
+	dev->wk_pending = 1;
+	pthread_cond_signal(&dev->wk_cond);
+	pthread_mutex_unlock(&dev->wk_mtx);
+}
+
+static void
+vm_dev_resume_request(vm_dev_p dev) {
+
+	pthread_mutex_lock(&dev->wk_mtx);
+	dev->rs_pending = 1;
+	pthread_cond_signal(&dev->rs_cond);
+	pthread_mutex_unlock(&dev->wk_mtx);
+}
+
+/* fd->mtx must be locked. */
+static size_t
+vm_fd_tx_put(vm_fd_p fd, const uint8_t *buf, size_t buf_size) {
+	size_t off, size, part;
+
+	size = MIN(buf_size, VM_FD_TX_FREE(fd));
+	off = (fd->tx_head & (VM_TX_RING_SZ - 1));
+	part = MIN(size, (VM_TX_RING_SZ - off));
+	memcpy(&fd->tx_ring[off], buf, part);
+	memcpy(fd->tx_ring, (buf + part), (size - part));
+	fd->tx_head += size;
+
+	return (size);
+}
+
+/* fd->mtx must be locked. */
+static size_t
+vm_fd_tx_get(vm_fd_p fd, uint8_t *buf, size_t buf_size) {
+	size_t off, size, part;
+
+	size = MIN(buf_size, VM_FD_TX_COUNT(fd));
+	off = (fd->tx_tail & (VM_TX_RING_SZ - 1));
+	part = MIN(size, (VM_TX_RING_SZ - off));
+	memcpy(buf, &fd->tx_ring[off], part);
+	memcpy((buf + part), fd->tx_ring, (size - part));
+	fd->tx_tail += size;
+
+	return (size);
+}
+
+/* fd->mtx must be locked. */
+static size_t
+vm_fd_shm_get(vm_fd_p fd, uint8_t *buf, size_t buf_size) {
+	vm_shm_hdr_p shm = fd->shm;
+	size_t size;
+	uint32_t off, part;
+
+	if (NULL == shm)
+		return (0);
+	size = MIN(buf_size, VM_FD_SHM_COUNT(fd));
+	off = (fd->shm_tail & (VM_SHM_DATA_SZ - 1));
+	part = MIN((uint32_t)size, (VM_SHM_DATA_SZ - off));
+	memcpy(buf, &shm->data[off], part);
+	memcpy((buf + part), shm->data, (size - part));
+	fd->shm_tail += (uint32_t)size;
+	__atomic_store_n(&shm->tail, fd->shm_tail, __ATOMIC_RELEASE);
+	if (0 == VM_FD_SHM_COUNT(fd)) {
+		/* Going to sleep, ask producer for kick.
+		 * Pairs with vm_shm_write(): update head, then check need_kick. */
+		__atomic_store_n(&shm->need_kick, 1, __ATOMIC_SEQ_CST);
+	}
+
+	return (size);
+}
+
+/* Loopback message: called by worker with dev->mtx locked.
+ * Slow reader lose whole messages that not fit to ring. */
+static void
+vm_dev_loopback(vm_dev_p dev, const struct iovec *iov, const int iovcnt) {
+	vm_fd_p fd;
+	int poll_wakeup = 0;
+	size_t head, size = 0, off, part;
+
+	for (int i = 0; i < iovcnt; i ++) {
+		size += iov[i].iov_len;
+	}
+	TAILQ_FOREACH(fd, &dev->rd_list, next) {
+		head = fd->tx_head; /* Only worker change it. */
+		if (size > (VM_TX_RING_SZ -
+		    (head - __atomic_load_n(&fd->tx_tail, __ATOMIC_ACQUIRE))))
+			continue;
+		for (int i = 0; i < iovcnt; i ++) {
+			off = (head & (VM_TX_RING_SZ - 1));
+			part = MIN(iov[i].iov_len, (VM_TX_RING_SZ - off));
+			memcpy(&fd->tx_ring[off], iov[i].iov_base, part);
+			memcpy(fd->tx_ring, (((const uint8_t*)iov[i].iov_base) + part),
+			    (iov[i].iov_len - part));
+			head += iov[i].iov_len;
+		}
+		/* Pairs with vm_read(): set rx_wait, then check head. */
+		__atomic_store_n(&fd->tx_head, head, __ATOMIC_SEQ_CST);
+		if (0 != __atomic_load_n(&fd->rx_wait, __ATOMIC_SEQ_CST)) {
+			pthread_mutex_lock(&fd->mtx);
+			fd->rx_wait = 0;
+			pthread_cond_broadcast(&fd->cond);
+			pthread_mutex_unlock(&fd->mtx);
+		}
+		if (0 != __atomic_exchange_n(&fd->poll_wait, 0, __ATOMIC_SEQ_CST)) {
+			poll_wakeup = 1;
+		}
+	}
+	if (0 != poll_wakeup) {
+		cuse_poll_wakeup();
+	}
+}
+
+/* Loopback parsed event with status byte, so messages from different
+ * writers are not mixed. Timed event is sent when it is played,
+ * frames are expected in time order. Called by worker. */
+static void
+vm_fd_loopback(vm_fd_p fd, const vm_evt_p evt, const uint64_t time) {
+	size_t size;
+	vm_lb_msg_p msg;
+	uint8_t buf[4], eox = MIDI_SYSEX_EOX;
+	struct iovec iov[3];
+
+	if (TAILQ_EMPTY(&fd->dev->rd_list))
+		return;
+	if (MIDI_SYSEX == evt->type) { /* Played now in any mode. */
+		buf[0] = MIDI_SYSEX;
+		iov[0].iov_base = buf;
+		iov[0].iov_len = 1;
+		iov[1].iov_base = evt->ex_data;
+		iov[1].iov_len = (size_t)evt->p1;
+		iov[2].iov_base = &eox;
+		iov[2].iov_len = 1;
+		vm_dev_loopback(fd->dev, iov, 3);
+		return;
+	}
+	if (0 != vm_event_serialize(evt, buf, sizeof(buf), &size))
+		return;
+	if (0 != time &&
+	    (fd->lb_head != fd->lb_tail || time > vm_backend_clock_get())) {
+		if (NULL == fd->lb_q) {
+			fd->lb_q = malloc((VM_LB_Q_SZ * sizeof(vm_lb_msg_t)));
+			if (NULL == fd->lb_q)
+				return;
+		}
+		if (VM_LB_Q_SZ == (fd->lb_head - fd->lb_tail))
+			return; /* Full: drop. */
+		msg = &fd->lb_q[(fd->lb_head & (VM_LB_Q_SZ - 1))];
+		msg->time = time;
+		msg->size = (uint8_t)size;
+		memcpy(msg->data, buf, size);
+		fd->lb_head ++;
+		return;
+	}
+	iov[0].iov_base = buf;
+	iov[0].iov_len = size;
+	vm_dev_loopback(fd->dev, iov, 1);
+}
+
+/* Send due timed loopback messages, called by worker with dev->mtx locked.
+ * Return next message time, 0 - queue is empty. */
+static uint64_t
+vm_fd_loopback_flush(vm_fd_p fd, const uint64_t now) {
+	vm_lb_msg_p msg;
+	struct iovec iov;
+
+	for (; fd->lb_tail != fd->lb_head; fd->lb_tail ++) {
+		msg = &fd->lb_q[(fd->lb_tail & (VM_LB_Q_SZ - 1))];
+		if (msg->time > now)
+			return (msg->time);
+		iov.iov_base = msg->data;
+		iov.iov_len = msg->size;
+		vm_dev_loopback(fd->dev, &iov, 1);
+	}
+
+	return (0);
+}
+
+/* Wait for fd->cond, fd->mtx must be locked.
+ * Wakeup periodically to check that peer is not interrupted. */
+static int
+vm_fd_cond_wait(vm_fd_p fd, int fflags) {
+	struct timespec ts;
+	static const struct timespec ts_wait = {
+		.tv_sec = 0,
+		.tv_nsec = VM_TX_WAIT_NS
+	};
+
+	if (0 != (CUSE_FFLAG_NONBLOCK & fflags))
+		return (CUSE_ERR_WOULDBLOCK);
+	if (0 == cuse_got_peer_signal())
+		return (CUSE_ERR_SIGNAL);
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	timespecadd(&ts, &ts_wait, &ts);
+	pthread_cond_timedwait(&fd->cond, &fd->mtx, &ts);
+
+	return (0);
+}
+
 static int
 vm_open(struct cuse_dev *pdev, int fflags) {
 	vm_dev_p dev = cuse_dev_get_priv0(pdev);
 	vm_fd_p fd;
+	vmb_settings_p bs;
+	pthread_condattr_t cattr;
 
-	fd = calloc(1, sizeof(vm_fd_t));
+	fd = obj_pool_alloc(&vm_fd_pool);
 	if (NULL == fd)
 		return (CUSE_ERR_NO_MEMORY);
 	if (0 != pthread_mutex_init(&fd->mtx, NULL))
 		goto err_out_mtx;
+	pthread_condattr_init(&cattr);
+	pthread_condattr_setclock(&cattr, CLOCK_MONOTONIC);
+	if (0 != pthread_cond_init(&fd->cond, &cattr)) {
+		pthread_condattr_destroy(&cattr);
+		goto err_out_cond;
+	}
+	pthread_condattr_destroy(&cattr);
 	fd->open_fflags = fflags;
 	fd->dev = dev;
-	fd->synth = vm_backend_synth_new(fd->dev->settings);
+	if (NULL != cuse_dev_get_priv1(pdev)) { /* Loopback unit. */
+		fd->reader = 1;
+		pthread_mutex_lock(&dev->mtx);
+		TAILQ_INSERT_TAIL(&dev->rd_list, fd, next);
+		dev->ref_cnt ++;
+		pthread_mutex_unlock(&dev->mtx);
+		cuse_dev_set_per_file_handle(pdev, fd);
+		return (0);
+	}
+	vm_event_parser_init(&fd->parser, &dev->evt_filter);
+	vm_event_aggregator_init(&fd->aggregator, dev->passthrough);
+	pthread_mutex_lock(&dev->mtx);
+	bs = dev->settings;
+	vm_backend_settings_ref(bs);
+	fd->settings_gen = dev->settings_gen;
+	pthread_mutex_unlock(&dev->mtx);
+	fd->synth = vm_backend_synth_new(bs);
 	if (NULL == fd->synth) {
 err_out:
+		vm_backend_settings_free(bs);
+		pthread_cond_destroy(&fd->cond);
+err_out_cond:
 		pthread_mutex_destroy(&fd->mtx);
 err_out_mtx:
-		free(fd);
+		obj_pool_free(&vm_fd_pool, fd);
 		return (CUSE_ERR_NO_MEMORY);
 	}
-	fd->adriver = vm_backend_audio_driver_new(fd->dev->settings, fd->synth);
-	if (NULL == fd->adriver)
+	fd->adriver = vm_backend_audio_driver_new(bs, fd->synth);
+	if (NULL == fd->adriver) {
+		vm_backend_synth_free(fd->synth);
 		goto err_out;
+	}
+	vm_backend_settings_free(bs);
 
-	fd->dev->ref_cnt ++;
+	pthread_mutex_lock(&dev->mtx);
+	TAILQ_INSERT_TAIL(&dev->fd_list, fd, next);
+	dev->ref_cnt ++;
+	pthread_mutex_unlock(&dev->mtx);
 	cuse_dev_set_per_file_handle(pdev, fd);
 
 	return (0);
@@ -109,75 +437,293 @@ err_out_mtx:
 static int
 vm_close(struct cuse_dev *pdev, int fflags __unused) {
 	vm_fd_p fd = cuse_dev_get_per_file_handle(pdev);
+	struct timespec ts, ts_end;
 
 	if (fd == NULL)
 		return (CUSE_ERR_INVALID);
 
+	if (0 != fd->reader) {
+		pthread_mutex_lock(&fd->dev->mtx);
+		TAILQ_REMOVE(&fd->dev->rd_list, fd, next);
+		pthread_mutex_unlock(&fd->dev->mtx);
+		goto free_fd;
+	}
+	/* Let worker play all queued events. */
+	clock_gettime(CLOCK_MONOTONIC, &ts_end);
+	ts_end.tv_sec += VM_CLOSE_SCHED_WAIT;
+	pthread_mutex_lock(&fd->mtx);
+	while ((0 != VM_FD_TX_COUNT(fd) || 0 != VM_FD_SHM_COUNT(fd) ||
+	    0 != vm_backend_audio_driver_sched_pending(fd->adriver)) &&
+	    0 != fd->dev->running) {
+		if (0 != vm_fd_cond_wait(fd, 0))
+			break;
+		/* Timed events may wait for dead output device. */
+		clock_gettime(CLOCK_MONOTONIC, &ts);
+		if (0 == VM_FD_TX_COUNT(fd) &&
+		    0 == VM_FD_SHM_COUNT(fd) &&
+		    timespeccmp(&ts, &ts_end, >))
+			break;
+	}
+	/* Worker hold dev->mtx while it use fd, resumer is waited. */
+	pthread_mutex_unlock(&fd->mtx);
+	pthread_mutex_lock(&fd->dev->mtx);
+	pthread_mutex_lock(&fd->mtx);
+	while (VM_DRV_RESUME == fd->drv_state) {
+		pthread_mutex_unlock(&fd->dev->mtx);
+		pthread_cond_wait(&fd->cond, &fd->mtx);
+		pthread_mutex_unlock(&fd->mtx);
+		pthread_mutex_lock(&fd->dev->mtx);
+		pthread_mutex_lock(&fd->mtx);
+	}
+	pthread_mutex_unlock(&fd->mtx);
+	if (NULL != fd->lb_q) {
+		vm_fd_loopback_flush(fd, UINT64_MAX);
+	}
+	TAILQ_REMOVE(&fd->dev->fd_list, fd, next);
+	pthread_mutex_unlock(&fd->dev->mtx);
+free_fd:
 	vm_backend_audio_driver_free(fd->adriver);
 	vm_backend_synth_free(fd->synth);
 	vm_dev_free(fd->dev);
+	free(fd->lb_q);
+	if (NULL != fd->shm) {
+		cuse_vmfree(fd->shm);
+	}
+	pthread_cond_destroy(&fd->cond);
 	pthread_mutex_destroy(&fd->mtx);
-	free(fd);
+	obj_pool_free(&vm_fd_pool, fd);
 	cuse_dev_set_per_file_handle(pdev, NULL);
 
 	return (0);
 }
 
 static int
-vm_read(struct cuse_dev *pdev __unused, int fflags __unused,
-    void *peer_ptr __unused, int len __unused) {
+vm_read(struct cuse_dev *pdev, int fflags, void *peer_ptr, int len) {
+	vm_fd_p fd = cuse_dev_get_per_file_handle(pdev);
+	int error;
+	uint8_t buf[VM_WRITE_BUF_SZ];
+	size_t size, tail, off, part;
+
+	if (fd == NULL || 0 == fd->reader)
+		return (CUSE_ERR_INVALID);
+
+	pthread_mutex_lock(&fd->mtx);
+	if (0 != fd->nonblock) {
+		fflags |= CUSE_FFLAG_NONBLOCK;
+	}
+	while (0 == VM_FD_RX_COUNT(fd)) {
+		/* Pairs with vm_dev_loopback(): update head, then check rx_wait. */
+		__atomic_store_n(&fd->rx_wait, 1, __ATOMIC_SEQ_CST);
+		if (0 != VM_FD_RX_COUNT(fd))
+			break;
+		error = vm_fd_cond_wait(fd, fflags);
+		if (0 != error) {
+			fd->rx_wait = 0;
+			pthread_mutex_unlock(&fd->mtx);
+			return (error);
+		}
+	}
+	fd->rx_wait = 0;
+	tail = fd->tx_tail; /* Only reader change it. */
+	size = MIN(MIN(sizeof(buf), (size_t)len), VM_FD_RX_COUNT(fd));
+	off = (tail & (VM_TX_RING_SZ - 1));
+	part = MIN(size, (VM_TX_RING_SZ - off));
+	memcpy(buf, &fd->tx_ring[off], part);
+	memcpy((buf + part), fd->tx_ring, (size - part));
+	__atomic_store_n(&fd->tx_tail, (tail + size), __ATOMIC_RELEASE);
+	error = cuse_copy_out(buf, peer_ptr, (int)size);
+	pthread_mutex_unlock(&fd->mtx);
+	if (0 != error)
+		return (error);
+
+	return ((int)size);
+}
+
+/* time: 0 - play now, other - schedule. */
+static int
+vm_fd_events_handle(vm_fd_p fd, vm_evt_p evts, const size_t count,
+    const uint64_t time) {
+	int error;
+
+	/* Driver is active: resumer thread resume it before. */
+	for (size_t i = 0; i < count; i ++) {
+		if (0 != time &&
+		    0 == vm_backend_event_schedule(fd->adriver, &evts[i], time))
+			continue;
+		/* Not timed, SYSEX or queue is full: play now. */
+		error = vm_backend_event_handle(fd->synth, &evts[i]);
+		if (0 != error &&
+		    EOPNOTSUPP != error)
+			return (error);
+	}
+
+	return (0);
+}
+
+static void
+vm_fd_bytes_handle(vm_fd_p fd, const uint8_t *buf, const size_t size,
+    const uint64_t time) {
+	size_t evts_cnt;
+	vm_evt_p evt;
+	vm_evt_t evts[VM_EVT_AGG_OUT_MAX];
+
+	for (size_t i = 0; i < size; i ++) {
+		evt = vm_event_parse(&fd->parser, buf[i]);
+		if (NULL == evt)
+			continue;
+		vm_fd_loopback(fd, evt, time);
+		evts_cnt = vm_event_aggregate(&fd->aggregator, evt, evts);
+		/* Write already returned, nothing to report to. */
+		vm_fd_events_handle(fd, evts, evts_cnt, time);
+	}
+}
+
+/* Split frames to headers and MIDI bytes. */
+static void
+vm_fd_frames_handle(vm_fd_p fd, const uint8_t *buf, const size_t size) {
+	size_t part;
+	vm_timed_hdr_t hdr;
+
+	for (size_t i = 0; i < size; i += part) {
+		if (0 == fd->frm_left) { /* Header. */
+			part = MIN((size - i),
+			    (sizeof(fd->frm_hdr) - fd->frm_hdr_used));
+			memcpy(&fd->frm_hdr[fd->frm_hdr_used], &buf[i], part);
+			fd->frm_hdr_used += part;
+			if (sizeof(fd->frm_hdr) > fd->frm_hdr_used)
+				continue;
+			fd->frm_hdr_used = 0;
+			memcpy(&hdr, fd->frm_hdr, sizeof(hdr));
+			fd->frm_time = MAX(1, hdr.time); /* 0 - play now. */
+			fd->frm_left = hdr.size;
+			continue;
+		}
+		part = MIN((size - i), fd->frm_left);
+		vm_fd_bytes_handle(fd, &buf[i], part, fd->frm_time);
+		fd->frm_left -= part;
+	}
+}
+
+/* Called from worker thread: take data from tx ring, parse and play.
+ * Return VM_TX_* flags. */
+static int
+vm_fd_tx_process(vm_fd_p fd, uint8_t *buf, size_t buf_size) {
+	int more, timed;
+	size_t size, evts_cnt, sched_free;
+	vm_evt_t evts[VM_EVT_AGG_OUT_MAX];
+
+	pthread_mutex_lock(&fd->mtx);
+	if (VM_DRV_ACTIVE != fd->drv_state) {
+		/* Resume may take long: resumer thread do it, data wait
+		 * in ring, worker is woken up after. */
+		if (VM_DRV_IDLE == fd->drv_state &&
+		    (0 != VM_FD_TX_COUNT(fd) || 0 != VM_FD_SHM_COUNT(fd))) {
+			fd->drv_state = VM_DRV_RESUME;
+			vm_dev_resume_request(fd->dev);
+		}
+		pthread_mutex_unlock(&fd->mtx);
+		return (0);
+	}
+	timed = fd->timed;
+	if (0 != timed) {
+		/* Byte gives 1 event, aggregator may add select and
+		 * held MSB. */
+		sched_free = vm_backend_audio_driver_sched_free(fd->adriver);
+		if ((VM_EVT_AGG_OUT_MAX - 1) >= sched_free) {
+			more = ((0 != VM_FD_TX_COUNT(fd) ||
+			    0 != VM_FD_SHM_COUNT(fd)) ? VM_TX_RETRY : 0);
+			pthread_mutex_unlock(&fd->mtx);
+			return (more);
+		}
+		buf_size = MIN(buf_size,
+		    (sched_free - (VM_EVT_AGG_OUT_MAX - 1)));
+	}
+	size = vm_fd_tx_get(fd, buf, buf_size);
+	size += vm_fd_shm_get(fd, (buf + size), (buf_size - size));
+	more = ((0 != VM_FD_TX_COUNT(fd) || 0 != VM_FD_SHM_COUNT(fd)) ?
+	    VM_TX_MORE : 0);
+	if (0 != size) {
+		pthread_cond_broadcast(&fd->cond);
+		if (0 != fd->poll_wait) {
+			fd->poll_wait = 0;
+			cuse_poll_wakeup();
+		}
+	}
+	pthread_mutex_unlock(&fd->mtx);
+	if (0 == size)
+		return (0);
+
+	if (0 == timed) {
+		vm_fd_bytes_handle(fd, buf, size, 0);
+	} else {
+		vm_fd_frames_handle(fd, buf, size);
+	}
+	if (0 == more) { /* Do not hold controller MSB between writes. */
+		evts_cnt = vm_event_aggregate_flush(&fd->aggregator, evts);
+		vm_fd_events_handle(fd, evts, evts_cnt,
+		    ((0 != timed) ? fd->frm_time : 0));
+	}
 
-	return (CUSE_ERR_INVALID);
+	return (more);
 }
 
 static int
-vm_write(struct cuse_dev *pdev, int fflags __unused, const void *peer_ptr,
+vm_write(struct cuse_dev *pdev, int fflags, const void *peer_ptr,
     int len) {
 	vm_fd_p fd = cuse_dev_get_per_file_handle(pdev);
-	int error, retval = 0;
+	int error = 0, retval = 0;
 	uint8_t buf[VM_WRITE_BUF_SZ];
-	size_t buf_size;
-	vm_evt_p evt;
+	size_t buf_size, buf_off;
 
-	if (fd == NULL)
+	if (fd == NULL || 0 != fd->reader)
 		return (CUSE_ERR_INVALID);
 
 	pthread_mutex_lock(&fd->mtx);
-	if (fd->tx_busy) {
-		pthread_mutex_unlock(&fd->mtx);
-		return (CUSE_ERR_BUSY);
+	if (0 != fd->nonblock) {
+		fflags |= CUSE_FFLAG_NONBLOCK;
 	}
+	while (0 != fd->tx_busy) { /* Wait for other writer. */
+		error = vm_fd_cond_wait(fd, fflags);
+		if (0 != error) {
+			pthread_mutex_unlock(&fd->mtx);
+			return (error);
+		}
+	}
+	fd->tx_busy = 1;
 
-	for (size_t i = 0; i < (size_t)len; i += sizeof(buf)) {
-		fd->tx_busy = 1;
+	for (size_t i = 0; i < (size_t)len; i += buf_size) {
 		pthread_mutex_unlock(&fd->mtx);
 		buf_size = MIN(sizeof(buf), (size_t)((size_t)len - i));
 		error = cuse_copy_in((((const uint8_t*)peer_ptr) + i),
 		    &buf, (int)buf_size);
 		pthread_mutex_lock(&fd->mtx);
-		fd->tx_busy = 0;
-		if (0 != error) {
-			retval = error;
+		if (0 != error)
 			break;
-		}
-
-		for (size_t j = 0; j < buf_size; j ++) {
-			evt = vm_event_parse(&fd->parser, buf[j]);
-			if (NULL == evt)
-				continue;
-			error = vm_backend_event_handle(fd->synth, evt);
-			if (0 != error &&
-			    EOPNOTSUPP != error) {
-				retval = CUSE_ERR_INVALID;
+		/* Queue data, wait for free space if ring is full. */
+		for (buf_off = 0;;) {
+			buf_off += vm_fd_tx_put(fd, &buf[buf_off],
+			    (buf_size - buf_off));
+			if (buf_off == buf_size)
+				break;
+			vm_dev_wakeup(fd->dev);
+			error = vm_fd_cond_wait(fd, fflags);
+			if (0 != error)
 				break;
-			}
 		}
-		retval += buf_size;
+		retval += (int)buf_off;
+		if (0 != error)
+			break;
 	}
 
+	fd->tx_busy = 0;
+	pthread_cond_broadcast(&fd->cond);
 	pthread_mutex_unlock(&fd->mtx);
+	if (0 != retval) {
+		vm_dev_wakeup(fd->dev);
+		return (retval); /* Partial write. */
+	}
 
-	return (retval);
+	return (error);
 }
 
 static int
@@ -187,11 +733,17 @@ vm_ioctl(struct cuse_dev *pdev, int fflags __unused,
 	size_t len;
 	union {
 		int ival;
+		uint64_t u64;
+		vm_shm_info_t shm_info;
 #ifdef SNDCTL_MIDI_INFO
 		struct midi_info mi;
 #endif
 	} data;
 	vm_dev_p dev = cuse_dev_get_priv0(pdev);
+	vm_fd_p fd = cuse_dev_get_per_file_handle(pdev);
+
+	if (fd == NULL)
+		return (CUSE_ERR_INVALID);
 
 	len = (size_t)IOCPARM_LEN(cmd);
 	if (sizeof(data) < len)
@@ -207,14 +759,29 @@ vm_ioctl(struct cuse_dev *pdev, int fflags __unused,
 
 	switch (cmd) {
 	case FIOASYNC: /* _IOW('f', 125, int): set/clear async i/o. */
-	case FIONBIO: /* _IOW('f', 126, int): set/clear non-blocking i/o. */
 		/* Not implemented. */
 		break;
+	case FIONBIO: /* _IOW('f', 126, int): set/clear non-blocking i/o. */
+		pthread_mutex_lock(&fd->mtx);
+		fd->nonblock = (0 != data.ival);
+		pthread_mutex_unlock(&fd->mtx);
+		break;
 	case FIONREAD: /* _IOR('f', 127, int): get # bytes to read. */
-		data.ival = 0;
+		data.ival = ((0 != fd->reader) ? (int)VM_FD_RX_COUNT(fd) : 0);
 		break;
+#ifdef FIONSPACE
+	case FIONSPACE: /* _IOR('f', 118, int): get space in send queue. */
+		/* Report how many bytes write() accept without blocking. */
+		pthread_mutex_lock(&fd->mtx);
+		data.ival = ((0 != fd->reader) ? 0 : (int)VM_FD_TX_FREE(fd));
+		pthread_mutex_unlock(&fd->mtx);
+		break;
+#endif
 	case FIONWRITE: /* _IOR('f', 119, int): get # bytes (yet) to write. */
-		data.ival = VM_WRITE_BUF_SZ;
+		/* Written bytes that worker did not take yet. */
+		pthread_mutex_lock(&fd->mtx);
+		data.ival = ((0 != fd->reader) ? 0 : (int)VM_FD_TX_COUNT(fd));
+		pthread_mutex_unlock(&fd->mtx);
 		break;
 #ifdef SNDCTL_MIDI_INFO
 	case SNDCTL_MIDI_INFO: /* _IOWR('Q',12, struct midi_info) */
@@ -226,6 +793,61 @@ vm_ioctl(struct cuse_dev *pdev, int fflags __unused,
 		data.mi.dev_type = 0x01; /* From sequencer.c. */
 		break;
 #endif
+	case VM_IOC_SHM_INFO:
+		if (0 != fd->reader)
+			goto err_out;
+		pthread_mutex_lock(&fd->mtx);
+		if (NULL == fd->shm) {
+			fd->shm = cuse_vmalloc((int)VM_SHM_SIZE);
+			if (NULL == fd->shm) {
+				pthread_mutex_unlock(&fd->mtx);
+				error = CUSE_ERR_NO_MEMORY;
+				break;
+			}
+			memset(fd->shm, 0x00, VM_SHM_SIZE);
+			fd->shm->magic = VM_SHM_MAGIC;
+			fd->shm->data_size = VM_SHM_DATA_SZ;
+			fd->shm->need_kick = 1;
+			fd->shm_tail = 0;
+		}
+		data.shm_info.offset = cuse_vmoffset(fd->shm);
+		data.shm_info.size = VM_SHM_SIZE;
+		pthread_mutex_unlock(&fd->mtx);
+		break;
+	case VM_IOC_SHM_KICK:
+		vm_dev_wakeup(dev);
+		break;
+	case VM_IOC_CLOCK_GET:
+		data.u64 = vm_backend_clock_get();
+		break;
+	case VM_IOC_TIMED_SET:
+		if (0 != fd->reader)
+			goto err_out;
+		if (0 != data.ival &&
+		    0 != vm_backend_audio_driver_sched_init(fd->adriver)) {
+			error = CUSE_ERR_NO_MEMORY;
+			break;
+		}
+		/* Worker use frame state with dev->mtx held. */
+		pthread_mutex_lock(&dev->mtx);
+		pthread_mutex_lock(&fd->mtx);
+		if (fd->timed != (0 != data.ival)) {
+			if (0 != VM_FD_TX_COUNT(fd) ||
+			    0 != VM_FD_SHM_COUNT(fd) ||
+			    0 != fd->frm_left ||
+			    0 != fd->frm_hdr_used) {
+				/* Queued data is in other format. */
+				error = CUSE_ERR_BUSY;
+			} else {
+				fd->timed = (0 != data.ival);
+				fd->frm_time = 0;
+				fd->frm_left = 0;
+				fd->frm_hdr_used = 0;
+			}
+		}
+		pthread_mutex_unlock(&fd->mtx);
+		pthread_mutex_unlock(&dev->mtx);
+		break;
 	default:
 		/* Log unsupported ioctl(). */
 err_out:
@@ -249,10 +871,24 @@ vm_poll(struct cuse_dev *pdev, int fflags __unused, int events) {
 	if (fd == NULL)
 		return (retval);
 
+	if (0 != fd->reader) {
+		if (0 != (CUSE_POLL_READ & events)) {
+			/* Pairs with vm_dev_loopback(). */
+			__atomic_store_n(&fd->poll_wait, 1, __ATOMIC_SEQ_CST);
+			if (0 != VM_FD_RX_COUNT(fd)) {
+				retval |= CUSE_POLL_READ;
+			}
+		}
+		return (retval);
+	}
+
 	pthread_mutex_lock(&fd->mtx);
-	if (0 != (CUSE_POLL_WRITE & events) &&
-	    0 == fd->tx_busy) {
-		retval |= CUSE_POLL_WRITE;
+	if (0 != (CUSE_POLL_WRITE & events)) {
+		if (0 != VM_FD_TX_FREE(fd)) {
+			retval |= CUSE_POLL_WRITE;
+		} else { /* Worker will call cuse_poll_wakeup(). */
+			fd->poll_wait = 1;
+		}
 	}
 	pthread_mutex_unlock(&fd->mtx);
 
@@ -269,28 +905,215 @@ static const struct cuse_methods vm_methods = {
 };
 
 
+/* Suspend idle driver, called by worker with dev->mtx locked. */
+static void
+vm_fd_idle_check(vm_fd_p fd) {
+	int state;
+
+	pthread_mutex_lock(&fd->mtx);
+	state = fd->drv_state;
+	pthread_mutex_unlock(&fd->mtx);
+	if (VM_DRV_RESUME == state) /* Resumer use driver. */
+		return;
+	if (0 != vm_backend_audio_driver_idle_check(fd->adriver) ||
+	    VM_DRV_IDLE == state)
+		return;
+	pthread_mutex_lock(&fd->mtx);
+	fd->drv_state = VM_DRV_IDLE;
+	pthread_mutex_unlock(&fd->mtx);
+}
+
+/* Resume drivers: new audio driver and synth restore may take long,
+ * worker continue to play other fds meantime. */
+static void *
+vm_dev_resumer_proc(void *arg) {
+	vm_dev_p dev = arg;
+	vm_fd_p fd;
+	int running = 1;
+
+	while (0 != running) {
+		pthread_mutex_lock(&dev->wk_mtx);
+		while (0 != dev->running && 0 == dev->rs_pending) {
+			pthread_cond_wait(&dev->rs_cond, &dev->wk_mtx);
+		}
+		dev->rs_pending = 0;
+		running = dev->running;
+		pthread_mutex_unlock(&dev->wk_mtx);
+
+		for (;;) {
+			pthread_mutex_lock(&dev->rs_mtx);
+			pthread_mutex_lock(&dev->mtx);
+			TAILQ_FOREACH(fd, &dev->fd_list, next) {
+				if (VM_DRV_RESUME == fd->drv_state)
+					break;
+			}
+			pthread_mutex_unlock(&dev->mtx);
+			if (NULL == fd) {
+				pthread_mutex_unlock(&dev->rs_mtx);
+				break;
+			}
+			/* Worker and close() do not use fd in this state. */
+			vm_backend_audio_driver_resume(fd->adriver);
+			pthread_mutex_lock(&fd->mtx);
+			fd->drv_state = VM_DRV_ACTIVE;
+			pthread_cond_broadcast(&fd->cond);
+			pthread_mutex_unlock(&fd->mtx);
+			pthread_mutex_unlock(&dev->rs_mtx);
+			vm_dev_wakeup(dev);
+		}
+	}
+
+	return (NULL);
+}
+
+static void *
+vm_dev_worker_proc(void *arg) {
+	vm_dev_p dev = arg;
+	vm_fd_p fd;
+	int more = 0;
+	uint64_t now, due, lb_due = 0;
+	struct timespec ts, ts_hk, ts_lb;
+	static const struct timespec ts_retry = {
+		.tv_sec = 0,
+		.tv_nsec = VM_SCHED_RETRY_NS
+	};
+	uint8_t buf[VM_WRITE_BUF_SZ];
+
+	clock_gettime(CLOCK_MONOTONIC, &ts_hk);
+	ts_hk.tv_sec += VM_HK_INTERVAL;
+	pthread_mutex_lock(&dev->wk_mtx);
+	while (0 != dev->running) {
+		if (0 == dev->wk_pending &&
+		    0 == (VM_TX_MORE & more)) {
+			ts = ts_hk;
+			if (0 != (VM_TX_RETRY & more)) {
+				/* Render thread free scheduled events queue. */
+				clock_gettime(CLOCK_MONOTONIC, &ts);
+				timespecadd(&ts, &ts_retry, &ts);
+				if (timespeccmp(&ts, &ts_hk, >)) {
+					ts = ts_hk;
+				}
+			}
+			if (0 != lb_due) { /* Timed loopback. */
+				ts_lb.tv_sec = (time_t)(lb_due / 1000000000);
+				ts_lb.tv_nsec = (long)(lb_due % 1000000000);
+				if (timespeccmp(&ts, &ts_lb, >)) {
+					ts = ts_lb;
+				}
+			}
+			pthread_cond_timedwait(&dev->wk_cond, &dev->wk_mtx,
+			    &ts);
+		}
+		dev->wk_pending = 0;
+		pthread_mutex_unlock(&dev->wk_mtx);
+
+		pthread_mutex_lock(&dev->mtx);
+		/* One chunk from each fd per pass. */
+		more = 0;
+		TAILQ_FOREACH(fd, &dev->fd_list, next) {
+			more |= vm_fd_tx_process(fd, buf, sizeof(buf));
+		}
+		lb_due = 0;
+		now = vm_backend_clock_get();
+		TAILQ_FOREACH(fd, &dev->fd_list, next) {
+			if (NULL == fd->lb_q)
+				continue;
+			due = vm_fd_loopback_flush(fd, now);
+			if (0 != due &&
+			    (0 == lb_due || due < lb_due)) {
+				lb_due = due;
+			}
+		}
+		/* Housekeeping. */
+		clock_gettime(CLOCK_MONOTONIC, &ts);
+		if (ts.tv_sec >= ts_hk.tv_sec) {
+			TAILQ_FOREACH(fd, &dev->fd_list, next) {
+				vm_fd_idle_check(fd);
+			}
+			ts_hk.tv_sec = (ts.tv_sec + VM_HK_INTERVAL);
+			ts_hk.tv_nsec = ts.tv_nsec;
+		}
+		pthread_mutex_unlock(&dev->mtx);
+
+		pthread_mutex_lock(&dev->wk_mtx);
+	}
+	pthread_mutex_unlock(&dev->wk_mtx);
+
+	return (NULL);
+}
+
 static void
 vm_dev_free(vm_dev_p dev) {
 
 	if (NULL == dev)
 		return;
+	pthread_mutex_lock(&dev->mtx);
 	dev->ref_cnt --;
-	if (0 < dev->ref_cnt)
+	if (0 < dev->ref_cnt) {
+		pthread_mutex_unlock(&dev->mtx);
 		return;
+	}
+	pthread_mutex_unlock(&dev->mtx);
 	vm_backend_settings_free(dev->settings);
+	pthread_cond_destroy(&dev->rs_cond);
+	pthread_mutex_destroy(&dev->rs_mtx);
+	pthread_cond_destroy(&dev->wk_cond);
+	pthread_mutex_destroy(&dev->wk_mtx);
+	pthread_mutex_destroy(&dev->mtx);
 	free(dev);
 }
 
 struct cuse_dev *
-vm_dev_midi_create(const char *dname, vmb_options_p opts) {
+vm_dev_midi_create(const char *dname, vmb_options_p opts,
+    vm_dev_options_p dev_opts) {
 	vm_dev_p dev;
+	int unit;
+	pthread_condattr_t cattr;
 
-	if (NULL == dname || NULL == opts)
+	if (NULL == dname || NULL == opts || NULL == dev_opts)
 		return (NULL);
 	dev = calloc(1, sizeof(vm_dev_t));
 	if (NULL == dev)
 		return (NULL);
+	if (0 != pthread_mutex_init(&dev->mtx, NULL)) {
+		free(dev);
+		return (NULL);
+	}
+	if (0 != pthread_mutex_init(&dev->wk_mtx, NULL)) {
+		pthread_mutex_destroy(&dev->mtx);
+		free(dev);
+		return (NULL);
+	}
+	pthread_condattr_init(&cattr);
+	pthread_condattr_setclock(&cattr, CLOCK_MONOTONIC);
+	if (0 != pthread_cond_init(&dev->wk_cond, &cattr)) {
+		pthread_condattr_destroy(&cattr);
+		pthread_mutex_destroy(&dev->wk_mtx);
+		pthread_mutex_destroy(&dev->mtx);
+		free(dev);
+		return (NULL);
+	}
+	pthread_condattr_destroy(&cattr);
+	if (0 != pthread_mutex_init(&dev->rs_mtx, NULL)) {
+		pthread_cond_destroy(&dev->wk_cond);
+		pthread_mutex_destroy(&dev->wk_mtx);
+		pthread_mutex_destroy(&dev->mtx);
+		free(dev);
+		return (NULL);
+	}
+	if (0 != pthread_cond_init(&dev->rs_cond, NULL)) {
+		pthread_mutex_destroy(&dev->rs_mtx);
+		pthread_cond_destroy(&dev->wk_cond);
+		pthread_mutex_destroy(&dev->wk_mtx);
+		pthread_mutex_destroy(&dev->mtx);
+		free(dev);
+		return (NULL);
+	}
+	TAILQ_INIT(&dev->fd_list);
+	TAILQ_INIT(&dev->rd_list);
+	dev->ref_cnt ++; /* Hold device while it is created. */
 	/* Settings. */
+	memcpy(&dev->opts, opts, sizeof(vmb_options_t));
 	dev->settings = vm_backend_settings_new(opts);
 	if (NULL == dev->settings) {
 		errno = ENOMEM;
@@ -298,21 +1121,65 @@ err_out:
 		vm_dev_free(dev);
 		return (NULL);
 	}
+	/* Events filter: backend defaults + user changes. */
+	vm_backend_event_filter_get(&dev->evt_filter);
+	if (NULL != dev_opts->evt_filter &&
+	    0 != vm_event_filter_parse(&dev->evt_filter, dev_opts->evt_filter)) {
+		errno = EINVAL;
+		goto err_out;
+	}
+	dev->passthrough = dev_opts->passthrough;
 	snprintf(dev->descr, sizeof(dev->descr), "Soft MIDI: %s",
 	    basename(opts->device));
 
-	for (int i = 0; i < VM_MAX_DEV_UNIT && NULL == dev->pdev; i ++) {
-		dev->pdev = cuse_dev_create(&vm_methods,
+	for (unit = 0; unit < VM_MAX_DEV_UNIT; unit ++) {
+		dev->pdev = cuse_dev_create(cuse_pool_methods(&vm_methods),
 		    dev, /* param0 */
 		    NULL, /* param1 */
 		    0 /* root */,
 		    0 /* wheel */,
 		    0666 /* mode */,
-		    "%s%i.0", dname, i);
+		    "%s%i.0", dname, unit);
+		if (NULL != dev->pdev)
+			break;
 	}
 	if (NULL == dev->pdev)
 		goto err_out;
-	dev->ref_cnt ++;
+	if (0 != dev_opts->loopback) {
+		dev->pdev_lb = cuse_dev_create(cuse_pool_methods(&vm_methods),
+		    dev, /* param0 */
+		    (void*)dev, /* param1: mark loopback unit. */
+		    0 /* root */,
+		    0 /* wheel */,
+		    0444 /* mode */,
+		    "%s%i.1", dname, unit);
+		if (NULL == dev->pdev_lb) {
+			cuse_dev_destroy(dev->pdev);
+			goto err_out;
+		}
+	}
+	/* Events dispatch and housekeeping, drivers resume. */
+	dev->running = 1;
+	if (0 != pthread_create(&dev->resumer, NULL, vm_dev_resumer_proc, dev)) {
+		dev->running = 0;
+		if (NULL != dev->pdev_lb) {
+			cuse_dev_destroy(dev->pdev_lb);
+		}
+		cuse_dev_destroy(dev->pdev);
+		goto err_out;
+	}
+	if (0 != pthread_create(&dev->worker, NULL, vm_dev_worker_proc, dev)) {
+		pthread_mutex_lock(&dev->wk_mtx);
+		dev->running = 0;
+		pthread_cond_signal(&dev->rs_cond);
+		pthread_mutex_unlock(&dev->wk_mtx);
+		pthread_join(dev->resumer, NULL);
+		if (NULL != dev->pdev_lb) {
+			cuse_dev_destroy(dev->pdev_lb);
+		}
+		cuse_dev_destroy(dev->pdev);
+		goto err_out;
+	}
 
 	return (dev->pdev);
 }
@@ -322,9 +1189,146 @@ vm_dev_midi_destroy(struct cuse_dev *pdev) {
 	vm_dev_p dev = cuse_dev_get_priv0(pdev);
 
 	if (NULL != dev) {
+		pthread_mutex_lock(&dev->wk_mtx);
+		dev->running = 0;
+		pthread_cond_signal(&dev->wk_cond);
+		pthread_cond_signal(&dev->rs_cond);
+		pthread_mutex_unlock(&dev->wk_mtx);
+		pthread_join(dev->worker, NULL);
+		pthread_join(dev->resumer, NULL);
+		if (NULL != dev->pdev_lb) {
+			cuse_dev_destroy(dev->pdev_lb);
+			dev->pdev_lb = NULL;
+		}
 		dev->pdev = NULL;
-		dev->ref_cnt --;
 		vm_dev_free(dev);
 	}
 	cuse_dev_destroy(pdev);
 }
+
+/* Count fds that use synth settings older than dev ones. */
+static size_t
+vm_dev_fd_outdated_count(vm_dev_p dev) {
+	size_t count = 0;
+	vm_fd_p fd;
+
+	pthread_mutex_lock(&dev->mtx);
+	TAILQ_FOREACH(fd, &dev->fd_list, next) {
+		if (dev->settings_gen != fd->settings_gen) {
+			count ++;
+		}
+	}
+	pthread_mutex_unlock(&dev->mtx);
+
+	return (count);
+}
+
+int
+vm_dev_midi_reload(struct cuse_dev *pdev) {
+	int error = 0;
+	vm_dev_p dev = cuse_dev_get_priv0(pdev);
+	vm_fd_p fd;
+	vmb_settings_p bs;
+	vmb_synth_p *synths;
+	size_t i, count, swapped = 0;
+
+	if (NULL == dev)
+		return (EINVAL);
+	bs = vm_backend_settings_new(&dev->opts);
+	if (NULL == bs)
+		return (ENOMEM);
+	/* Keep old settings if new soundfont file can not be loaded. */
+	error = vm_backend_settings_sfont_load(bs);
+	if (0 != error) {
+		vm_backend_settings_free(bs);
+		syslog(LOG_ERR, "%s: reload: soundfont load failed, "
+		    "old settings kept", dev->descr);
+		return (error);
+	}
+	/* New fds get new settings from now. */
+	pthread_mutex_lock(&dev->mtx);
+	vm_backend_settings_free(dev->settings);
+	dev->settings = bs;
+	dev->settings_gen ++;
+	pthread_mutex_unlock(&dev->mtx);
+
+	/* Repeat: some fds may be opened with old settings meantime. */
+	while (0 != (count = vm_dev_fd_outdated_count(dev))) {
+		synths = calloc(count, sizeof(vmb_synth_p));
+		if (NULL == synths) {
+			error = ENOMEM;
+			break;
+		}
+		/* Pre-warm without locks: soundfont load may take long,
+		 * fds keep playing with old synths. */
+		for (i = 0; i < count; i ++) {
+			synths[i] = vm_backend_synth_new(bs);
+			if (NULL == synths[i]) {
+				error = ENOMEM;
+				break;
+			}
+		}
+		/* Worker does not handle events while dev->mtx held,
+		 * resumer while dev->rs_mtx held. */
+		pthread_mutex_lock(&dev->rs_mtx);
+		pthread_mutex_lock(&dev->mtx);
+		i = 0;
+		TAILQ_FOREACH(fd, &dev->fd_list, next) {
+			if (dev->settings_gen == fd->settings_gen)
+				continue;
+			if (i == count || NULL == synths[i])
+				break;
+			if (0 != vm_backend_synth_swap(fd->adriver, fd->synth,
+			    synths[i])) {
+				error = ENOMEM;
+				break;
+			}
+			fd->settings_gen = dev->settings_gen;
+			i ++;
+		}
+		pthread_mutex_unlock(&dev->mtx);
+		pthread_mutex_unlock(&dev->rs_mtx);
+		swapped += i;
+		/* Old engines and not used new ones. */
+		for (i = 0; i < count; i ++) {
+			vm_backend_synth_free(synths[i]);
+		}
+		free(synths);
+		if (0 != error)
+			break;
+	}
+
+	syslog(LOG_INFO, "%s: reloaded, %zu fds switched to new synth, "
+	    "error: %i", dev->descr, swapped, error);
+
+	return (error);
+}
+
+void
+vm_dev_midi_stats_log(struct cuse_dev *pdev) {
+	vm_dev_p dev = cuse_dev_get_priv0(pdev);
+	vm_fd_p fd;
+	size_t fd_count = 0, pool_allocated = 0;
+	vmb_a_stats_t st, st_sum;
+
+	if (NULL == dev)
+		return;
+	memset(&st_sum, 0x00, sizeof(st_sum));
+	pthread_mutex_lock(&dev->mtx);
+	TAILQ_FOREACH(fd, &dev->fd_list, next) {
+		fd_count ++;
+		if (0 != vm_backend_audio_driver_stats_get(fd->adriver, &st))
+			continue;
+		st_sum.blocks += st.blocks;
+		st_sum.minflt += st.minflt;
+		st_sum.majflt += st.majflt;
+	}
+	pthread_mutex_unlock(&dev->mtx);
+	obj_pool_stats_get(&vm_fd_pool, &pool_allocated, NULL);
+
+	syslog(LOG_INFO, "%s: open fds: %zu, fd contexts in pool: %zu, "
+	    "rendered blocks: %"PRIu64", "
+	    "render thread page faults: %"PRIu64" minor, %"PRIu64" major",
+	    dev->descr, fd_count, pool_allocated,
+	    st_sum.blocks, st_sum.minflt, st_sum.majflt);
+}
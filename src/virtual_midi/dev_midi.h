@@ -37,11 +37,29 @@
 #include "midi_backend.h"
 
 
+typedef struct virt_midi_dev_options_s {
+	const char	*evt_filter; /* See vm_event_filter_parse(). */
+	int		passthrough; /* Do not aggregate controllers. */
+	int		loopback; /* Create read only unit N.1 with played messages. */
+} vm_dev_options_t, *vm_dev_options_p;
+
+
 struct cuse_dev *
-vm_dev_midi_create(const char *dname, vmb_options_p opts);
+vm_dev_midi_create(const char *dname, vmb_options_p opts,
+    vm_dev_options_p dev_opts);
 
 void
 vm_dev_midi_destroy(struct cuse_dev *pdev);
 
+/* Create settings and synths again, replace synths of opened fds
+ * without interrupting them.
+ * Call vm_backend_sfont_cache_flush() before to load soundfont again. */
+int
+vm_dev_midi_reload(struct cuse_dev *pdev);
+
+/* Write device statistics to syslog. */
+void
+vm_dev_midi_stats_log(struct cuse_dev *pdev);
+
 
 #endif /* __DEV_MIDI_H__ */
@@ -47,27 +47,111 @@ typedef struct virt_midi_backend_options_s {
 	const char *	driver;
 	const char *	device;
 	const char *	soundfont;
+	uint32_t	idle_timeout; /* Seconds, 0 - disabled. */
+	uint32_t	reclaim_timeout; /* Seconds, 0 - disabled. */
+	int		rt_prio; /* Audio thread real-time priority, 0 - disabled. */
+	int		low_latency; /* Page-lock samples, count page faults. */
 } vmb_options_t, *vmb_options_p;
 
+typedef struct virt_midi_backend_audio_stats_s {
+	uint64_t	blocks; /* Rendered blocks. */
+	uint64_t	minflt; /* Render thread page faults without I/O, low_latency only. */
+	uint64_t	majflt; /* Render thread page faults with I/O, low_latency only. */
+} vmb_a_stats_t, *vmb_a_stats_p;
+
 
 vmb_settings_p
 vm_backend_settings_new(vmb_options_p opts);
+/* Settings are reference counted: synths and drivers hold them. */
+void
+vm_backend_settings_ref(vmb_settings_p bs);
 void
 vm_backend_settings_free(vmb_settings_p bs);
 int
 vm_backend_settings_get_device(vmb_settings_p bs, char *buf, size_t buf_size);
+/* Load soundfont from disk again, before settings are used.
+ * Returns error if it failed. */
+int
+vm_backend_settings_sfont_load(vmb_settings_p bs);
 
 vmb_synth_p
 vm_backend_synth_new(vmb_settings_p bs);
 void
 vm_backend_synth_free(vmb_synth_p bsynth);
+/* Free synth memory, keep channels state. */
+int
+vm_backend_synth_reclaim(vmb_synth_p bsynth);
+/* Create synth again and restore channels state.
+ * Called automatically by event handler and audio driver resume. */
+int
+vm_backend_synth_restore(vmb_synth_p bsynth);
+/* Move channels state to new_bsynth engine and exchange engines and
+ * settings, render thread of badrv (may be NULL) is held between blocks.
+ * Caller must not send events to bsynth meantime.
+ * After return new_bsynth holds old engine, free it. */
+int
+vm_backend_synth_swap(vmb_a_drv_p badrv, vmb_synth_p bsynth,
+    vmb_synth_p new_bsynth);
 
 vmb_a_drv_p
 vm_backend_audio_driver_new(vmb_settings_p bs, vmb_synth_p bsynth);
 void
 vm_backend_audio_driver_free(vmb_a_drv_p badrv);
+/* Stop rendering and release output device. */
+void
+vm_backend_audio_driver_suspend(vmb_a_drv_p badrv);
+/* Start rendering again, call before sounding events. */
+int
+vm_backend_audio_driver_resume(vmb_a_drv_p badrv);
+int
+vm_backend_audio_driver_stats_get(vmb_a_drv_p badrv, vmb_a_stats_p stats);
+/* Scheduled events: render thread apply them at block sample offset
+ * of their time, see vm_backend_clock_get().
+ * Render thread hold events queue allocated on first init call. */
+int
+vm_backend_audio_driver_sched_init(vmb_a_drv_p badrv);
+/* Events that can be scheduled now. */
+size_t
+vm_backend_audio_driver_sched_free(vmb_a_drv_p badrv);
+/* Events that wait for their time. */
+size_t
+vm_backend_audio_driver_sched_pending(vmb_a_drv_p badrv);
+/* Suspend driver if output was silent for idle_timeout,
+ * reclaim synth after reclaim_timeout if driver suspended.
+ * Return values:
+ * 0: driver suspended.
+ * EBUSY: driver is active.
+ */
+int
+vm_backend_audio_driver_idle_check(vmb_a_drv_p badrv);
+
+/* Soundfonts loaded by vm_backend_settings_sfont_load() become current,
+ * existing synths keep using already loaded. */
+void
+vm_backend_sfont_cache_flush(void);
+
+/* Write backend wide statistics to syslog. */
+void
+vm_backend_stats_log(void);
 
 
+/* Events that backend can handle, all other filtered out by parser. */
+void
+vm_backend_event_filter_get(vm_evt_filter_p filter);
+
+/* Scheduled events clock: CLOCK_MONOTONIC nanoseconds. */
+uint64_t
+vm_backend_clock_get(void);
+/* Single producer, driver must be resumed to play events.
+ * Return values:
+ * EINVAL: invalid args or driver without events queue.
+ * EOPNOTSUPP: SYSEX, it data is not owned by event, handle it now.
+ * EAGAIN: queue is full.
+ */
+int
+vm_backend_event_schedule(vmb_a_drv_p badrv, vm_evt_p evt,
+    const uint64_t time);
+
 /* Return values:
  * EINVAL: invalid args.
  * EIO: backend fail to handle event.
@@ -30,41 +30,199 @@
 
 #include <sys/param.h>
 #include <sys/types.h>
+#include <sys/time.h>
+#include <sys/resource.h> /* getrusage */
+#include <sys/queue.h>
 #include <inttypes.h>
 #include <stdlib.h> /* malloc, exit */
 #include <stdio.h> /* snprintf, fprintf */
 #include <unistd.h> /* close, write, sysconf */
 #include <string.h> /* bcopy, bzero, memcpy, memmove, memset, strerror... */
+#include <time.h>
+#include <pthread.h>
+#include <syslog.h>
 
 #include <fluidsynth.h>
 
 #include "midi_backend.h"
 
 
+/* Samples below this level is silence: less than 1 LSB of 16 bit output. */
+#define VMB_SILENCE_LEVEL	(1.0f / 32768.0f)
+#define VMB_SCHED_SIZE		1024 /* Scheduled events max, power of 2. */
+#define VMB_RENDER_MAX_BUFS	64 /* Block split limit: channels buffers. */
+#define VMB_RUSAGE_BLOCKS	512 /* Page faults counters sample interval. */
+#define VMB_NRPN_SF2_MSB	120 /* NRPN MSB of SF2 generators, select accumulated by fluid. */
+
+
+struct virt_midi_backend_settings_s {
+	fluid_settings_t	*fs;
+	volatile size_t		ref_cnt; /* Device, synths and drivers. */
+	struct virt_midi_backend_sfont_s *sfont; /* Held, set by vm_backend_settings_sfont_load(). */
+	uint32_t		sfont_gen; /* Soundfont cache generation used by synths. */
+	uint32_t		idle_timeout; /* Seconds, 0 - disabled. */
+	uint32_t		reclaim_timeout; /* Seconds, 0 - disabled. */
+	int			low_latency;
+};
+
+/* Loaded soundfont, shared by all synths of all devices.
+ * One fluid_sfont_t is added to many synths, fluidsynth 2.x allows it:
+ * - fluid_synth_add_sfont() set sfont id to next synth id: sfont is
+ * first in each synth and in holder, so id is always same, checked on add;
+ * - presets select notify load and unload samples only with dynamic
+ * sample loading: then sfont is not shared, each synth load own;
+ * - samples refcount is changed by voices of different synths without
+ * lock, so update may be lost. It is checked only when sfont is freed,
+ * after last synth that used it: lost update may keep memory, but
+ * never free samples that are used. */
+typedef struct virt_midi_backend_sfont_s {
+	TAILQ_ENTRY(virt_midi_backend_sfont_s) next;
+	fluid_settings_t	*fs; /* Holder settings, device settings may gone. */
+	fluid_synth_t		*holder; /* Synth that loaded and owns sfont. */
+	fluid_sfont_t		*sfont;
+	int			sfont_id; /* In holder, same in all synths. */
+	size_t			ref_cnt; /* Synths that use sfont. */
+	uint32_t		gen; /* Cache generation, when it was loaded. */
+	int			loading; /* sfload() in progress, wait vmb_sfont_cv. */
+	char			file[]; /* Soundfont file name. */
+} vmb_sfont_t, *vmb_sfont_p;
+
+static pthread_mutex_t vmb_sfont_mtx = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t vmb_sfont_cv = PTHREAD_COND_INITIALIZER; /* Load done. */
+static uint32_t vmb_sfont_gen = 0; /* New settings do not reuse older entries. */
+static TAILQ_HEAD(, virt_midi_backend_sfont_s) vmb_sfont_list =
+    TAILQ_HEAD_INITIALIZER(vmb_sfont_list);
+
+/* Channel state, that is restored after synth reclaim. */
+typedef struct virt_midi_backend_chan_state_s {
+	int			bank;
+	int			program;
+	int			pitch_bend;
+	int			pitch_wheel_sens;
+	float			fine_tune;
+	float			coarse_tune;
+	uint8_t			cc[128];
+} vmb_chan_state_t, *vmb_chan_state_p;
+
+struct virt_midi_backend_synth_s {
+	vmb_settings_p		bs;
+	fluid_synth_t		*fsynth; /* NULL - reclaimed. */
+	vmb_sfont_p		sfont; /* Used by fsynth. */
+	vmb_chan_state_p	state; /* Saved channels state. */
+	int			chan_count;
+	uint32_t		param_sel[16]; /* (N)RPN selected in fsynth: (type << 16) | number, 0 - unknown. */
+	volatile uint32_t	active_time; /* Last not silent block time. */
+};
+
+/* Scheduled events: worker put to ring, render thread move them to
+ * heap ordered by time and apply at block sample offset. */
+typedef struct virt_midi_backend_sched_evt_s {
+	uint64_t		time; /* CLOCK_MONOTONIC, ns. */
+	uint32_t		seq; /* Keep order of events with same time. */
+	vm_evt_t		evt;
+} vmb_sched_evt_t, *vmb_sched_evt_p;
+
+typedef struct virt_midi_backend_sched_s {
+	volatile size_t		head; /* Producer. */
+	volatile size_t		tail; /* Render thread. */
+	volatile size_t		heap_count; /* Set by render thread. */
+	uint32_t		seq; /* Producer. */
+	vmb_sched_evt_t		ring[VMB_SCHED_SIZE];
+	vmb_sched_evt_t		heap[VMB_SCHED_SIZE];
+} vmb_sched_t, *vmb_sched_p;
+
+struct virt_midi_backend_audio_driver_s {
+	vmb_settings_p		bs;
+	vmb_synth_p		bsynth;
+	pthread_mutex_t		render_mtx; /* Held while block rendered. */
+	vmb_sched_p		sched; /* Allocated on first use. */
+	double			sample_rate;
+	uint64_t		clock_base; /* Render thread: time of clock_samples = 0. */
+	uint64_t		clock_samples; /* Rendered since clock_base. */
+	fluid_audio_driver_t	*fad; /* NULL - suspended. */
+	vmb_a_stats_t		stats;
+	struct rusage		ru_last; /* Render thread counters on last sample. */
+	uint64_t		ru_block; /* ru_last sample block, 0 - no sample. */
+};
+
+
+static vmb_sfont_p vm_backend_sfont_get(vmb_settings_p bs, const char *file);
+static void	vm_backend_sfont_put(vmb_sfont_p sf);
+static int	vm_backend_fevent_handle(vmb_synth_p bsynth, vm_evt_p evt);
+
+
+static uint32_t
+vm_backend_time_get(void) {
+	struct timespec now;
+
+	if (0 != clock_gettime(CLOCK_MONOTONIC, &now))
+		return (0);
+	return ((uint32_t)now.tv_sec);
+}
+
+
+/* "file" driver takes output file name instead of device. */
+static void
+vm_backend_device_setting(const char *driver, char *buf, size_t buf_size) {
+
+	if (0 == strcmp(driver, "file")) {
+		strlcpy(buf, "audio.file.name", buf_size);
+	} else {
+		snprintf(buf, buf_size, "audio.%s.device", driver);
+	}
+}
+
 vmb_settings_p
 vm_backend_settings_new(vmb_options_p opts) {
 	char buf[32];
 	fluid_settings_t *s;
+	vmb_settings_p bs;
 
 	if (NULL == opts)
 		return (NULL);
+	bs = calloc(1, sizeof(struct virt_midi_backend_settings_s));
+	if (NULL == bs)
+		return (NULL);
 	s = new_fluid_settings();
-	if (NULL == s)
+	if (NULL == s) {
+		free(bs);
 		return (NULL);
+	}
+	bs->fs = s;
+	bs->ref_cnt = 1;
+	pthread_mutex_lock(&vmb_sfont_mtx);
+	bs->sfont_gen = vmb_sfont_gen;
+	pthread_mutex_unlock(&vmb_sfont_mtx);
+	bs->idle_timeout = opts->idle_timeout;
+	bs->reclaim_timeout = opts->reclaim_timeout;
 
 	if (NULL != opts->driver) {
 		fluid_settings_setstr(s, "audio.driver", opts->driver);
 		if (NULL != opts->device) {
-			snprintf(buf, sizeof(buf), "audio.%s.device", opts->driver);
+			vm_backend_device_setting(opts->driver, buf, sizeof(buf));
 			fluid_settings_setstr(s, buf, opts->device);
 		}
 	}
 	if (NULL != opts->soundfont) {
 		fluid_settings_setstr(s, "synth.default-soundfont", opts->soundfont);
 	}
-	fluid_settings_setint(s, "audio.realtime-prio", 0);
+	fluid_settings_setint(s, "audio.realtime-prio", MAX(0, opts->rt_prio));
+	if (0 != opts->low_latency) {
+		bs->low_latency = 1;
+		/* Load all samples with soundfont and page-lock them. */
+		fluid_settings_setint(s, "synth.dynamic-sample-loading", 0);
+		fluid_settings_setint(s, "synth.lock-memory", 1);
+	}
+
+	return (bs);
+}
 
-	return ((vmb_settings_p)s);
+void
+vm_backend_settings_ref(vmb_settings_p bs) {
+
+	if (NULL == bs)
+		return;
+	__atomic_add_fetch(&bs->ref_cnt, 1, __ATOMIC_RELAXED);
 }
 
 void
@@ -72,7 +230,40 @@ vm_backend_settings_free(vmb_settings_p bs) {
 
 	if (NULL == bs)
 		return;
-	delete_fluid_settings((fluid_settings_t*)bs);
+	if (0 != __atomic_sub_fetch(&bs->ref_cnt, 1, __ATOMIC_ACQ_REL))
+		return;
+	vm_backend_sfont_put(bs->sfont);
+	delete_fluid_settings(bs->fs);
+	free(bs);
+}
+
+/* Load soundfont from file again, not from cache: for generation that
+ * vm_backend_sfont_cache_flush() makes current. Settings hold it, so
+ * synths get it from cache. */
+int
+vm_backend_settings_sfont_load(vmb_settings_p bs) {
+	char *str = NULL;
+	vmb_sfont_p sf;
+
+	if (NULL == bs)
+		return (EINVAL);
+	if (FLUID_OK != fluid_settings_dupstr(bs->fs,
+	    "synth.default-soundfont", &str) ||
+	    0 == str[0]) {
+		fluid_free(str);
+		return (0); /* Nothing to load. */
+	}
+	pthread_mutex_lock(&vmb_sfont_mtx);
+	bs->sfont_gen = (vmb_sfont_gen + 1);
+	pthread_mutex_unlock(&vmb_sfont_mtx);
+	sf = vm_backend_sfont_get(bs, str);
+	fluid_free(str);
+	if (NULL == sf)
+		return (EIO);
+	vm_backend_sfont_put(bs->sfont);
+	bs->sfont = sf;
+
+	return (0);
 }
 
 
@@ -83,12 +274,12 @@ vm_backend_settings_get_device(vmb_settings_p bs, char *buf, size_t buf_size) {
 
 	if (NULL == bs)
 		return (EINVAL);
-	if (FLUID_OK != fluid_settings_dupstr((fluid_settings_t*)bs,
+	if (FLUID_OK != fluid_settings_dupstr(bs->fs,
 	    "audio.driver", &driver) ||
 	    0 == driver[0])
 		goto err_out;
-	snprintf(buf_tmp, sizeof(buf_tmp), "audio.%s.device", driver);
-	if (FLUID_OK != fluid_settings_dupstr((fluid_settings_t*)bs,
+	vm_backend_device_setting(driver, buf_tmp, sizeof(buf_tmp));
+	if (FLUID_OK != fluid_settings_dupstr(bs->fs,
 	    buf_tmp, &device) ||
 	    0 == device[0])
 		goto err_out;
@@ -103,26 +294,295 @@ err_out:
 }
 
 
-vmb_synth_p
-vm_backend_synth_new(vmb_settings_p bs) {
+static void
+vm_backend_sfont_free(vmb_sfont_p sf) {
+
+	if (NULL != sf->holder) {
+		delete_fluid_synth(sf->holder); /* Also free sfont. */
+	}
+	if (NULL != sf->fs) {
+		delete_fluid_settings(sf->fs);
+	}
+	free(sf);
+}
+
+/* Return loaded soundfont from cache, load it on first use.
+ * Load done without vmb_sfont_mtx, other users of same file wait for it. */
+static vmb_sfont_p
+vm_backend_sfont_get(vmb_settings_p bs, const char *file) {
+	int sfont_id, val;
+	size_t file_size;
+	vmb_sfont_p sf;
+
+	pthread_mutex_lock(&vmb_sfont_mtx);
+	TAILQ_FOREACH(sf, &vmb_sfont_list, next) {
+		if (bs->sfont_gen == sf->gen &&
+		    0 == strcmp(sf->file, file))
+			goto found;
+	}
+	file_size = (strlen(file) + 1);
+	sf = calloc(1, (sizeof(vmb_sfont_t) + file_size));
+	if (NULL == sf) {
+		pthread_mutex_unlock(&vmb_sfont_mtx);
+		return (NULL);
+	}
+	memcpy(sf->file, file, file_size);
+	sf->gen = bs->sfont_gen;
+	sf->ref_cnt = 1;
+	sf->loading = 1;
+	TAILQ_INSERT_TAIL(&vmb_sfont_list, sf, next);
+	pthread_mutex_unlock(&vmb_sfont_mtx);
+
+	sf->fs = new_fluid_settings();
+	if (NULL == sf->fs)
+		goto err_out;
+	/* Settings that affect sample data. */
+	if (FLUID_OK == fluid_settings_getint(bs->fs,
+	    "synth.dynamic-sample-loading", &val)) {
+		fluid_settings_setint(sf->fs, "synth.dynamic-sample-loading", val);
+	}
+	if (FLUID_OK == fluid_settings_getint(bs->fs, "synth.lock-memory", &val)) {
+		fluid_settings_setint(sf->fs, "synth.lock-memory", val);
+	}
+	fluid_settings_setint(sf->fs, "synth.polyphony", 1); /* Never play. */
+	sf->holder = new_fluid_synth(sf->fs);
+	if (NULL == sf->holder)
+		goto err_out;
+	sfont_id = fluid_synth_sfload(sf->holder, file, 0);
+	if (FLUID_FAILED == sfont_id)
+		goto err_out;
+	sf->sfont = fluid_synth_get_sfont_by_id(sf->holder, sfont_id);
+	if (NULL == sf->sfont)
+		goto err_out;
+	sf->sfont_id = sfont_id;
+
+	pthread_mutex_lock(&vmb_sfont_mtx);
+	sf->loading = 0;
+	pthread_cond_broadcast(&vmb_sfont_cv);
+	pthread_mutex_unlock(&vmb_sfont_mtx);
+
+	return (sf);
+
+found:
+	sf->ref_cnt ++;
+	while (0 != sf->loading) {
+		pthread_cond_wait(&vmb_sfont_cv, &vmb_sfont_mtx);
+	}
+	if (NULL != sf->sfont) {
+		pthread_mutex_unlock(&vmb_sfont_mtx);
+		return (sf);
+	}
+	/* Load failed, loader already removed it from list. */
+	sf->ref_cnt --;
+	val = (0 == sf->ref_cnt);
+	pthread_mutex_unlock(&vmb_sfont_mtx);
+	if (0 != val) {
+		vm_backend_sfont_free(sf);
+	}
+
+	return (NULL);
+
+err_out:
+	pthread_mutex_lock(&vmb_sfont_mtx);
+	TAILQ_REMOVE(&vmb_sfont_list, sf, next);
+	sf->sfont = NULL;
+	sf->loading = 0;
+	sf->ref_cnt --;
+	val = (0 == sf->ref_cnt);
+	pthread_cond_broadcast(&vmb_sfont_cv);
+	pthread_mutex_unlock(&vmb_sfont_mtx);
+	if (0 != val) {
+		vm_backend_sfont_free(sf);
+	}
+
+	return (NULL);
+}
+
+static void
+vm_backend_sfont_put(vmb_sfont_p sf) {
+
+	if (NULL == sf)
+		return;
+	pthread_mutex_lock(&vmb_sfont_mtx);
+	sf->ref_cnt --;
+	if (0 != sf->ref_cnt) {
+		pthread_mutex_unlock(&vmb_sfont_mtx);
+		return;
+	}
+	TAILQ_REMOVE(&vmb_sfont_list, sf, next);
+	pthread_mutex_unlock(&vmb_sfont_mtx);
+	vm_backend_sfont_free(sf);
+}
+
+/* Soundfonts loaded by vm_backend_settings_sfont_load() become current,
+ * older ones stay loaded while used. */
+void
+vm_backend_sfont_cache_flush(void) {
+
+	pthread_mutex_lock(&vmb_sfont_mtx);
+	vmb_sfont_gen ++;
+	pthread_mutex_unlock(&vmb_sfont_mtx);
+}
+
+static int
+vm_backend_fsynth_new(vmb_synth_p bsynth) {
+	int val = 0;
 	char *str = NULL;
 	fluid_synth_t *synth;
 
-	if (NULL == bs)
-		return (NULL);
-	synth = new_fluid_synth((fluid_settings_t*)bs);
+	synth = new_fluid_synth(bsynth->bs->fs);
 	if (NULL == synth)
-		return (NULL);
+		return (ENOMEM);
 
-	/* Load soundfont. */
-	if (FLUID_OK == fluid_settings_dupstr((fluid_settings_t*)bs,
+	/* Soundfont. */
+	if (FLUID_OK == fluid_settings_dupstr(bsynth->bs->fs,
 	    "synth.default-soundfont", &str) &&
 	    0 != str[0]) {
-		fluid_synth_sfload(synth, str, 1);
+		fluid_settings_getint(bsynth->bs->fs,
+		    "synth.dynamic-sample-loading", &val);
+		if (0 == val) { /* Shared, see vmb_sfont_t. */
+			bsynth->sfont = vm_backend_sfont_get(bsynth->bs, str);
+		} else { /* Synth owns it. */
+			fluid_synth_sfload(synth, str, 0);
+		}
+		if (NULL != bsynth->sfont &&
+		    bsynth->sfont->sfont_id != fluid_synth_add_sfont(synth,
+		    bsynth->sfont->sfont)) {
+			syslog(LOG_ERR, "%s: shared soundfont got other id, "
+			    "loading own copy", str);
+			fluid_synth_remove_sfont(synth, bsynth->sfont->sfont);
+			vm_backend_sfont_put(bsynth->sfont);
+			bsynth->sfont = NULL;
+			fluid_synth_sfload(synth, str, 0);
+		}
+		fluid_synth_program_reset(synth);
 	}
 	fluid_free(str);
+	bsynth->fsynth = synth;
+	memset(bsynth->param_sel, 0x00, sizeof(bsynth->param_sel));
+
+	return (0);
+}
+
+static void
+vm_backend_fsynth_free(vmb_synth_p bsynth) {
+
+	if (NULL == bsynth->fsynth)
+		return;
+	if (NULL != bsynth->sfont) {
+		/* Synth must not free shared sfont. */
+		fluid_synth_remove_sfont(bsynth->fsynth, bsynth->sfont->sfont);
+	}
+	delete_fluid_synth(bsynth->fsynth);
+	bsynth->fsynth = NULL;
+	vm_backend_sfont_put(bsynth->sfont);
+	bsynth->sfont = NULL;
+}
+
+/* Controllers that are not restored: handled separately or
+ * have side effects. */
+static int
+vm_backend_cc_is_restorable(const int ctl) {
+
+	switch (ctl) {
+	case MIDI_CTL_BANK_SELECT:
+	case (MIDI_CTL_BANK_SELECT + MIDI_CTL_LSB_OFFSET):
+	case MIDI_CTL_DATA_ENTRY:
+	case MIDI_CTL_DATA_ENTRY_LSB:
+	case MIDI_CTL_DATA_INCREMENT:
+	case MIDI_CTL_DATA_DECREMENT:
+	case MIDI_CTL_NRPN_LSB:
+	case MIDI_CTL_NRPN_MSB:
+	case MIDI_CTL_RPN_LSB:
+	case MIDI_CTL_RPN_MSB:
+		return (0);
+	default:
+		break;
+	}
+	/* 120-127: Channel mode messages. */
+	return ((120 > ctl) ? 1 : 0);
+}
+
+static void
+vm_backend_synth_state_save(fluid_synth_t *synth, vmb_chan_state_p state,
+    const int chan_count) {
+	int sfont_id, val;
+	vmb_chan_state_p st;
+
+	for (int i = 0; i < chan_count; i ++) {
+		st = &state[i];
+		fluid_synth_get_program(synth, i, &sfont_id,
+		    &st->bank, &st->program);
+		fluid_synth_get_pitch_bend(synth, i, &st->pitch_bend);
+		fluid_synth_get_pitch_wheel_sens(synth, i,
+		    &st->pitch_wheel_sens);
+		st->fine_tune = fluid_synth_get_gen(synth, i, GEN_FINETUNE);
+		st->coarse_tune = fluid_synth_get_gen(synth, i, GEN_COARSETUNE);
+		for (int j = 0; j < 128; j ++) {
+			val = 0;
+			fluid_synth_get_cc(synth, i, j, &val);
+			st->cc[j] = (uint8_t)val;
+		}
+	}
+}
+
+static void
+vm_backend_synth_state_restore(fluid_synth_t *synth, vmb_chan_state_p state,
+    const int chan_count) {
+	vmb_chan_state_p st;
+
+	for (int i = 0; i < chan_count; i ++) {
+		st = &state[i];
+		fluid_synth_bank_select(synth, i, st->bank);
+		fluid_synth_program_change(synth, i, st->program);
+		for (int j = 0; j < 128; j ++) {
+			if (0 == vm_backend_cc_is_restorable(j))
+				continue;
+			fluid_synth_cc(synth, i, j, st->cc[j]);
+		}
+		fluid_synth_pitch_wheel_sens(synth, i, st->pitch_wheel_sens);
+		fluid_synth_pitch_bend(synth, i, st->pitch_bend);
+		fluid_synth_set_gen(synth, i, GEN_FINETUNE, st->fine_tune);
+		fluid_synth_set_gen(synth, i, GEN_COARSETUNE, st->coarse_tune);
+	}
+}
+
+void
+vm_backend_stats_log(void) {
+	size_t count = 0, users = 0;
+	vmb_sfont_p sf;
+
+	pthread_mutex_lock(&vmb_sfont_mtx);
+	TAILQ_FOREACH(sf, &vmb_sfont_list, next) {
+		count ++;
+		users += sf->ref_cnt;
+	}
+	pthread_mutex_unlock(&vmb_sfont_mtx);
+
+	syslog(LOG_INFO, "soundfont cache: %zu soundfonts, %zu synths use them",
+	    count, users);
+}
+
+
+vmb_synth_p
+vm_backend_synth_new(vmb_settings_p bs) {
+	vmb_synth_p bsynth;
+
+	if (NULL == bs)
+		return (NULL);
+	bsynth = calloc(1, sizeof(struct virt_midi_backend_synth_s));
+	if (NULL == bsynth)
+		return (NULL);
+	bsynth->bs = bs;
+	if (0 != vm_backend_fsynth_new(bsynth)) {
+		free(bsynth);
+		return (NULL);
+	}
+	vm_backend_settings_ref(bs);
+	bsynth->chan_count = fluid_synth_count_midi_channels(bsynth->fsynth);
+	bsynth->active_time = vm_backend_time_get();
 
-	return ((vmb_synth_p)synth);
+	return (bsynth);
 }
 
 void
@@ -130,18 +590,351 @@ vm_backend_synth_free(vmb_synth_p bsynth) {
 
 	if (NULL == bsynth)
 		return;
-	delete_fluid_synth((fluid_synth_t*)bsynth);
+	vm_backend_fsynth_free(bsynth);
+	vm_backend_settings_free(bsynth->bs);
+	free(bsynth->state);
+	free(bsynth);
+}
+
+int
+vm_backend_synth_reclaim(vmb_synth_p bsynth) {
+
+	if (NULL == bsynth)
+		return (EINVAL);
+	if (NULL == bsynth->fsynth)
+		return (0); /* Already reclaimed. */
+	if (NULL == bsynth->state) {
+		bsynth->state = calloc((size_t)bsynth->chan_count,
+		    sizeof(vmb_chan_state_t));
+		if (NULL == bsynth->state)
+			return (ENOMEM);
+	}
+	vm_backend_synth_state_save(bsynth->fsynth, bsynth->state,
+	    bsynth->chan_count);
+	/* Voices and presets memory, samples freed with last sfont user. */
+	vm_backend_fsynth_free(bsynth);
+
+	return (0);
+}
+
+int
+vm_backend_synth_restore(vmb_synth_p bsynth) {
+
+	if (NULL == bsynth)
+		return (EINVAL);
+	if (NULL != bsynth->fsynth)
+		return (0);
+	bsynth->active_time = vm_backend_time_get();
+	if (0 != vm_backend_fsynth_new(bsynth))
+		return (ENOMEM);
+	if (NULL != bsynth->state) {
+		vm_backend_synth_state_restore(bsynth->fsynth, bsynth->state,
+		    bsynth->chan_count);
+		free(bsynth->state);
+		bsynth->state = NULL;
+	}
+
+	return (0);
+}
+
+int
+vm_backend_synth_swap(vmb_a_drv_p badrv, vmb_synth_p bsynth,
+    vmb_synth_p new_bsynth) {
+	vmb_settings_p bs, drv_bs;
+	fluid_synth_t *fsynth;
+	vmb_sfont_p sfont;
+	vmb_chan_state_p state;
+	int chan_count;
+
+	if (NULL == bsynth ||
+	    NULL == new_bsynth ||
+	    NULL == new_bsynth->fsynth)
+		return (EINVAL);
+	if (NULL == bsynth->fsynth) {
+		/* Reclaimed: keep saved state, restore will use new
+		 * settings and soundfont. */
+		vm_backend_fsynth_free(new_bsynth);
+		bs = bsynth->bs;
+		bsynth->bs = new_bsynth->bs;
+		new_bsynth->bs = bs;
+		if (NULL != badrv) { /* Suspended, no render thread. */
+			vm_backend_settings_ref(bsynth->bs);
+			bs = badrv->bs;
+			badrv->bs = bsynth->bs;
+			vm_backend_settings_free(bs);
+		}
+		return (0);
+	}
+	/* Caller does not send events now, render thread only read synth. */
+	state = calloc((size_t)bsynth->chan_count, sizeof(vmb_chan_state_t));
+	if (NULL == state)
+		return (ENOMEM);
+	vm_backend_synth_state_save(bsynth->fsynth, state, bsynth->chan_count);
+	vm_backend_synth_state_restore(new_bsynth->fsynth, state,
+	    MIN(bsynth->chan_count, new_bsynth->chan_count));
+	free(state);
+
+	/* Between render blocks. */
+	if (NULL != badrv) {
+		pthread_mutex_lock(&badrv->render_mtx);
+	}
+	bs = bsynth->bs;
+	fsynth = bsynth->fsynth;
+	sfont = bsynth->sfont;
+	chan_count = bsynth->chan_count;
+	bsynth->bs = new_bsynth->bs;
+	bsynth->fsynth = new_bsynth->fsynth;
+	bsynth->sfont = new_bsynth->sfont;
+	bsynth->chan_count = new_bsynth->chan_count;
+	memset(bsynth->param_sel, 0x00, sizeof(bsynth->param_sel));
+	if (NULL != badrv) {
+		/* Running audio driver keep settings it was created with
+		 * until resume, only timeouts and flags used from here. */
+		vm_backend_settings_ref(bsynth->bs);
+		drv_bs = badrv->bs;
+		badrv->bs = bsynth->bs;
+		pthread_mutex_unlock(&badrv->render_mtx);
+		vm_backend_settings_free(drv_bs);
+	}
+	new_bsynth->bs = bs;
+	new_bsynth->fsynth = fsynth;
+	new_bsynth->sfont = sfont;
+	new_bsynth->chan_count = chan_count;
+
+	return (0);
+}
+
+
+/* Branchless, so compiler can vectorize it. */
+static int
+vm_backend_audio_is_silent(float *buf[], const int count, const int len) {
+	int loud = 0;
+
+	for (int i = 0; i < count; i ++) {
+		const float *pbuf = buf[i];
+
+		for (int j = 0; j < len; j ++) {
+			loud |= ((VMB_SILENCE_LEVEL < pbuf[j]) |
+			    (-VMB_SILENCE_LEVEL > pbuf[j]));
+		}
+	}
+
+	return (0 == loud);
+}
+
+static int
+vm_backend_sched_evt_less(const vmb_sched_evt_p a, const vmb_sched_evt_p b) {
+
+	if (a->time != b->time)
+		return (a->time < b->time);
+	return (0 > (int32_t)(a->seq - b->seq));
+}
+
+/* Render thread: move events from ring to heap. */
+static void
+vm_backend_sched_fetch(vmb_sched_p sched) {
+	size_t head, tail = sched->tail, i, parent, count = sched->heap_count;
+	vmb_sched_evt_t tmp;
+
+	head = __atomic_load_n(&sched->head, __ATOMIC_ACQUIRE);
+	if (tail == head)
+		return;
+	for (; tail != head; tail ++) {
+		/* Producer keeps ring + heap count under VMB_SCHED_SIZE. */
+		i = count ++;
+		sched->heap[i] = sched->ring[(tail & (VMB_SCHED_SIZE - 1))];
+		while (0 != i) { /* Sift up. */
+			parent = ((i - 1) / 2);
+			if (0 == vm_backend_sched_evt_less(&sched->heap[i],
+			    &sched->heap[parent]))
+				break;
+			tmp = sched->heap[i];
+			sched->heap[i] = sched->heap[parent];
+			sched->heap[parent] = tmp;
+			i = parent;
+		}
+	}
+	/* Heap count first: producer must not see free space early. */
+	__atomic_store_n(&sched->heap_count, count, __ATOMIC_RELEASE);
+	__atomic_store_n(&sched->tail, tail, __ATOMIC_RELEASE);
+}
+
+/* Render thread: remove first event from heap. */
+static void
+vm_backend_sched_pop(vmb_sched_p sched) {
+	size_t i = 0, child, count = (sched->heap_count - 1);
+	vmb_sched_evt_t tmp;
+
+	sched->heap[0] = sched->heap[count];
+	for (;;) { /* Sift down. */
+		child = ((2 * i) + 1);
+		if (child >= count)
+			break;
+		if ((child + 1) < count &&
+		    0 != vm_backend_sched_evt_less(&sched->heap[(child + 1)],
+		    &sched->heap[child])) {
+			child ++;
+		}
+		if (0 == vm_backend_sched_evt_less(&sched->heap[child],
+		    &sched->heap[i]))
+			break;
+		tmp = sched->heap[i];
+		sched->heap[i] = sched->heap[child];
+		sched->heap[child] = tmp;
+		i = child;
+	}
+	__atomic_store_n(&sched->heap_count, count, __ATOMIC_RELEASE);
+}
+
+/* Render part of block: [off, off + len). */
+static int
+vm_backend_audio_render_part(fluid_synth_t *synth, const int off,
+    const int len, int nfx, float *fx[], int nout, float *out[]) {
+	float *fx_off[VMB_RENDER_MAX_BUFS], *out_off[VMB_RENDER_MAX_BUFS];
+
+	if (0 == len)
+		return (FLUID_OK);
+	for (int i = 0; i < nfx; i ++) {
+		fx_off[i] = (fx[i] + off);
+	}
+	for (int i = 0; i < nout; i ++) {
+		out_off[i] = (out[i] + off);
+	}
+
+	return (fluid_synth_process(synth, len, nfx, fx_off, nout, out_off));
+}
+
+/* Render block, apply scheduled events at their sample offsets.
+ * Synth handle events between its internal 64 samples blocks. */
+static int
+vm_backend_audio_render_sched(vmb_a_drv_p badrv, vmb_sched_p sched,
+    int len, int nfx, float *fx[], int nout, float *out[]) {
+	int error, off = 0, pos;
+	uint64_t now, start, block_ns;
+	vmb_sched_evt_p sevt;
+	vmb_synth_p bsynth = badrv->bsynth;
+	fluid_synth_t *synth = bsynth->fsynth;
+
+	/* Block time: by rendered samples count, so events offsets do
+	 * not jitter with callback wakeup time.  Resync if clock
+	 * drift more than 2 blocks: first block, resume after suspend. */
+	now = vm_backend_clock_get();
+	block_ns = (uint64_t)(((double)len * 1000000000.0) / badrv->sample_rate);
+	start = (badrv->clock_base + (uint64_t)(((double)badrv->clock_samples *
+	    1000000000.0) / badrv->sample_rate));
+	if (0 == badrv->clock_base ||
+	    now > (start + (2 * block_ns)) ||
+	    (now + (2 * block_ns)) < start) {
+		badrv->clock_base = now;
+		badrv->clock_samples = 0;
+		start = now;
+	}
+	badrv->clock_samples += (uint64_t)len;
+
+	vm_backend_sched_fetch(sched);
+	while (0 != sched->heap_count) {
+		sevt = &sched->heap[0];
+		if (sevt->time >= (start + block_ns))
+			break;
+		if (sevt->time <= start ||
+		    VMB_RENDER_MAX_BUFS < nfx ||
+		    VMB_RENDER_MAX_BUFS < nout) { /* Late or can not split. */
+			pos = 0;
+		} else {
+			pos = (int)(((double)(sevt->time - start) *
+			    badrv->sample_rate) / 1000000000.0);
+			pos = MIN(pos, (len - 1));
+		}
+		if (pos > off) {
+			error = vm_backend_audio_render_part(synth, off,
+			    (pos - off), nfx, fx, nout, out);
+			if (FLUID_OK != error)
+				return (error);
+			off = pos;
+		}
+		vm_backend_fevent_handle(bsynth, &sevt->evt);
+		vm_backend_sched_pop(sched);
+	}
+
+	return (vm_backend_audio_render_part(synth, off, (len - off),
+	    nfx, fx, nout, out));
 }
 
+static int
+vm_backend_audio_render(void *data, int len, int nfx, float *fx[],
+    int nout, float *out[]) {
+	vmb_a_drv_p badrv = data;
+	int error;
+	vmb_sched_p sched;
+	struct rusage ru;
+	int low_latency;
+	uint32_t idle_timeout;
+
+	badrv->stats.blocks ++;
+	/* Only vm_backend_synth_swap() may hold it. */
+	pthread_mutex_lock(&badrv->render_mtx);
+	/* Settings may be swapped on reload. */
+	low_latency = badrv->bs->low_latency;
+	idle_timeout = badrv->bs->idle_timeout;
+	sched = __atomic_load_n(&badrv->sched, __ATOMIC_ACQUIRE);
+	if (NULL == sched) {
+		error = fluid_synth_process(badrv->bsynth->fsynth,
+		    len, nfx, fx, nout, out);
+	} else {
+		error = vm_backend_audio_render_sched(badrv, sched,
+		    len, nfx, fx, nout, out);
+	}
+	pthread_mutex_unlock(&badrv->render_mtx);
+	/* Count render thread page faults, syscall only once per
+	 * VMB_RUSAGE_BLOCKS blocks, first sample is base. */
+	if (0 != low_latency &&
+	    (0 == badrv->ru_block ||
+	     VMB_RUSAGE_BLOCKS <= (badrv->stats.blocks - badrv->ru_block)) &&
+	    0 == getrusage(RUSAGE_THREAD, &ru)) {
+		if (0 != badrv->ru_block) {
+			badrv->stats.minflt += (uint64_t)(ru.ru_minflt -
+			    badrv->ru_last.ru_minflt);
+			badrv->stats.majflt += (uint64_t)(ru.ru_majflt -
+			    badrv->ru_last.ru_majflt);
+		}
+		badrv->ru_last = ru;
+		badrv->ru_block = badrv->stats.blocks;
+	}
+	if (FLUID_OK != error ||
+	    0 == idle_timeout)
+		return (error);
+	if (0 == vm_backend_audio_is_silent(out, nout, len) ||
+	    0 == vm_backend_audio_is_silent(fx, nfx, len)) {
+		badrv->bsynth->active_time = vm_backend_time_get();
+	}
+
+	return (error);
+}
 
 vmb_a_drv_p
 vm_backend_audio_driver_new(vmb_settings_p bs, vmb_synth_p bsynth) {
+	vmb_a_drv_p badrv;
 
 	if (NULL == bs ||
 	    NULL == bsynth)
 		return (NULL);
-	return ((vmb_a_drv_p)new_fluid_audio_driver((fluid_settings_t*)bs,
-	    (fluid_synth_t*)bsynth));
+	badrv = calloc(1, sizeof(struct virt_midi_backend_audio_driver_s));
+	if (NULL == badrv)
+		return (NULL);
+	if (0 != pthread_mutex_init(&badrv->render_mtx, NULL)) {
+		free(badrv);
+		return (NULL);
+	}
+	badrv->bs = bs;
+	badrv->bsynth = bsynth;
+	if (0 != vm_backend_audio_driver_resume(badrv)) {
+		pthread_mutex_destroy(&badrv->render_mtx);
+		free(badrv);
+		return (NULL);
+	}
+	vm_backend_settings_ref(bs);
+
+	return (badrv);
 }
 
 void
@@ -149,20 +942,265 @@ vm_backend_audio_driver_free(vmb_a_drv_p badrv) {
 
 	if (NULL == badrv)
 		return;
-	delete_fluid_audio_driver((fluid_audio_driver_t*)badrv);
+	vm_backend_audio_driver_suspend(badrv);
+	vm_backend_settings_free(badrv->bs);
+	pthread_mutex_destroy(&badrv->render_mtx);
+	free(badrv->sched);
+	free(badrv);
 }
 
+int
+vm_backend_audio_driver_resume(vmb_a_drv_p badrv) {
+
+	if (NULL == badrv)
+		return (EINVAL);
+	if (0 != vm_backend_synth_restore(badrv->bsynth))
+		return (ENOMEM);
+	badrv->bsynth->active_time = vm_backend_time_get();
+	if (NULL != badrv->fad)
+		return (0);
+	badrv->ru_block = 0; /* New render thread. */
+	badrv->clock_base = 0;
+	/* Settings may be changed by reload. */
+	if (FLUID_OK != fluid_settings_getnum(badrv->bs->fs, "synth.sample-rate",
+	    &badrv->sample_rate) ||
+	    0.0 >= badrv->sample_rate) {
+		badrv->sample_rate = 44100.0;
+	}
+	badrv->fad = new_fluid_audio_driver2(badrv->bs->fs,
+	    vm_backend_audio_render, badrv);
+	if (NULL == badrv->fad)
+		return (EIO);
+
+	return (0);
+}
+
+void
+vm_backend_audio_driver_suspend(vmb_a_drv_p badrv) {
+
+	if (NULL == badrv ||
+	    NULL == badrv->fad)
+		return;
+	delete_fluid_audio_driver(badrv->fad);
+	badrv->fad = NULL;
+}
 
-/* fluid_synth_handle_midi_event(). */
 int
-vm_backend_event_handle(vmb_synth_p bsynth, vm_evt_p evt) {
-	fluid_synth_t *synth = (fluid_synth_t*)bsynth;
+vm_backend_audio_driver_stats_get(vmb_a_drv_p badrv, vmb_a_stats_p stats) {
 
-	if (NULL == bsynth ||
-	    NULL == evt)
+	if (NULL == badrv || NULL == stats)
+		return (EINVAL);
+	memcpy(stats, &badrv->stats, sizeof(vmb_a_stats_t));
+
+	return (0);
+}
+
+uint64_t
+vm_backend_clock_get(void) {
+	struct timespec now;
+
+	if (0 != clock_gettime(CLOCK_MONOTONIC, &now))
+		return (0);
+	return (((uint64_t)now.tv_sec * 1000000000ull) + (uint64_t)now.tv_nsec);
+}
+
+int
+vm_backend_audio_driver_sched_init(vmb_a_drv_p badrv) {
+	vmb_sched_p sched;
+
+	if (NULL == badrv)
+		return (EINVAL);
+	if (NULL != __atomic_load_n(&badrv->sched, __ATOMIC_ACQUIRE))
+		return (0);
+	sched = calloc(1, sizeof(vmb_sched_t));
+	if (NULL == sched)
+		return (ENOMEM);
+	if (!__atomic_compare_exchange_n(&badrv->sched, &(vmb_sched_p){ NULL },
+	    sched, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+		free(sched); /* Other thread was first. */
+	}
+
+	return (0);
+}
+
+size_t
+vm_backend_audio_driver_sched_free(vmb_a_drv_p badrv) {
+	vmb_sched_p sched;
+
+	if (NULL == badrv ||
+	    NULL == (sched = __atomic_load_n(&badrv->sched, __ATOMIC_ACQUIRE)))
+		return (0);
+	return (VMB_SCHED_SIZE - vm_backend_audio_driver_sched_pending(badrv));
+}
+
+size_t
+vm_backend_audio_driver_sched_pending(vmb_a_drv_p badrv) {
+	vmb_sched_p sched;
+	size_t tail, heap_count;
+
+	if (NULL == badrv ||
+	    NULL == (sched = __atomic_load_n(&badrv->sched, __ATOMIC_ACQUIRE)))
+		return (0);
+	/* Tail before heap count: moved event counted at least once. */
+	tail = __atomic_load_n(&sched->tail, __ATOMIC_ACQUIRE);
+	heap_count = __atomic_load_n(&sched->heap_count, __ATOMIC_ACQUIRE);
+
+	return ((__atomic_load_n(&sched->head, __ATOMIC_ACQUIRE) - tail) +
+	    heap_count);
+}
+
+int
+vm_backend_event_schedule(vmb_a_drv_p badrv, vm_evt_p evt,
+    const uint64_t time) {
+	vmb_sched_p sched;
+	vmb_sched_evt_p sevt;
+
+	if (NULL == badrv ||
+	    NULL == evt ||
+	    NULL == (sched = __atomic_load_n(&badrv->sched, __ATOMIC_ACQUIRE)))
+		return (EINVAL);
+	if (MIDI_SYSEX == evt->type) /* Data is not owned by event. */
+		return (EOPNOTSUPP);
+	if (0 == vm_backend_audio_driver_sched_free(badrv))
+		return (EAGAIN);
+	sevt = &sched->ring[(sched->head & (VMB_SCHED_SIZE - 1))];
+	sevt->time = time;
+	sevt->seq = sched->seq ++;
+	memcpy(&sevt->evt, evt, sizeof(vm_evt_t));
+	__atomic_store_n(&sched->head, (sched->head + 1), __ATOMIC_RELEASE);
+
+	return (0);
+}
+
+int
+vm_backend_audio_driver_idle_check(vmb_a_drv_p badrv) {
+	uint32_t idle_time;
+
+	if (NULL == badrv)
 		return (EINVAL);
+	idle_time = (vm_backend_time_get() - badrv->bsynth->active_time);
+	if (NULL != badrv->fad) {
+		if (0 == badrv->bs->idle_timeout ||
+		    badrv->bs->idle_timeout > idle_time ||
+		    0 != fluid_synth_get_active_voice_count(badrv->bsynth->fsynth) ||
+		    0 != vm_backend_audio_driver_sched_pending(badrv))
+			return (EBUSY);
+		vm_backend_audio_driver_suspend(badrv);
+	}
+	/* Driver suspended: synth is not used by render thread. */
+	if (0 != badrv->bs->reclaim_timeout &&
+	    badrv->bs->reclaim_timeout <= idle_time) {
+		vm_backend_synth_reclaim(badrv->bsynth);
+	}
+
+	return (0);
+}
+
+
+void
+vm_backend_event_filter_get(vm_evt_filter_p filter) {
+
+	if (NULL == filter)
+		return;
+	vm_event_filter_init(filter, 0);
+	/* Channel messages and SYSEX. */
+	vm_event_filter_set(filter, MIDI_NOTEOFF, MIDI_SYSEX, 1);
+	vm_event_filter_set(filter, MIDI_SYSTEM_RESET, MIDI_SYSTEM_RESET, 1);
+}
+
+/* Controller update only if value changed: fluid updates voices
+ * modulators on each fluid_synth_cc() call. */
+static int
+vm_backend_cc_changed(fluid_synth_t *synth, const int chan, const int ctl,
+    const int value) {
+	int cur;
+
+	if (FLUID_OK == fluid_synth_get_cc(synth, chan, ctl, &cur) &&
+	    cur == value)
+		return (FLUID_OK);
+	return (fluid_synth_cc(synth, chan, ctl, value));
+}
+
+/* Replay (N)RPN as controllers sequence, fluid handle it by itself.
+ * Selectors are sent only if other parameter selected in fluid:
+ * usually 1 call per value.
+ * Data entry LSB only stored by fluid, MSB applies whole value once. */
+static int
+vm_backend_param_cc(vmb_synth_p bsynth, vm_evt_p evt) {
+	fluid_synth_t *synth = bsynth->fsynth;
+	int chan = evt->chan, ctl_msb, ctl_lsb;
+	const uint32_t sel = (((uint32_t)evt->type << 16) | (evt->p1 & 0x3FFF));
+
+	if (sel == bsynth->param_sel[(chan & 0x0F)])
+		goto data_entry;
+	if (VM_EVT_RPN == evt->type) {
+		ctl_msb = MIDI_CTL_RPN_MSB;
+		ctl_lsb = MIDI_CTL_RPN_LSB;
+	} else {
+		ctl_msb = MIDI_CTL_NRPN_MSB;
+		ctl_lsb = MIDI_CTL_NRPN_LSB;
+	}
+	if (FLUID_OK != fluid_synth_cc(synth, chan, ctl_msb,
+	    (int)((evt->p1 >> 7) & 0x7F)) ||
+	    FLUID_OK != fluid_synth_cc(synth, chan, ctl_lsb,
+	    (int)(evt->p1 & 0x7F))) {
+		bsynth->param_sel[(chan & 0x0F)] = 0;
+		return (EIO);
+	}
+	bsynth->param_sel[(chan & 0x0F)] = sel;
+data_entry:
+	if (VM_EVT_PARAM_SELECT == evt->p2)
+		return (0);
+	if (FLUID_OK != vm_backend_cc_changed(synth, chan,
+	    MIDI_CTL_DATA_ENTRY_LSB, (int)(evt->p2 & 0x7F)) ||
+	    FLUID_OK != fluid_synth_cc(synth, chan, MIDI_CTL_DATA_ENTRY,
+	    (int)((evt->p2 >> 7) & 0x7F)))
+		return (EIO);
+	if (VM_EVT_NRPN == evt->type &&
+	    VMB_NRPN_SF2_MSB == (evt->p1 >> 7)) {
+		/* fluid reset accumulated SF2 generator select. */
+		bsynth->param_sel[(chan & 0x0F)] = 0;
+	}
+
+	return (0);
+}
+
+/* fluid_synth_handle_midi_event(). */
+static int
+vm_backend_fevent_handle(vmb_synth_p bsynth, vm_evt_p evt) {
+	fluid_synth_t *synth = bsynth->fsynth;
 
 	switch (evt->type) {
+	case VM_EVT_CTL_CHANGE14: /* Usually only LSB changes: 1 update. */
+		if (FLUID_OK != vm_backend_cc_changed(synth, evt->chan,
+		    (int)(evt->p1 + MIDI_CTL_LSB_OFFSET),
+		    (int)(evt->p2 & 0x7F)))
+			return (EIO);
+		return ((FLUID_OK == vm_backend_cc_changed(synth, evt->chan,
+		    (int)evt->p1, (int)((evt->p2 >> 7) & 0x7F))) ? 0 : EIO);
+	case VM_EVT_RPN:
+		/* Same as fluid RPN data entry handler, but without
+		 * 4 controllers updates. */
+		if (VM_EVT_PARAM_SELECT == evt->p2)
+			return (vm_backend_param_cc(bsynth, evt));
+		switch (evt->p1) {
+		case 0x0000: /* Pitch bend range, semitones. */
+			return ((FLUID_OK == fluid_synth_pitch_wheel_sens(synth,
+			    evt->chan, (int)(evt->p2 >> 7))) ? 0 : EIO);
+		case 0x0001: /* Fine tune: +/- 100 cents, 8192 = center. */
+			return ((FLUID_OK == fluid_synth_set_gen(synth,
+			    evt->chan, GEN_FINETUNE,
+			    ((float)((int)evt->p2 - 8192) * (100.0f / 8192.0f)))) ? 0 : EIO);
+		case 0x0002: /* Coarse tune: semitones, 64 = center. */
+			return ((FLUID_OK == fluid_synth_set_gen(synth,
+			    evt->chan, GEN_COARSETUNE,
+			    (float)((int)(evt->p2 >> 7) - 64))) ? 0 : EIO);
+		default:
+			break;
+		}
+		__attribute__((fallthrough)); /* PASSTROUTH. */
+	case VM_EVT_NRPN:
+		return (vm_backend_param_cc(bsynth, evt));
 	case MIDI_NOTEOFF: /* 0x80. */
 		return ((FLUID_OK == fluid_synth_noteoff(synth,
 		    evt->chan, (int)evt->p1)) ? 0 : EIO); /* p2: vel? */
@@ -173,6 +1211,10 @@ vm_backend_event_handle(vmb_synth_p bsynth, vm_evt_p evt) {
 		return ((FLUID_OK == fluid_synth_key_pressure(synth,
 		    evt->chan, (int)evt->p1, (int)evt->p2)) ? 0 : EIO);
 	case MIDI_CTL_CHANGE: /* 0xB0. */
+		if (MIDI_CTL_NRPN_LSB <= evt->p1 &&
+		    MIDI_CTL_RPN_MSB >= evt->p1) { /* Selected as is. */
+			bsynth->param_sel[(evt->chan & 0x0F)] = 0;
+		}
 		return ((FLUID_OK == fluid_synth_cc(synth,
 		    evt->chan, (int)evt->p1, (int)evt->p2)) ? 0 : EIO);
 	case MIDI_PGM_CHANGE: /* 0xC0. */
@@ -185,10 +1227,13 @@ vm_backend_event_handle(vmb_synth_p bsynth, vm_evt_p evt) {
 		return ((FLUID_OK == fluid_synth_pitch_bend(synth,
 		    evt->chan, (int)evt->p1)) ? 0 : EIO);
 	case MIDI_SYSEX: /* 0xF0. */
+		/* May reset channels. */
+		memset(bsynth->param_sel, 0x00, sizeof(bsynth->param_sel));
 		return ((FLUID_OK == fluid_synth_sysex(synth,
 		    (const char*)evt->ex_data, (int)evt->p1,
 		    NULL, NULL, NULL, 0)) ? 0 : EIO);
 	case MIDI_SYSTEM_RESET: /* 0xFF. */
+		memset(bsynth->param_sel, 0x00, sizeof(bsynth->param_sel));
 		return ((FLUID_OK == fluid_synth_system_reset(synth)) ? 0 : EIO);
 	default:
 		if (0xF8 <= evt->type) /* Real-time messages (0xF8-0xFF) is not handled. */
@@ -198,3 +1243,15 @@ vm_backend_event_handle(vmb_synth_p bsynth, vm_evt_p evt) {
 
 	return (EDOM);
 }
+
+int
+vm_backend_event_handle(vmb_synth_p bsynth, vm_evt_p evt) {
+
+	if (NULL == bsynth ||
+	    NULL == evt)
+		return (EINVAL);
+	if (0 != vm_backend_synth_restore(bsynth))
+		return (EIO);
+
+	return (vm_backend_fevent_handle(bsynth, evt));
+}
@@ -30,6 +30,7 @@
 
 #include <sys/param.h>
 #include <sys/types.h>
+#include <sys/mman.h> /* mlockall */
 
 #include <inttypes.h>
 #include <stdlib.h> /* malloc, exit */
@@ -45,7 +46,9 @@
 #include <getopt.h>
 #include <pwd.h>
 #include <grp.h>
+#include <signal.h>
 
+#include "cuse_pool.h"
 #include "dev_midi.h"
 #include "sys_utils.h"
 
@@ -61,6 +64,10 @@
 #endif
 
 #define VIRTUAL_MIDI_DEF_VDEV		"midi"
+#define VIRTUAL_MIDI_DEF_IDLE		60
+#define VIRTUAL_MIDI_DEF_RECLAIM	300
+#define VIRTUAL_MIDI_MAX_ODEV		16
+#define VIRTUAL_MIDI_DEF_MIN_THREADS	2
 
 /* See more: https://www.fluidsynth.org/api/settings_audio.html */
 /* OSS */
@@ -79,6 +86,8 @@
 
 
 static volatile int app_running = 1;
+static volatile int app_stats_log = 0;
+static volatile int app_reload = 0;
 
 typedef struct command_line_options_s {
 	int		daemon;
@@ -86,11 +95,23 @@ typedef struct command_line_options_s {
 	uid_t		pw_uid;		/* user uid */
 	gid_t		pw_gid;		/* user gid */
 	int		threads;
+	int		min_threads;
+	const char	*cpus;
+	int		workers_rt_prio;
+	int		workers_rt_count;
 	const char	*vdev;
 	/* snd backend settings. */
 	const char	*odrv;
-	const char	*odev;
+	const char	*odev[VIRTUAL_MIDI_MAX_ODEV];
+	size_t		odev_count;
 	const char	*soundfont;
+	int		idle_timeout;
+	int		reclaim_timeout;
+	int		rt_prio;
+	int		low_latency;
+	const char	*evt_filter;
+	int		passthrough;
+	int		loopback;
 } cmd_opts_t, *cmd_opts_p;
 
 
@@ -105,6 +126,17 @@ static struct option long_options[] = {
 	{ "odrv",	required_argument,	NULL,	'o'	},
 	{ "odev",	required_argument,	NULL,	'O'	},
 	{ "soundfont",	required_argument,	NULL,	's'	},
+	{ "filter",	required_argument,	NULL,	'F'	},
+	{ "passthrough", no_argument,		NULL,	'R'	},
+	{ "idle",	required_argument,	NULL,	'I'	},
+	{ "reclaim",	required_argument,	NULL,	'M'	},
+	{ "rtprio",	required_argument,	NULL,	'r'	},
+	{ "lowlatency",	no_argument,		NULL,	'L'	},
+	{ "loopback",	no_argument,		NULL,	'B'	},
+	{ "minthreads",	required_argument,	NULL,	'm'	},
+	{ "cpus",	required_argument,	NULL,	'c'	},
+	{ "wrtprio",	required_argument,	NULL,	'w'	},
+	{ "rtthreads",	required_argument,	NULL,	'W'	},
 	{ NULL,		0,			NULL,	0	}
 };
 
@@ -114,11 +146,22 @@ static const char *long_options_descr[] = {
 	"<pid>				PID file name",
 	"<user>			Change uid",
 	"<group>			Change gid",
-	"<cuse_threads>		CUSE threads count. Default: CPU count x2",
+	"<cuse_threads>		CUSE threads max count. Default: CPU count x2",
 	"<virtual_device_name>		New virtual MIDI device base name. Default: " VIRTUAL_MIDI_DEF_VDEV,
 	"<output_driver_name>		Output sound driver name. Default: " VIRTUAL_MIDI_DEF_ODRV,
-	"<output_device_name>		Output device name. Default: " VIRTUAL_MIDI_DEF_ODEV,
+	"<output_device_name>		Output device name, repeat to create device per output (16 max). Default: " VIRTUAL_MIDI_DEF_ODEV,
 	"<soundfont_file_name>	Soundfont file name. Default: " VIRTUAL_MIDI_DEF_SOUNDFONT_FILE,
+	"<events_filter>		MIDI events filter: comma separated list of [+|-]status[-status] in hex, applied to backend defaults. Example: +F8,-A0-AF",
+	"			Pass controllers as is, without RPN/NRPN and 14-bit controllers aggregation",
+	"<seconds>			Suspend audio output after given seconds of silence, 0 - never. Default: 60",
+	"<seconds>		Free synth memory after given seconds of silence, works only with idle. 0 - never. Default: 300",
+	"<prio>			Audio thread real-time priority, 0 - disabled. Default: 0, with lowlatency: 60",
+	"				Low latency mode: lock all memory, load all samples on start, count render thread page faults",
+	"				Create read only unit <vdev>N.1, that returns all data written to <vdev>N.0",
+	"<cuse_threads>		CUSE threads min count, more started when all busy. Default: 2",
+	"<cpu_list>			Pin CUSE threads to CPUs, example: 0,2-3. Default: any",
+	"<prio>			CUSE threads SCHED_FIFO priority, 0 - disabled. Default: 0",
+	"<count>			CUSE threads with -cpus and -wrtprio, other run as usual. Default: minthreads",
 	NULL
 };
 
@@ -135,8 +178,11 @@ cmd_opts_parse(int argc, char **argv, struct option *opts,
 	memset(cmd_opts, 0x00, sizeof(cmd_opts_t));
 	cmd_opts->vdev = VIRTUAL_MIDI_DEF_VDEV;
 	cmd_opts->odrv = VIRTUAL_MIDI_DEF_ODRV;
-	cmd_opts->odev = VIRTUAL_MIDI_DEF_ODEV;
 	cmd_opts->soundfont = VIRTUAL_MIDI_DEF_SOUNDFONT_FILE;
+	cmd_opts->idle_timeout = VIRTUAL_MIDI_DEF_IDLE;
+	cmd_opts->reclaim_timeout = VIRTUAL_MIDI_DEF_RECLAIM;
+	cmd_opts->rt_prio = -1;
+	cmd_opts->min_threads = VIRTUAL_MIDI_DEF_MIN_THREADS;
 
 	/* Process command line. */
 	/* Generate opts string from long options. */
@@ -209,17 +255,59 @@ restart_opts:
 			cmd_opts->odrv = optarg;
 			break;
 		case 8: /* odev */
-			cmd_opts->odev = optarg;
+			if (VIRTUAL_MIDI_MAX_ODEV <= cmd_opts->odev_count) {
+				errx(EX_USAGE,
+				    "option \"-O\" can be used %i times max.",
+				    VIRTUAL_MIDI_MAX_ODEV);
+			}
+			cmd_opts->odev[cmd_opts->odev_count ++] = optarg;
 			break;
 		case 9: /* soundfont */
 			cmd_opts->soundfont = optarg;
 			break;
+		case 10: /* filter */
+			cmd_opts->evt_filter = optarg;
+			break;
+		case 11: /* passthrough */
+			cmd_opts->passthrough = 1;
+			break;
+		case 12: /* idle */
+			cmd_opts->idle_timeout = atoi(optarg);
+			break;
+		case 13: /* reclaim */
+			cmd_opts->reclaim_timeout = atoi(optarg);
+			break;
+		case 14: /* rtprio */
+			cmd_opts->rt_prio = atoi(optarg);
+			break;
+		case 15: /* lowlatency */
+			cmd_opts->low_latency = 1;
+			break;
+		case 16: /* loopback */
+			cmd_opts->loopback = 1;
+			break;
+		case 17: /* minthreads */
+			cmd_opts->min_threads = atoi(optarg);
+			break;
+		case 18: /* cpus */
+			cmd_opts->cpus = optarg;
+			break;
+		case 19: /* wrtprio */
+			cmd_opts->workers_rt_prio = atoi(optarg);
+			break;
+		case 20: /* rtthreads */
+			cmd_opts->workers_rt_count = atoi(optarg);
+			break;
 		default:
 			return (EINVAL);
 		}
 		opt_idx = -1;
 	}
 
+	if (0 == cmd_opts->odev_count) {
+		cmd_opts->odev[cmd_opts->odev_count ++] = VIRTUAL_MIDI_DEF_ODEV;
+	}
+
 	return (0);
 }
 
@@ -232,39 +320,65 @@ signal_handler(int sig) {
 	case SIGKILL:
 		app_running = 0;
 		break;
-	case SIGHUP:
 	case SIGUSR1:
+		app_stats_log = 1;
+		break;
+	case SIGHUP:
+		app_reload = 1;
+		break;
 	case SIGUSR2:
 	default:
 		break;
 	}
 }
 
-static void *
-cuse_worker_proc(void *arg __unused) {
+/* Lock file: one running process per output device. */
+static int
+lock_file_open(const char *vdev, const char *odrv, const char *odev,
+    char *lock_file, size_t lock_file_buf_size) {
+	int fd;
+	size_t i, lock_file_size;
+	const char *forbidden_chars = "/\\ .";
 
-	while (0 != app_running) {
-		if (0 != cuse_wait_and_process())
-			break;
+	if (0 == strncasecmp("/dev/", odev, 5)) {
+		odev += 5; /* remove "/dev/" */
+	}
+	lock_file_size = (size_t)snprintf(lock_file, lock_file_buf_size,
+	    _PATH_VARRUN "%s-%s-%s.lock", vdev, odrv, odev);
+	/* Replace special characters. */
+	for (i = (sizeof(_PATH_VARRUN) - 1); i < (lock_file_size - 5); i ++) {
+		if (NULL == strchr(forbidden_chars, lock_file[i]))
+			continue;
+		lock_file[i] = '_';
+	}
+	/* Start file locking... */
+	fd = open(lock_file, (O_RDWR | O_CREAT));
+	if (-1 == fd) {
+		errx(EX_CANTCREAT, "Could not create lock file: %s - %i: %s",
+		    lock_file, errno, strerror(errno));
+	}
+	if (0 != flock(fd, (LOCK_EX | LOCK_NB))) {
+		errx(EX_TEMPFAIL, "Could not lock file, probably other process already running: %s - %i: %s",
+		    lock_file, errno, strerror(errno));
 	}
 
-	return (NULL);
+	return (fd);
 }
 
 
 int
 main(int argc, char **argv) {
 	int error = 0;
-	int fd_lock_file = -1 /*, fd_midistat = -1; TODO in kernel. */;
+	int fd_lock_file[VIRTUAL_MIDI_MAX_ODEV] /*, fd_midistat = -1; TODO in kernel. */;
 	cmd_opts_t cmd_opts;
 	vmb_options_t vmb_opts;
-	struct cuse_dev *midi_dev;
-	pthread_t td;
-	char lock_file[PATH_MAX];
-	const char *odev_ptr;
-	const char *forbidden_chars = "/\\ .";
-	size_t i, lock_file_size;
+	vm_dev_options_t dev_opts;
+	struct cuse_dev *midi_dev[VIRTUAL_MIDI_MAX_ODEV];
+	cuse_pool_options_t pool_opts;
+	char lock_file[VIRTUAL_MIDI_MAX_ODEV][PATH_MAX];
+	size_t i;
 	struct timespec rqts = { .tv_sec = 3600, .tv_nsec = 0 };
+	sigset_t sig_set;
 
 	/* Command line processing. */
 	error = cmd_opts_parse(argc, argv, long_options, &cmd_opts);
@@ -277,13 +391,15 @@ main(int argc, char **argv) {
 	}
 	/* Handle cmd line options. */
 	if (NULL == cmd_opts.vdev ||
-	    NULL == cmd_opts.odrv ||
-	    NULL == cmd_opts.odev) {
+	    NULL == cmd_opts.odrv) {
 		fprintf(stderr, "vdev, odrv and odev is required options!\n");
 		print_usage(argv[0], PACKAGE_STRING, PACKAGE_DESCRIPTION,
 		    long_options, long_options_descr);
 		return (-1);
 	}
+	if (-1 == cmd_opts.rt_prio) {
+		cmd_opts.rt_prio = ((0 != cmd_opts.low_latency) ? 60 : 0);
+	}
 	if (0 == cmd_opts.threads) {
 		cmd_opts.threads = (int)sysconf(_SC_NPROCESSORS_ONLN);
 		if (-1 == cmd_opts.threads) {
@@ -293,29 +409,10 @@ main(int argc, char **argv) {
 		}
 	}
 
-	/* Lock file. */
-	odev_ptr = cmd_opts.odev;
-	if (0 == strncasecmp("/dev/", odev_ptr, 5)) {
-		odev_ptr += 5; /* remove "/dev/" */
-	}
-	lock_file_size = (size_t)snprintf(lock_file, sizeof(lock_file),
-	    _PATH_VARRUN "%s-%s-%s.lock",
-	    cmd_opts.vdev, cmd_opts.odrv, odev_ptr);
-	/* Replace special characters. */
-	for (i = (sizeof(_PATH_VARRUN) - 1); i < (lock_file_size - 5); i ++) {
-		if (NULL == strchr(forbidden_chars, lock_file[i]))
-			continue;
-		lock_file[i] = '_';
-	}
-	/* Start file locking... */
-	fd_lock_file = open(lock_file, (O_RDWR | O_CREAT));
-	if (-1 == fd_lock_file) {
-		errx(EX_CANTCREAT, "Could not create lock file: %s - %i: %s",
-		    lock_file, errno, strerror(errno));
-	}
-	if (0 != flock(fd_lock_file, (LOCK_EX | LOCK_NB))) {
-		errx(EX_TEMPFAIL, "Could not lock file, probably other process already running: %s - %i: %s",
-		    lock_file, errno, strerror(errno));
+	/* Lock files. */
+	for (i = 0; i < cmd_opts.odev_count; i ++) {
+		fd_lock_file[i] = lock_file_open(cmd_opts.vdev, cmd_opts.odrv,
+		    cmd_opts.odev[i], lock_file[i], sizeof(lock_file[i]));
 	}
 
 	/* Daemonize. */
@@ -325,13 +422,25 @@ main(int argc, char **argv) {
 		signal(SIGTERM, signal_handler);
 		signal(SIGHUP, signal_handler);
 		signal(SIGUSR1, signal_handler);
-		signal(SIGUSR2, signal_handler);
 		signal(SIGPIPE, SIG_IGN);
 	}
+	signal(SIGUSR1, signal_handler);
+	signal(SIGHUP, signal_handler);
 	/* PID file. */
 	if (NULL != cmd_opts.pid) {
 		write_pid(cmd_opts.pid);
 	}
+	/* Lock current and future memory: thread stacks, synth state
+	 * and samples, so render thread does not wait for page in. */
+	if (0 != cmd_opts.low_latency &&
+	    0 != mlockall((MCL_CURRENT | MCL_FUTURE))) {
+		warn("mlockall()");
+	}
+	/* Only main thread handle signals, other threads inherit mask. */
+	sigemptyset(&sig_set);
+	sigaddset(&sig_set, SIGUSR1);
+	sigaddset(&sig_set, SIGHUP);
+	pthread_sigmask(SIG_BLOCK, &sig_set, NULL);
 
 	/* CUSE init. */
 	if (0 != cuse_init()) {
@@ -339,34 +448,75 @@ main(int argc, char **argv) {
 		    errno, strerror(errno));
 	}
 
-	/* MIDI device. */
+	/* MIDI devices: one per output device. */
 	memset(&vmb_opts, 0x00, sizeof(vmb_options_t));
 	vmb_opts.driver = cmd_opts.odrv;
-	vmb_opts.device = cmd_opts.odev;
 	vmb_opts.soundfont = cmd_opts.soundfont;
-	midi_dev = vm_dev_midi_create(cmd_opts.vdev, &vmb_opts);
-	if (NULL == midi_dev) {
-		errx(EX_SOFTWARE, "Could not create '/dev/%s' - %i: %s",
-		    cmd_opts.vdev, errno, strerror(errno));
+	vmb_opts.idle_timeout = (uint32_t)MAX(0, cmd_opts.idle_timeout);
+	vmb_opts.reclaim_timeout = (uint32_t)MAX(0, cmd_opts.reclaim_timeout);
+	vmb_opts.rt_prio = cmd_opts.rt_prio;
+	vmb_opts.low_latency = cmd_opts.low_latency;
+	memset(&dev_opts, 0x00, sizeof(vm_dev_options_t));
+	dev_opts.evt_filter = cmd_opts.evt_filter;
+	dev_opts.passthrough = cmd_opts.passthrough;
+	dev_opts.loopback = cmd_opts.loopback;
+	for (i = 0; i < cmd_opts.odev_count; i ++) {
+		vmb_opts.device = cmd_opts.odev[i];
+		midi_dev[i] = vm_dev_midi_create(cmd_opts.vdev, &vmb_opts,
+		    &dev_opts);
+		if (NULL == midi_dev[i]) {
+			errx(EX_SOFTWARE, "Could not create '/dev/%s' for '%s' - %i: %s",
+			    cmd_opts.vdev, cmd_opts.odev[i], errno, strerror(errno));
+		}
 	}
 
-	/* CUSE post init. */
-	for (i = 0; i < (size_t)cmd_opts.threads; i ++) {
-		pthread_create(&td, NULL, &cuse_worker_proc, NULL);
+	/* CUSE post init: worker threads serve all devices. */
+	memset(&pool_opts, 0x00, sizeof(cuse_pool_options_t));
+	pool_opts.min_threads = (size_t)MAX(1, cmd_opts.min_threads);
+	pool_opts.max_threads = (size_t)cmd_opts.threads;
+	pool_opts.cpus = cmd_opts.cpus;
+	pool_opts.rt_prio = MAX(0, cmd_opts.workers_rt_prio);
+	pool_opts.rt_threads = (size_t)MAX(0, cmd_opts.workers_rt_count);
+	error = cuse_pool_start(&pool_opts);
+	if (0 != error) {
+		errx(EX_SOFTWARE, "Could not start CUSE threads - %i: %s",
+		    error, strerror(error));
 	}
 
+	pthread_sigmask(SIG_UNBLOCK, &sig_set, NULL);
+
 	/* Drop rights. */
 	set_user_and_group(cmd_opts.pw_uid, cmd_opts.pw_gid);
 
 	/* Wait for signals. */
 	while (0 != app_running) {
 		nanosleep(&rqts, NULL); /* Ignore early wakeup and errors. */
+		if (0 != app_reload) {
+			/* Main thread does not serve clients: load
+			 * soundfont here and swap synths when ready.
+			 * Device keeps old settings if load failed. */
+			app_reload = 0;
+			for (i = 0; i < cmd_opts.odev_count; i ++) {
+				vm_dev_midi_reload(midi_dev[i]);
+			}
+			vm_backend_sfont_cache_flush();
+		}
+		if (0 != app_stats_log) {
+			app_stats_log = 0;
+			for (i = 0; i < cmd_opts.odev_count; i ++) {
+				vm_dev_midi_stats_log(midi_dev[i]);
+			}
+			vm_backend_stats_log();
+			cuse_pool_stats_log();
+		}
 	}
 
 	/* Exititng... */
-	vm_dev_midi_destroy(midi_dev);
-	close(fd_lock_file);
-	unlink(lock_file);
+	for (i = 0; i < cmd_opts.odev_count; i ++) {
+		vm_dev_midi_destroy(midi_dev[i]);
+		close(fd_lock_file[i]);
+		unlink(lock_file[i]);
+	}
 	if (NULL != cmd_opts.pid) {
 		unlink(cmd_opts.pid);
 	}
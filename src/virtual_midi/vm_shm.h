@@ -0,0 +1,160 @@
+/*-
+ * Copyright (c) 2024-2025 Rozhuk Ivan <rozhuk.im@gmail.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE REGENTS AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE REGENTS OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ * Author: Rozhuk Ivan <rozhuk.im@gmail.com>
+ *
+ */
+
+/*
+ * Shared memory MIDI bytes ring: single producer (client), single
+ * consumer (virtual_midi device worker).
+ * Client usage:
+ *	fd = open("/dev/midi0.0", O_WRONLY);
+ *	vm_shm_open(fd, &shm);
+ *	vm_shm_write(&shm, buf, size); // Many times.
+ *	vm_shm_close(&shm);
+ * vm_shm_write() does not make syscalls while daemon is busy with
+ * ring data, and kick it with ioctl() only if it is sleeping.
+ */
+
+#ifndef __VM_SHM_H__
+#define __VM_SHM_H__
+
+#include <sys/param.h>
+#include <sys/types.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <inttypes.h>
+#include <string.h> /* memcpy */
+#include <errno.h>
+
+
+#define VM_SHM_MAGIC		0x564d5348 /* "VMSH" */
+#define VM_SHM_DATA_SZ		(64 * 1024) /* Power of 2. */
+#define VM_SHM_ALIGN		64 /* Keep producer and consumer fields on own cache lines. */
+
+typedef struct vm_shm_hdr_s {
+	uint32_t	magic;
+	uint32_t	data_size; /* Power of 2. */
+	/* Producer. */
+	volatile uint32_t head __attribute__((aligned(VM_SHM_ALIGN))); /* Write offset, free running. */
+	/* Consumer. */
+	volatile uint32_t tail __attribute__((aligned(VM_SHM_ALIGN))); /* Read offset, free running. */
+	volatile uint32_t need_kick; /* Consumer sleeps, producer must kick it. */
+	uint8_t		data[] __attribute__((aligned(VM_SHM_ALIGN)));
+} vm_shm_hdr_t, *vm_shm_hdr_p;
+
+typedef struct vm_shm_info_s {
+	uint64_t	offset; /* mmap() offset. */
+	uint64_t	size; /* mmap() size. */
+} vm_shm_info_t, *vm_shm_info_p;
+
+/* Map ring, allocated on first call. */
+#define VM_IOC_SHM_INFO		_IOR('V', 1, vm_shm_info_t)
+/* Wakeup consumer. */
+#define VM_IOC_SHM_KICK		_IO('V', 2)
+
+
+#define VM_SHM_COUNT(__hdr)						\
+    (__atomic_load_n(&(__hdr)->head, __ATOMIC_ACQUIRE) -		\
+    __atomic_load_n(&(__hdr)->tail, __ATOMIC_ACQUIRE))
+
+
+typedef struct vm_shm_s {
+	int		fd;
+	vm_shm_info_t	info;
+	vm_shm_hdr_p	hdr;
+} vm_shm_t, *vm_shm_p;
+
+
+static inline int
+vm_shm_open(int fd, vm_shm_p shm) {
+	void *ptr;
+
+	if (NULL == shm)
+		return (EINVAL);
+	memset(shm, 0x00, sizeof(vm_shm_t));
+	if (0 != ioctl(fd, VM_IOC_SHM_INFO, &shm->info))
+		return (errno);
+	ptr = mmap(NULL, (size_t)shm->info.size, (PROT_READ | PROT_WRITE),
+	    MAP_SHARED, fd, (off_t)shm->info.offset);
+	if (MAP_FAILED == ptr)
+		return (errno);
+	shm->fd = fd;
+	shm->hdr = ptr;
+	if (VM_SHM_MAGIC != shm->hdr->magic) {
+		munmap(ptr, (size_t)shm->info.size);
+		shm->hdr = NULL;
+		return (EPROTO);
+	}
+
+	return (0);
+}
+
+static inline void
+vm_shm_close(vm_shm_p shm) {
+
+	if (NULL == shm || NULL == shm->hdr)
+		return;
+	munmap(shm->hdr, (size_t)shm->info.size);
+	shm->hdr = NULL;
+}
+
+static inline int
+vm_shm_kick(vm_shm_p shm) {
+
+	if (0 != ioctl(shm->fd, VM_IOC_SHM_KICK))
+		return (errno);
+
+	return (0);
+}
+
+/* Return bytes count placed to ring, may be less than size if ring is full. */
+static inline size_t
+vm_shm_write(vm_shm_p shm, const void *buf, size_t size) {
+	vm_shm_hdr_p hdr = shm->hdr;
+	uint32_t head, off, part;
+
+	head = hdr->head; /* Only producer change it. */
+	size = MIN(size,
+	    (hdr->data_size - (head - __atomic_load_n(&hdr->tail, __ATOMIC_ACQUIRE))));
+	if (0 == size)
+		return (0);
+	off = (head & (hdr->data_size - 1));
+	part = MIN((uint32_t)size, (hdr->data_size - off));
+	memcpy(&hdr->data[off], buf, part);
+	memcpy(hdr->data, (((const uint8_t*)buf) + part), (size - part));
+	__atomic_store_n(&hdr->head, (head + (uint32_t)size), __ATOMIC_SEQ_CST);
+	/* Pairs with consumer: set need_kick, then check head. */
+	if (0 != __atomic_load_n(&hdr->need_kick, __ATOMIC_SEQ_CST) &&
+	    0 != __atomic_exchange_n(&hdr->need_kick, 0, __ATOMIC_SEQ_CST)) {
+		vm_shm_kick(shm);
+	}
+
+	return (size);
+}
+
+
+#endif /* __VM_SHM_H__ */
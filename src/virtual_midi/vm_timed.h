@@ -0,0 +1,88 @@
+/*-
+ * Copyright (c) 2024-2025 Rozhuk Ivan <rozhuk.im@gmail.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE REGENTS AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE REGENTS OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ * Author: Rozhuk Ivan <rozhuk.im@gmail.com>
+ *
+ */
+
+/*
+ * Timed write mode: events played at given time with sample accuracy,
+ * client may queue up to 1024 events ahead and sleep.
+ * Client usage:
+ *	fd = open("/dev/midi0.0", O_WRONLY);
+ *	ioctl(fd, VM_IOC_TIMED_SET, &(int){ 1 });
+ *	ioctl(fd, VM_IOC_CLOCK_GET, &now);
+ *	size = vm_timed_frame_put(buf, sizeof(buf), (now + 500000000),
+ *	    note_on, 3);
+ *	write(fd, buf, size);
+ * write() accept frames: vm_timed_hdr_t followed by hdr.size MIDI bytes,
+ * frame may be split between write() calls.
+ * Late events played immediately, SYSEX played when received.
+ * Switch mode only while no data written and not played.
+ */
+
+#ifndef __VM_TIMED_H__
+#define __VM_TIMED_H__
+
+#include <sys/param.h>
+#include <sys/types.h>
+#include <sys/ioctl.h>
+#include <inttypes.h>
+#include <string.h> /* memcpy */
+
+
+typedef struct vm_timed_hdr_s {
+	uint64_t	time; /* Device clock, nanoseconds. */
+	uint32_t	size; /* MIDI bytes after header. */
+	uint32_t	reserved; /* Set to 0. */
+} vm_timed_hdr_t, *vm_timed_hdr_p;
+
+/* Device clock: CLOCK_MONOTONIC, nanoseconds. */
+#define VM_IOC_CLOCK_GET	_IOR('V', 3, uint64_t) /* 1, 2: vm_shm.h */
+/* 1 - write() accept frames, 0 - raw MIDI bytes.
+ * EBUSY if written data is not played yet or frame is incomplete. */
+#define VM_IOC_TIMED_SET	_IOW('V', 4, int)
+
+
+/* Return frame size placed to buf, 0 if buf is too small. */
+static inline size_t
+vm_timed_frame_put(void *buf, size_t buf_size, uint64_t time,
+    const void *data, size_t size) {
+	vm_timed_hdr_t hdr;
+
+	if ((sizeof(hdr) + size) > buf_size ||
+	    UINT32_MAX < size)
+		return (0);
+	hdr.time = time;
+	hdr.size = (uint32_t)size;
+	hdr.reserved = 0;
+	memcpy(buf, &hdr, sizeof(hdr));
+	memcpy((((uint8_t*)buf) + sizeof(hdr)), data, size);
+
+	return (sizeof(hdr) + size);
+}
+
+
+#endif /* __VM_TIMED_H__ */
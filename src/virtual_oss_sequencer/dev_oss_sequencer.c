@@ -32,6 +32,13 @@
 #include <sys/types.h>
 #include <sys/ioctl.h>
 #include <sys/stat.h>
+#include <sys/queue.h>
+#if defined(__linux__)
+#	include <sys/inotify.h>
+#else
+#	include <sys/socket.h>
+#	include <sys/un.h>
+#endif
 #if defined(__OpenBSD__)
 	#include <soundcard.h>
 #else
@@ -39,6 +46,7 @@
 #endif
 
 #include <inttypes.h>
+#include <stddef.h> /* offsetof */
 #include <stdlib.h> /* malloc, exit */
 #include <stdio.h> /* snprintf, fprintf */
 #include <string.h> /* bcopy, bzero, memcpy, memmove, memset, strerror... */
@@ -46,42 +54,535 @@
 #include <fcntl.h>
 #include <errno.h>
 #include <dirent.h> /* opendir, readdir */
+#include <poll.h>
 #include <pthread.h>
+#include <sched.h> /* sched_yield */
+#include <syslog.h>
 #include <cuse.h>
 
 #include "midi_event.h"
+#include "cuse_pool.h"
+#include "obj_pool.h"
+#include "timer_wheel.h"
 #include "dev_oss_sequencer.h"
 
 
 #define VM_WRITE_BUF_SZ		4096
+#define VM_DEVS_INLINE		8 /* Devices stored in fd context, more - allocated. */
+#define VM_DEV_DESCR_SZ		32
+#define VM_DEV_BUF_SZ		512 /* Output device buffer, flushed on time change. */
+#define VM_DEV_BUSY_RETRY_NS	1000000 /* Device owned by other fd: retry interval. */
+#define VM_OUT_Q_SZ		8192 /* Output queue bytes, must be power of 2. */
+#define VM_OUT_Q_EVT_SZ		8 /* Max event size, used to count events. */
+#define VM_OUT_Q_EVENTS		(VM_OUT_Q_SZ / VM_OUT_Q_EVT_SZ)
+#define VM_TX_WAIT_NS		100000000 /* Check for peer signal interval. */
+#define VM_CLOSE_WAIT		10 /* Max seconds to wait for queued events on close. */
+#define VM_DISP_BATCH		64 /* Events played from one fd before switch to next. */
+#define VM_DISP_TICK_NS		1000000 /* Timer wheel tick: 1 ms. */
+#define VM_DISP_TICK_MIN_NS	10000 /* Timer wheel tick with spin. */
+#define VM_DISP_SPIN_MAX_US	10000
+#define VM_LATE_HIST_CNT	9 /* vm_late_hist_us[] + 1. */
+#define VM_NOTIFY_POLL_MS	500 /* Check for stop interval. */
+#define VM_DEVD_PIPE		"/var/run/devd.seqpacket.pipe"
 #define TMR_TIMERBASE		15 /* Internal use: translate ioctl() to event handler. */
 
 
+/* Output device: name, description and handle shared by all fds.
+ * Interned once per daemon. */
+typedef struct virt_midi_device_name_s {
+	struct virt_midi_device_name_s *next;
+	pthread_mutex_t		mtx; /* One writer at time: messages are not mixed. */
+	/* Writer that sent message start: only it writes until message
+	 * end, it writes without mtx. Protected by mtx. */
+	struct virt_midi_device_ctx_s *owner;
+	int			fd; /* -1 - not opened. */
+	size_t			ref_cnt; /* fds that use handle. */
+	char			descr[VM_DEV_DESCR_SZ]; /* Protected by vm_dev_names_mtx. */
+	char			dev_name[]; /* Device file name. */
+} vm_dev_name_t, *vm_dev_name_p;
+
+/* Output devices list, replaced by rescan. */
+typedef struct virt_midi_device_list_s {
+	size_t			count;
+	vm_dev_name_p		names[];
+} vm_dev_list_t, *vm_dev_list_p;
+
+/* Sequencer device: output devices registry. */
+typedef struct virt_midi_seq_device_s {
+	pthread_mutex_t		mtx; /* Protect devs. */
+	pthread_mutex_t		scan_mtx; /* Only one rescan at time. */
+	vm_dev_list_p		devs;
+	const char		**inc_lst;
+	size_t			inc_lst_cnt;
+	volatile int		rescan; /* No notifications: rescan on open. */
+	volatile int		running;
+	int			notify_fd; /* inotify or devd socket, -1 - none. */
+	pthread_t		notify_td;
+	vm_seq_dev_options_t	opts;
+} vm_seq_dev_t, *vm_seq_dev_p;
+
+/* fd clock: real or simulated, see vm_seq_dev_options_t. */
+typedef struct virt_midi_clock_s *vm_clock_p;
+typedef struct virt_midi_clock_s {
+	uint64_t		(*now)(vm_clock_p clk); /* Nanoseconds. */
+	/* Simulated: move time to wait end, NULL - real clock. */
+	void			(*advance)(vm_clock_p clk, const uint64_t time);
+	uint64_t		sim_time;
+	vm_seq_emit_cb		emit_cb;
+	void			*emit_udata;
+} vm_clock_t;
+
+#define VM_DEV_FD_NONE		-1 /* Not opened yet. */
+#define VM_DEV_FD_FAILED	-2 /* open() failed, do not retry. */
+
 typedef struct virt_midi_device_ctx_s {
-	int			fd; /* /dev/midiX.X fd. */
-	char			descr[32]; /* Device description. */
-	char			dev_name[PATH_MAX]; /* Device file name. */
+	int			fd; /* Copy of name->fd, opened on first use. */
+	vm_dev_name_p		name;
+	vm_clock_p		clock; /* fd clock. */
+	size_t			buf_used;
+	size_t			msg_end; /* Last whole message end in buf. */
+	int			putc_left; /* SEQ_MIDIPUTC message bytes left, -1 - SYSEX. */
+	uint8_t			putc_status; /* SEQ_MIDIPUTC running status. */
+	uint8_t			*sysex; /* EV_SYSEX fragments, allocated on first use. */
+	size_t			sysex_used;
+	int			sysex_part; /* EV_SYSEX part sent, device owned until EOX. */
+	uint8_t			buf[VM_DEV_BUF_SZ]; /* Events with same time. */
 } vm_dev_t, *vm_dev_p;
 
+/* Dispatcher state of fd, protected by vm_disp.mtx. */
+#define VM_DISP_IDLE		0 /* Queue is empty. */
+#define VM_DISP_RUNQ		1 /* In vm_disp.run_q. */
+#define VM_DISP_TIMER		2 /* In timer wheel: wait for TMR_WAIT_* time. */
+#define VM_DISP_BUSY		3 /* Dispatcher plays events. */
+
+/* Allocated from vm_fd_pool, hot fields first, out_q is not zeroed. */
 typedef struct virt_midi_oss_sequencer_fd_ctx_s {
 	pthread_mutex_t		mtx; /* Multiple threads may use fd in same time. */
-	int			open_fflags;
+	pthread_cond_t		cond; /* Signaled by dispatcher. */
 	volatile int		tx_busy;
-	struct timespec		timer_start; /* Timer start time. */
-	struct timespec		timer_stop_diff; /* Timer value on stop. */
+	int			nonblock; /* Set by FIONBIO. */
+	int			poll_wait;
+	int			disp_state; /* VM_DISP_*. */
+	size_t			out_head; /* Writer. */
+	size_t			out_tail; /* Dispatcher. */
+	size_t			out_lowat; /* Free events for poll(): SNDCTL_SEQ_TRESHOLD. */
+	uint64_t		wait_until; /* Dispatcher: nanoseconds, 0 - no wait. */
+	uint64_t		prev_deadline; /* TMR_WAIT_REL base, 0 - now. */
+	TAILQ_ENTRY(virt_midi_oss_sequencer_fd_ctx_s) disp_next;
+	tw_node_t		disp_timer;
+	int			open_fflags;
+	vm_dev_p		devs; /* devs_inline or allocated. */
+	size_t			devs_count;
 	uint64_t		timer_base;
 	uint64_t		timer_tempo;
-	vm_dev_p		devs;
-	size_t			devs_count;
+	uint64_t		tick_ns; /* Timer tick duration: integer part. */
+	uint64_t		tick_ns_frac; /* Fraction part, 32 bit fixed point. */
+	struct timespec		timer_start; /* Timer start time. */
+	struct timespec		timer_stop_diff; /* Timer value on stop. */
+	vm_clock_t		clock;
+	vm_dev_t		devs_inline[VM_DEVS_INLINE];
+	uint8_t			out_q[VM_OUT_Q_SZ]; /* Whole events only. */
 } vm_fd_t, *vm_fd_p;
 
+#define VM_FD_OUT_COUNT(__fd)	((__fd)->out_head - (__fd)->out_tail)
+#define VM_FD_OUT_FREE(__fd)	(VM_OUT_Q_SZ - VM_FD_OUT_COUNT(__fd))
+#define VM_FD_OUT_FREE_EVENTS(__fd) (VM_FD_OUT_FREE(__fd) / VM_OUT_Q_EVT_SZ)
+
+typedef TAILQ_HEAD(vm_fd_list_s, virt_midi_oss_sequencer_fd_ctx_s) vm_fd_list_t;
+
+/* SEQ_FULLSIZE payload state, only inside write(). */
+typedef struct vm_fullsize_s {
+	vm_dev_p		dev; /* Locked device, NULL - skip payload. */
+	size_t			left; /* Payload bytes left. */
+	uint8_t			last; /* Last sent byte. */
+} vm_fullsize_t, *vm_fullsize_p;
+
+/* One thread play queued events of all fds at time. */
+typedef struct vm_dispatcher_s {
+	pthread_mutex_t		mtx; /* Lock order: fd->mtx, vm_disp.mtx. */
+	pthread_cond_t		cond; /* Wakeup dispatcher. */
+	pthread_cond_t		idle_cond; /* cur_fd changed. */
+	pthread_t		td;
+	volatile int		running;
+	size_t			ref_cnt; /* Devices that use dispatcher. */
+	vm_fd_p			cur_fd; /* Dispatcher use it without vm_disp.mtx. */
+	vm_fd_list_t		run_q; /* Have events to play now. */
+	tw_t			tw; /* Wait for TMR_WAIT_* time. */
+	uint64_t		tick_ns; /* Timer wheel tick. */
+	uint64_t		spin_ns; /* Yield this time before wait end, 0 - sleep only. */
+	/* Stats, updated only by dispatcher thread. */
+	uint64_t		late_hist[VM_LATE_HIST_CNT]; /* Wait end lateness. */
+	uint64_t		late_max;
+} vm_disp_t;
+
+/* Lateness histogram buckets upper bounds, microseconds. */
+static const uint64_t vm_late_hist_us[(VM_LATE_HIST_CNT - 1)] = {
+	10, 50, 100, 250, 500, 1000, 2000, 5000
+};
+
+/* Contexts recycled across open/close. */
+static obj_pool_t vm_fd_pool = OBJ_POOL_INITIALIZER(sizeof(vm_fd_t),
+    offsetof(vm_fd_t, out_q), 8);
+
+static vm_disp_t vm_disp = {
+	.mtx = PTHREAD_MUTEX_INITIALIZER,
+};
+
+static pthread_mutex_t vm_dev_names_mtx = PTHREAD_MUTEX_INITIALIZER;
+static vm_dev_name_p vm_dev_names = NULL; /* Never freed. */
+
+
+/* Return interned device name, add it on first use, update description.
+ * Entries are never freed and dev_name is not changed after add:
+ * one mtx, handle and owner per device node. */
+static vm_dev_name_p
+vm_dev_name_get(const char *dev_name, const char *descr) {
+	size_t dev_name_size;
+	vm_dev_name_p name;
+
+	pthread_mutex_lock(&vm_dev_names_mtx);
+	for (name = vm_dev_names; NULL != name; name = name->next) {
+		if (0 != strcmp(name->dev_name, dev_name))
+			continue;
+		strlcpy(name->descr, descr, sizeof(name->descr));
+		goto out;
+	}
+	dev_name_size = (strlen(dev_name) + 1);
+	name = malloc(sizeof(vm_dev_name_t) + dev_name_size);
+	if (NULL == name)
+		goto out;
+	if (0 != pthread_mutex_init(&name->mtx, NULL)) {
+		free(name);
+		name = NULL;
+		goto out;
+	}
+	name->owner = NULL;
+	name->fd = -1;
+	name->ref_cnt = 0;
+	strlcpy(name->descr, descr, sizeof(name->descr));
+	memcpy(name->dev_name, dev_name, dev_name_size);
+	name->next = vm_dev_names;
+	vm_dev_names = name;
+out:
+	pthread_mutex_unlock(&vm_dev_names_mtx);
+
+	return (name);
+}
+
+static void
+vm_dev_name_descr_get(vm_dev_name_p name, char *buf, const size_t buf_size) {
+
+	pthread_mutex_lock(&vm_dev_names_mtx);
+	strlcpy(buf, name->descr, buf_size);
+	pthread_mutex_unlock(&vm_dev_names_mtx);
+}
+
+
+static int
+vm_write_all(int fd, const uint8_t *buf, const size_t buf_size) {
+	ssize_t rc = 0;
+
+	for (size_t i = 0; i < buf_size; i += (size_t)rc) {
+		rc = write(fd, &buf[i], (buf_size - i));
+		if (-1 == rc)
+			return (errno);
+	}
+
+	return (0);
+}
+
+/* Return shared handle, device opened by first user. */
+static int
+vm_dev_name_open(vm_dev_name_p name) {
+	int dfd;
+
+	pthread_mutex_lock(&name->mtx);
+	if (0 == name->ref_cnt) {
+		name->fd = open(name->dev_name, O_RDWR);
+	}
+	if (-1 != name->fd) {
+		name->ref_cnt ++;
+	}
+	dfd = name->fd;
+	pthread_mutex_unlock(&name->mtx);
+
+	return (dfd);
+}
+
+static void
+vm_dev_name_close(vm_dev_name_p name) {
+
+	pthread_mutex_lock(&name->mtx);
+	name->ref_cnt --;
+	if (0 == name->ref_cnt) {
+		close(name->fd);
+		name->fd = -1;
+	}
+	pthread_mutex_unlock(&name->mtx);
+}
+
+/* Own device until message end: other fds keep their data and retry,
+ * dispatcher never waits for device, see vm_fd_devs_busy(). */
+static int
+vm_dev_own(vm_dev_p dev) {
+	int error = 0;
+
+	pthread_mutex_lock(&dev->name->mtx);
+	if (NULL == dev->name->owner) {
+		dev->name->owner = dev;
+	} else if (dev != dev->name->owner) {
+		error = EBUSY;
+	}
+	pthread_mutex_unlock(&dev->name->mtx);
+
+	return (error);
+}
+
+static void
+vm_dev_release(vm_dev_p dev) {
+
+	if (dev != __atomic_load_n(&dev->name->owner, __ATOMIC_ACQUIRE))
+		return;
+	pthread_mutex_lock(&dev->name->mtx);
+	dev->name->owner = NULL;
+	pthread_mutex_unlock(&dev->name->mtx);
+}
+
+/* Other fd sends message in parts now. */
+static int
+vm_dev_busy(vm_dev_p dev) {
+	vm_dev_p owner;
+
+	if (0 > dev->fd)
+		return (0);
+	owner = __atomic_load_n(&dev->name->owner, __ATOMIC_ACQUIRE);
+
+	return ((NULL != owner && dev != owner) ? 1 : 0);
+}
+
+/* Terminate message that was sent in parts, on close and reset. */
+static void
+vm_dev_abort(vm_dev_p dev) {
+	static const uint8_t eox = MIDI_SYSEX_EOX;
+
+	dev->sysex_part = 0;
+	if (0 > dev->fd ||
+	    dev != __atomic_load_n(&dev->name->owner, __ATOMIC_ACQUIRE))
+		return;
+	vm_write_all(dev->fd, &eox, 1);
+	vm_dev_release(dev);
+}
+
+/* Send data with shared handle, other fds writes wait.
+ * Returns EBUSY if device owned by other fd. */
+static int
+vm_dev_send(vm_dev_p dev, const uint8_t *buf, const size_t buf_size) {
+	int error = EBUSY;
+	vm_dev_p owner;
+
+	pthread_mutex_lock(&dev->name->mtx);
+	owner = dev->name->owner;
+	if (dev == owner) { /* Other fds do not write. */
+		pthread_mutex_unlock(&dev->name->mtx);
+	} else if (NULL != owner) {
+		pthread_mutex_unlock(&dev->name->mtx);
+		return (error);
+	}
+	if (NULL != dev->clock->emit_cb) {
+		dev->clock->emit_cb(dev->clock->emit_udata,
+		    dev->clock->now(dev->clock), dev->name->dev_name,
+		    buf, buf_size);
+	}
+	error = vm_write_all(dev->fd, buf, buf_size);
+	if (dev != owner) {
+		pthread_mutex_unlock(&dev->name->mtx);
+	}
+
+	return (error);
+}
+
+/* Send whole messages, incomplete SEQ_MIDIPUTC message is kept
+ * if force is not set. Sent message start owns device until its end.
+ * Data is kept on EBUSY. */
+static int
+vm_dev_flush(vm_dev_p dev, const int force) {
+	int error, partial;
+	size_t size = ((0 != force) ? dev->buf_used : dev->msg_end);
+
+	if (0 == size)
+		return (0);
+	partial = ((size > dev->msg_end) ? 1 : 0);
+	if (0 != partial) {
+		error = vm_dev_own(dev);
+		if (0 != error)
+			return (error);
+	}
+	error = vm_dev_send(dev, dev->buf, size); /* Drop on error. */
+	if (EBUSY == error)
+		return (error);
+	dev->buf_used -= size;
+	memmove(dev->buf, &dev->buf[size], dev->buf_used);
+	dev->msg_end = 0;
+	if (0 == partial &&
+	    0 == dev->sysex_part) { /* Message end sent. */
+		vm_dev_release(dev);
+	}
+
+	return (error);
+}
+
+/* One write() per device: called when time changes, before wait,
+ * timer events and after ioctl(). */
+static void
+vm_fd_devs_flush(vm_fd_p fd, const int force) {
+
+	for (size_t i = 0; i < fd->devs_count; i ++) {
+		vm_dev_flush(&fd->devs[i], force);
+	}
+}
+
+static int
+vm_dev_append(vm_dev_p dev, const uint8_t *buf, const size_t buf_size) {
+
+	if (0 > dev->fd) /* Not opened by writer or failed. */
+		return (EBADF);
+	if ((VM_DEV_BUF_SZ - dev->buf_used) < buf_size) {
+		vm_dev_flush(dev, 0);
+		if ((VM_DEV_BUF_SZ - dev->buf_used) < buf_size) {
+			/* Long SEQ_MIDIPUTC SYSEX or big event. */
+			vm_dev_flush(dev, 1);
+			if (VM_DEV_BUF_SZ < buf_size &&
+			    0 == dev->buf_used)
+				return (vm_dev_send(dev, buf, buf_size));
+			if ((VM_DEV_BUF_SZ - dev->buf_used) < buf_size)
+				return (EBUSY); /* Other fd owns device. */
+		}
+	}
+	memcpy(&dev->buf[dev->buf_used], buf, buf_size);
+	dev->buf_used += buf_size;
+
+	return (0);
+}
+
+/* Whole serialized message. */
+static int
+vm_dev_write(vm_dev_p dev, const uint8_t *buf, const size_t buf_size) {
+	int error;
+
+	error = vm_dev_append(dev, buf, buf_size);
+	if (0 != error)
+		return (error);
+	dev->msg_end = dev->buf_used;
+	dev->putc_left = 0;
+
+	return (0);
+}
+
+/* SEQ_MIDIPUTC: raw byte, track message end. */
+static int
+vm_dev_putc(vm_dev_p dev, const uint8_t c) {
+	int error;
+
+	error = vm_dev_append(dev, &c, 1);
+	if (0 != error)
+		return (error);
+	if (0x80 & c) { /* Status byte. */
+		if (MIDI_SYNC <= c) { /* Real-time: may be inside message. */
+			if (0 != dev->putc_left)
+				return (0);
+		} else if (MIDI_SYSEX == c) {
+			dev->putc_left = -1;
+			return (0);
+		} else if (MIDI_SYSEX_EOX == c) {
+			dev->putc_left = 0;
+		} else {
+			dev->putc_status = ((MIDI_SYSEX > c) ? c : 0);
+			dev->putc_left = (int)vm_event_status_data_len(c);
+			if (0 != dev->putc_left)
+				return (0);
+		}
+	} else { /* Data byte. */
+		if (0 > dev->putc_left)
+			return (0);
+		if (0 == dev->putc_left) {
+			if (0 == dev->putc_status) /* No running status. */
+				return (0);
+			dev->putc_left = (int)vm_event_status_data_len(
+			    dev->putc_status);
+		}
+		dev->putc_left --;
+		if (0 != dev->putc_left)
+			return (0);
+	}
+	dev->msg_end = dev->buf_used;
+
+	return (0);
+}
+
+/* EV_SYSEX: collect fragments until MIDI_SYSEX_EOX, then write as one message. */
+static int
+vm_dev_sysex(vm_dev_p dev, const uint8_t *buf, const size_t buf_size) {
+	int error;
+
+	if (0 > dev->fd)
+		return (EBADF);
+	if (NULL == dev->sysex) {
+		dev->sysex = malloc(MIDI_SYSEX_MAX_MSG_SIZE);
+		if (NULL == dev->sysex) { /* Pass as is. */
+			for (size_t i = 0; i < buf_size; i ++) {
+				vm_dev_putc(dev, buf[i]);
+			}
+			return (ENOMEM);
+		}
+	}
+	for (size_t i = 0; i < buf_size; i ++) {
+		if (MIDI_SYSEX == buf[i] &&
+		    0 != dev->sysex_used) { /* Unterminated: drop. */
+			dev->sysex_used = 0;
+			if (0 != dev->sysex_part) {
+				vm_dev_abort(dev);
+			}
+		}
+		if (MIDI_SYSEX_MAX_MSG_SIZE == dev->sysex_used) {
+			/* Too long: send collected part, device is owned
+			 * until EOX: other fds messages are not inside. */
+			error = vm_dev_flush(dev, 1);
+			if (0 == error) {
+				error = vm_dev_own(dev);
+			}
+			if (0 == error) {
+				error = vm_dev_send(dev, dev->sysex,
+				    dev->sysex_used);
+				dev->sysex_part = 1;
+			}
+			dev->sysex_used = 0;
+			if (0 != error)
+				return (error);
+		}
+		dev->sysex[dev->sysex_used ++] = buf[i];
+		if (MIDI_SYSEX_EOX != buf[i])
+			continue;
+		error = vm_dev_write(dev, dev->sysex, dev->sysex_used);
+		dev->sysex_used = 0;
+		if (0 != dev->sysex_part) { /* Message end: release device. */
+			dev->sysex_part = 0;
+			vm_dev_flush(dev, 0);
+			if (0 == dev->buf_used) {
+				vm_dev_release(dev);
+			}
+		}
+		if (0 != error)
+			return (error);
+	}
+
+	return (0);
+}
 
 static int
 vm_backend_event_write(vm_fd_p fd, const size_t dev, vm_evt_p evt) {
 	int error;
 	uint8_t buf[(MIDI_SYSEX_MAX_MSG_SIZE + 8)];
 	size_t buf_size;
-	ssize_t rc = 0;
 
 	if (NULL == fd ||
 	    dev >= fd->devs_count ||
@@ -91,13 +592,65 @@ vm_backend_event_write(vm_fd_p fd, const size_t dev, vm_evt_p evt) {
 	if (0 != error)
 		return (error);
 
-	for (size_t i = 0; i < buf_size; i += (size_t)rc) {
-		rc = write(fd->devs[dev].fd, &buf[i], (buf_size - i));
-		if (-1 == rc)
-			return (errno);
+	return (vm_dev_write(&fd->devs[dev], buf, buf_size));
+}
+
+static uint64_t
+vm_timespec_ns(const struct timespec *ts) {
+
+	return (((uint64_t)ts->tv_sec * 1000000000ull) + (uint64_t)ts->tv_nsec);
+}
+
+static uint64_t
+vm_clock_ns(void) {
+	struct timespec now;
+
+	if (0 != clock_gettime(CLOCK_MONOTONIC, &now))
+		return (0);
+	return (vm_timespec_ns(&now));
+}
+
+static uint64_t
+vm_clock_real_now(vm_clock_p clk __unused) {
+
+	return (vm_clock_ns());
+}
+
+static uint64_t
+vm_clock_sim_now(vm_clock_p clk) {
+
+	return (clk->sim_time);
+}
+
+static void
+vm_clock_sim_advance(vm_clock_p clk, const uint64_t time) {
+
+	if (time > clk->sim_time) {
+		clk->sim_time = time;
 	}
+}
 
-	return (0);
+static void
+vm_clock_init(vm_clock_p clk, vm_seq_dev_options_p opts) {
+
+	memset(clk, 0x00, sizeof(vm_clock_t));
+	if (0 != opts->sim_clock) {
+		clk->now = vm_clock_sim_now;
+		clk->advance = vm_clock_sim_advance;
+		clk->sim_time = vm_clock_ns();
+	} else {
+		clk->now = vm_clock_real_now;
+	}
+	clk->emit_cb = opts->emit_cb;
+	clk->emit_udata = opts->emit_udata;
+}
+
+static void
+vm_fd_clock_ts(vm_fd_p fd, struct timespec *ts) {
+	const uint64_t now = fd->clock.now(&fd->clock);
+
+	ts->tv_sec = (time_t)(now / 1000000000ull);
+	ts->tv_nsec = (long)(now % 1000000000ull);
 }
 
 static uint64_t
@@ -105,8 +658,7 @@ vm_time_get(vm_fd_p fd) {
 	uint64_t ret;
 	struct timespec now;
 
-	if (0 != clock_gettime(CLOCK_MONOTONIC, &now))
-		return (0);
+	vm_fd_clock_ts(fd, &now);
 	timespecsub(&now, &now, &fd->timer_start);
 	/* Convert to nanoseconds: 1 sec = 1000000000 nanoseconds. */
 	ret = ((uint64_t)now.tv_sec * 1000000000ul);
@@ -119,28 +671,54 @@ vm_time_get(vm_fd_p fd) {
 	return (ret);
 }
 
+/* Update tick duration after tempo or timebase change. */
 static void
-vm_timer_wait(vm_fd_p fd, const uint64_t ticks, const int wait_abs) {
-	int error;
-	uint64_t tmp;
-	struct timespec when;
+vm_fd_tick_update(vm_fd_p fd) {
+	const uint64_t div = (fd->timer_tempo * fd->timer_base);
 
-	tmp = ((ticks * 60ull * 1000000000ull) / (fd->timer_tempo * fd->timer_base));
-	/* 1 sec = 1000000000 nanoseconds. */
-	when.tv_sec = (tmp / 1000000000ul);
-	when.tv_nsec = (tmp % 1000000000ul);
+	fd->tick_ns = ((60ull * 1000000000ull) / div);
+	fd->tick_ns_frac = ((((60ull * 1000000000ull) % div) << 32) / div);
+}
 
-	if (0 != wait_abs) {
-		if (!timespecisset(&fd->timer_start)) /* Timer was not started! */
-			return;
-		timespecadd(&when, &fd->timer_start, &when);
-	}
+static uint64_t
+vm_ticks_to_ns(vm_fd_p fd, const uint32_t ticks) {
 
-	while (0 != (error = clock_nanosleep(CLOCK_MONOTONIC,
-	    ((0 != wait_abs) ? TIMER_ABSTIME : 0), &when, &when))) {
-		if (EINTR != error)
-			break;
+	return ((ticks * fd->tick_ns) +
+	    ((ticks * fd->tick_ns_frac) >> 32));
+}
+
+
+/* Return output device index of event, -1 if there is no device. */
+static int
+vm_sequencer_event_dev(const uint8_t *pbuf) {
+
+	switch (pbuf[0]) {
+	case SEQ_MIDIPUTC: /* 5. */
+		return (pbuf[2]);
+	case EV_CHN_COMMON: /* 0x92. */
+	case EV_CHN_VOICE: /* 0x93. */
+	case EV_SYSEX: /* 0x94. */
+		return (pbuf[1]);
 	}
+
+	return (-1);
+}
+
+/* Open output device on first use.
+ * Called by writer or SNDCTL_SEQ_OUTOFBAND with fd->mtx locked and
+ * fd->tx_busy set, it is unlocked while open(): open() of virtual_midi
+ * device may take seconds, dispatcher must not wait for it.
+ * fd->tx_busy protect devs from other writers. */
+static void
+vm_fd_dev_open(vm_fd_p fd, vm_dev_p dev) {
+	int dfd;
+
+	if (VM_DEV_FD_NONE != dev->fd)
+		return;
+	pthread_mutex_unlock(&fd->mtx);
+	dfd = vm_dev_name_open(dev->name);
+	pthread_mutex_lock(&fd->mtx);
+	dev->fd = ((-1 == dfd) ? VM_DEV_FD_FAILED : dfd);
 }
 
 
@@ -168,36 +746,33 @@ vm_sequencer_event_handle(vm_fd_p fd, const uint8_t *buf,
 		if (fd->devs_count <= (size_t)dev)
 			goto err_out;
 		p1 = pbuf[1];
-		/* Send the event to the next link in the chain. */
-		if (1 != write(fd->devs[dev].fd, &p1, 1))
+		/* Bytes gathered until time change, see vm_fd_devs_flush(). */
+		if (0 != vm_dev_putc(&fd->devs[dev], p1))
 			goto err_out;
 		break;
 	case EV_TIMING: /* 0x81. */
 		/* No dev. */
 		switch (pbuf[1]) { /* Timer event. */
 		case TMR_WAIT_REL: /* 1: SEQ_DELTA_TIME; ticks. */
-			memcpy(&param, &pbuf[4], sizeof(param));
-			vm_timer_wait(fd, param, 0);
-			break;
 		case TMR_WAIT_ABS: /* 2: SEQ_WAIT_TIME; ticks. */
-			memcpy(&param, &pbuf[4], sizeof(param));
-			vm_timer_wait(fd, param, 1);
+			/* Handled by vm_fd_dispatch(), ignored out of band. */
 			break;
 		case TMR_STOP: /* 3: SEQ_STOP_TIMER. */
 			if (!timespecisset(&fd->timer_start) ||
 			    timespecisset(&fd->timer_stop_diff))
 				break;
-			clock_gettime(CLOCK_MONOTONIC, &fd->timer_stop_diff);
+			vm_fd_clock_ts(fd, &fd->timer_stop_diff);
 			timespecsub(&fd->timer_stop_diff, &fd->timer_start,
 			    &fd->timer_stop_diff);
 			break;
 		case TMR_START: /* 4: SEQ_START_TIMER. */
-			clock_gettime(CLOCK_MONOTONIC, &fd->timer_start);
+			vm_fd_clock_ts(fd, &fd->timer_start);
+			fd->prev_deadline = 0;
 			break;
 		case TMR_CONTINUE: /* 5: SEQ_CONTINUE_TIMER. */
 			if (timespecisset(&fd->timer_stop_diff))
 				break;
-			clock_gettime(CLOCK_MONOTONIC, &fd->timer_start);
+			vm_fd_clock_ts(fd, &fd->timer_start);
 			timespecsub(&fd->timer_start, &fd->timer_stop_diff,
 			    &fd->timer_start);
 			timespecclear(&fd->timer_stop_diff);
@@ -210,6 +785,7 @@ vm_sequencer_event_handle(vm_fd_p fd, const uint8_t *buf,
 				param = 360;
 			}
 			fd->timer_tempo = param;
+			vm_fd_tick_update(fd);
 			break;
 		case TMR_TIMERBASE: /* 15. */
 			memcpy(&param, &pbuf[4], sizeof(param));
@@ -219,6 +795,7 @@ vm_sequencer_event_handle(vm_fd_p fd, const uint8_t *buf,
 				param = 1000;
 			}
 			fd->timer_base = param;
+			vm_fd_tick_update(fd);
 			break;
 		//case TMR_ECHO: /* 8: SEQ_ECHO_BACK; key. */
 		//case TMR_CLOCK: /* 9. */
@@ -278,20 +855,14 @@ vm_sequencer_event_handle(vm_fd_p fd, const uint8_t *buf,
 		dev = pbuf[1];
 		if (fd->devs_count <= (size_t)dev)
 			goto err_out;
-		/* See seq_sysex(). */
-		/* Find len. */
+		/* See seq_sysex(): raw bytes, 0xff - padding. */
 		for (param = 0; param < 6 && 0xff != pbuf[2 + param]; param ++)
 			;
-		memset(&mevt, 0x00, sizeof(mevt));
-		mevt.type = MIDI_SYSEX;
-		mevt.p1 = param;
-		mevt.ex_data = (void*)&pbuf[2];
-		/* Post data. */
-		vm_backend_event_write(fd, (size_t)dev, &mevt);
+		vm_dev_sysex(&fd->devs[dev], &pbuf[2], (size_t)param);
 		break;
 	case SEQ_FULLSIZE: /* 0xfd: Long events. */
-		/* TODO: restore code for SEQ_FULLSIZE. */
-		ev_size = buf_size; /* Flush. */
+		/* Handled by vm_write(). */
+		ev_size = buf_size;
 		break;
 	//case SEQ_ECHO: /* 8. */
 	//case EV_SEQ_LOCAL: /* 0x80. */
@@ -308,6 +879,432 @@ err_out:
 }
 
 
+/* Remove fd from run queue or timer wheel, vm_disp.mtx must be locked.
+ * Busy fd will be queued by dispatcher if needed. */
+static void
+vm_disp_fd_cancel_locked(vm_fd_p fd) {
+
+	switch (fd->disp_state) {
+	case VM_DISP_RUNQ:
+		TAILQ_REMOVE(&vm_disp.run_q, fd, disp_next);
+		break;
+	case VM_DISP_TIMER:
+		tw_del(&vm_disp.tw, &fd->disp_timer);
+		break;
+	default:
+		return;
+	}
+	fd->disp_state = VM_DISP_IDLE;
+}
+
+/* Ask dispatcher to play fd queue, fd->mtx must be locked. */
+static void
+vm_disp_fd_kick(vm_fd_p fd) {
+
+	if (0 == VM_FD_OUT_COUNT(fd))
+		return;
+	pthread_mutex_lock(&vm_disp.mtx);
+	if (VM_DISP_IDLE == fd->disp_state) {
+		fd->disp_state = VM_DISP_RUNQ;
+		TAILQ_INSERT_TAIL(&vm_disp.run_q, fd, disp_next);
+		pthread_cond_signal(&vm_disp.cond);
+	}
+	pthread_mutex_unlock(&vm_disp.mtx);
+}
+
+/* Called before fd free, fd->mtx must be unlocked. */
+static void
+vm_disp_fd_remove(vm_fd_p fd) {
+
+	pthread_mutex_lock(&vm_disp.mtx);
+	while (vm_disp.cur_fd == fd) {
+		pthread_cond_wait(&vm_disp.idle_cond, &vm_disp.mtx);
+	}
+	vm_disp_fd_cancel_locked(fd);
+	pthread_mutex_unlock(&vm_disp.mtx);
+}
+
+/* Called by dispatcher only. */
+static void
+vm_disp_late_add(const uint64_t late) {
+	size_t i;
+
+	for (i = 0; i < (VM_LATE_HIST_CNT - 1); i ++) {
+		if ((vm_late_hist_us[i] * 1000) > late)
+			break;
+	}
+	vm_disp.late_hist[i] ++;
+	if (late > vm_disp.late_max) {
+		vm_disp.late_max = late;
+	}
+}
+
+/* Wait end is closer than spin time: yield until it.
+ * Return 1 if other fd is due before: dispatcher must play it first.
+ * fd->mtx unlocked meanwhile, fd state may change. */
+static int
+vm_fd_spin_wait(vm_fd_p fd) {
+	int other_due = 0;
+	const uint64_t wait_until = fd->wait_until;
+	uint64_t now, next;
+
+	pthread_mutex_unlock(&fd->mtx);
+	while ((now = vm_clock_ns()) < wait_until) {
+		pthread_mutex_lock(&vm_disp.mtx);
+		other_due = (!TAILQ_EMPTY(&vm_disp.run_q) ||
+		    (0 == tw_next(&vm_disp.tw, &next) &&
+		     (next * vm_disp.tick_ns) <= now));
+		pthread_mutex_unlock(&vm_disp.mtx);
+		if (0 != other_due)
+			break;
+		sched_yield();
+	}
+	pthread_mutex_lock(&fd->mtx);
+
+	return (other_due);
+}
+
+/* Some output device is owned by other fd. */
+static int
+vm_fd_devs_busy(vm_fd_p fd) {
+
+	for (size_t i = 0; i < fd->devs_count; i ++) {
+		if (0 != vm_dev_busy(&fd->devs[i]))
+			return (1);
+	}
+
+	return (0);
+}
+
+/* Play queued events until wait, queue end or batch end.
+ * Called by dispatcher with fd->mtx locked. */
+static void
+vm_fd_dispatch(vm_fd_p fd) {
+	int state = VM_DISP_IDLE, busy = 0;
+	uint8_t ev[VM_OUT_Q_EVT_SZ];
+	size_t ev_size, off, part;
+	uint64_t now, deadline, timer;
+	uint32_t param;
+
+	now = fd->clock.now(&fd->clock);
+	for (size_t i = 0;; i ++) {
+		if (0 != fd->wait_until) {
+			if (fd->wait_until > now) {
+				if (NULL != fd->clock.advance) { /* No wait. */
+					fd->clock.advance(&fd->clock,
+					    fd->wait_until);
+					now = fd->wait_until;
+					continue;
+				}
+				if ((fd->wait_until - now) > vm_disp.spin_ns) {
+					state = VM_DISP_TIMER;
+					break;
+				}
+				if (0 != vm_fd_spin_wait(fd)) {
+					state = VM_DISP_RUNQ;
+					break;
+				}
+				now = vm_clock_ns();
+				continue;
+			}
+			if (NULL == fd->clock.advance) {
+				vm_disp_late_add((now - fd->wait_until));
+			}
+			fd->prev_deadline = fd->wait_until;
+			fd->wait_until = 0;
+		}
+		if (0 == VM_FD_OUT_COUNT(fd)) {
+			fd->prev_deadline = 0;
+			break;
+		}
+		if (VM_DISP_BATCH == i) { /* Let other fds play. */
+			state = VM_DISP_RUNQ;
+			break;
+		}
+		if (0 != vm_fd_devs_busy(fd)) { /* Keep order: retry later. */
+			state = VM_DISP_TIMER;
+			busy = 1;
+			break;
+		}
+		off = (fd->out_tail & (VM_OUT_Q_SZ - 1));
+		ev_size = ((128 <= fd->out_q[off]) ? 8 : 4);
+		part = MIN(ev_size, (VM_OUT_Q_SZ - off));
+		memcpy(ev, &fd->out_q[off], part);
+		memcpy(&ev[part], fd->out_q, (ev_size - part));
+		fd->out_tail += ev_size;
+		if (EV_TIMING == ev[0]) { /* Send events for previous time. */
+			vm_fd_devs_flush(fd, 0);
+		}
+		if (EV_TIMING != ev[0] ||
+		    (TMR_WAIT_REL != ev[1] && TMR_WAIT_ABS != ev[1])) {
+			vm_sequencer_event_handle(fd, ev, ev_size);
+			continue;
+		}
+		/* Relative to previous wait end: delays does not drift. */
+		if (TMR_WAIT_REL == ev[1]) {
+			deadline = ((0 != fd->prev_deadline) ?
+			    fd->prev_deadline : now);
+		} else {
+			if (!timespecisset(&fd->timer_start)) /* Timer was not started! */
+				continue;
+			deadline = vm_timespec_ns(&fd->timer_start);
+		}
+		memcpy(&param, &ev[4], sizeof(param));
+		fd->wait_until = (deadline + vm_ticks_to_ns(fd, param));
+		now = fd->clock.now(&fd->clock);
+	}
+	if (VM_DISP_RUNQ != state) { /* Keep gathering on next pass. */
+		vm_fd_devs_flush(fd, 0);
+	}
+
+	pthread_mutex_lock(&vm_disp.mtx);
+	fd->disp_state = state;
+	switch (state) {
+	case VM_DISP_RUNQ:
+		TAILQ_INSERT_TAIL(&vm_disp.run_q, fd, disp_next);
+		break;
+	case VM_DISP_TIMER: /* Never play before time, wake up to spin. */
+		timer = ((0 != busy) ? (vm_clock_ns() + VM_DEV_BUSY_RETRY_NS) :
+		    (fd->wait_until - vm_disp.spin_ns));
+		tw_add(&vm_disp.tw, &fd->disp_timer,
+		    ((timer + (vm_disp.tick_ns - 1)) / vm_disp.tick_ns));
+		break;
+	}
+	pthread_mutex_unlock(&vm_disp.mtx);
+
+	/* Writers, SNDCTL_SEQ_SYNC, close. */
+	pthread_cond_broadcast(&fd->cond);
+	if (0 != fd->poll_wait &&
+	    VM_FD_OUT_FREE_EVENTS(fd) >= fd->out_lowat) {
+		fd->poll_wait = 0;
+		cuse_poll_wakeup();
+	}
+}
+
+static void *
+vm_disp_proc(void *arg __unused) {
+	vm_fd_p fd;
+	tw_node_p node;
+	tw_list_t expired;
+	uint64_t next;
+	struct timespec ts;
+
+	TAILQ_INIT(&expired);
+	pthread_mutex_lock(&vm_disp.mtx);
+	while (0 != vm_disp.running) {
+		tw_advance(&vm_disp.tw, (vm_clock_ns() / vm_disp.tick_ns),
+		    &expired);
+		while (NULL != (node = TAILQ_FIRST(&expired))) {
+			TAILQ_REMOVE(&expired, node, next);
+			fd = node->udata;
+			fd->disp_state = VM_DISP_RUNQ;
+			TAILQ_INSERT_TAIL(&vm_disp.run_q, fd, disp_next);
+		}
+		fd = TAILQ_FIRST(&vm_disp.run_q);
+		if (NULL != fd) {
+			TAILQ_REMOVE(&vm_disp.run_q, fd, disp_next);
+			fd->disp_state = VM_DISP_BUSY;
+			vm_disp.cur_fd = fd;
+			pthread_mutex_unlock(&vm_disp.mtx);
+			pthread_mutex_lock(&fd->mtx);
+			vm_fd_dispatch(fd);
+			pthread_mutex_unlock(&fd->mtx);
+			pthread_mutex_lock(&vm_disp.mtx);
+			vm_disp.cur_fd = NULL;
+			pthread_cond_broadcast(&vm_disp.idle_cond);
+			continue;
+		}
+		/* Sleep until nearest timer or new events. */
+		if (0 != tw_next(&vm_disp.tw, &next)) {
+			pthread_cond_wait(&vm_disp.cond, &vm_disp.mtx);
+			continue;
+		}
+		next *= vm_disp.tick_ns;
+		ts.tv_sec = (time_t)(next / 1000000000ull);
+		ts.tv_nsec = (long)(next % 1000000000ull);
+		pthread_cond_timedwait(&vm_disp.cond, &vm_disp.mtx, &ts);
+	}
+	pthread_mutex_unlock(&vm_disp.mtx);
+
+	return (NULL);
+}
+
+/* spin_us used only by first started device. */
+static int
+vm_disp_start(const uint32_t spin_us) {
+	int error = 0;
+	pthread_condattr_t cattr;
+
+	pthread_mutex_lock(&vm_disp.mtx);
+	if (0 != vm_disp.ref_cnt)
+		goto out;
+	vm_disp.spin_ns = (MIN(spin_us, VM_DISP_SPIN_MAX_US) * 1000ull);
+	/* Wake up in spin time before wait end. */
+	vm_disp.tick_ns = MAX(VM_DISP_TICK_MIN_NS,
+	    MIN(VM_DISP_TICK_NS, (vm_disp.spin_ns / 2)));
+	if (0 == vm_disp.spin_ns) {
+		vm_disp.tick_ns = VM_DISP_TICK_NS;
+	}
+	pthread_condattr_init(&cattr);
+	pthread_condattr_setclock(&cattr, CLOCK_MONOTONIC);
+	error = pthread_cond_init(&vm_disp.cond, &cattr);
+	pthread_condattr_destroy(&cattr);
+	if (0 != error)
+		goto err_out;
+	error = pthread_cond_init(&vm_disp.idle_cond, NULL);
+	if (0 != error)
+		goto err_out_cond;
+	TAILQ_INIT(&vm_disp.run_q);
+	tw_init(&vm_disp.tw, (vm_clock_ns() / vm_disp.tick_ns));
+	vm_disp.running = 1;
+	error = pthread_create(&vm_disp.td, NULL, vm_disp_proc, NULL);
+	if (0 != error)
+		goto err_out_td;
+out:
+	vm_disp.ref_cnt ++;
+	pthread_mutex_unlock(&vm_disp.mtx);
+
+	return (0);
+
+err_out_td:
+	vm_disp.running = 0;
+	pthread_cond_destroy(&vm_disp.idle_cond);
+err_out_cond:
+	pthread_cond_destroy(&vm_disp.cond);
+err_out:
+	pthread_mutex_unlock(&vm_disp.mtx);
+
+	return (error);
+}
+
+static void
+vm_disp_stop(void) {
+
+	pthread_mutex_lock(&vm_disp.mtx);
+	if (0 == vm_disp.ref_cnt) {
+		pthread_mutex_unlock(&vm_disp.mtx);
+		return;
+	}
+	vm_disp.ref_cnt --;
+	if (0 != vm_disp.ref_cnt) {
+		pthread_mutex_unlock(&vm_disp.mtx);
+		return;
+	}
+	vm_disp.running = 0;
+	pthread_cond_signal(&vm_disp.cond);
+	pthread_mutex_unlock(&vm_disp.mtx);
+	pthread_join(vm_disp.td, NULL);
+	pthread_cond_destroy(&vm_disp.idle_cond);
+	pthread_cond_destroy(&vm_disp.cond);
+}
+
+/* Wait for fd->cond, fd->mtx must be locked.
+ * Wakeup periodically to check that peer is not interrupted. */
+static int
+vm_fd_cond_wait(vm_fd_p fd, int fflags) {
+	struct timespec ts;
+	static const struct timespec ts_wait = {
+		.tv_sec = 0,
+		.tv_nsec = VM_TX_WAIT_NS
+	};
+
+	if (0 != (CUSE_FFLAG_NONBLOCK & fflags))
+		return (CUSE_ERR_WOULDBLOCK);
+	if (0 == cuse_got_peer_signal())
+		return (CUSE_ERR_SIGNAL);
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	timespecadd(&ts, &ts_wait, &ts);
+	pthread_cond_timedwait(&fd->cond, &fd->mtx, &ts);
+
+	return (0);
+}
+
+/* SEQ_FULLSIZE: struct sysex_info header followed by len bytes.
+ * SYSEX_PATCH payload is streamed to device by writer, in same write()
+ * call, after all queued events played. Device is owned until SYSEX
+ * end, so other fds can not break it: dispatcher holds back their
+ * events, no lock is held while payload is copied in and written. */
+static int
+vm_fd_fullsize_start(vm_fd_p fd, int fflags, const uint8_t *hdr,
+    vm_fullsize_p fs) {
+	int error;
+	uint16_t key, dev;
+	int32_t size;
+
+	memcpy(&key, &hdr[0], sizeof(key));
+	memcpy(&dev, &hdr[2], sizeof(dev));
+	memcpy(&size, &hdr[4], sizeof(size));
+	fs->dev = NULL;
+	fs->left = ((0 < size) ? (size_t)size : 0);
+	fs->last = 0;
+	if (SYSEX_PATCH != key ||
+	    fd->devs_count <= (size_t)dev) /* Skip payload. */
+		return (0);
+	vm_fd_dev_open(fd, &fd->devs[dev]);
+	if (0 > fd->devs[dev].fd)
+		return (0);
+	/* Play queued events first. */
+	vm_disp_fd_kick(fd);
+	while (0 != VM_FD_OUT_COUNT(fd) || 0 != fd->wait_until) {
+		error = vm_fd_cond_wait(fd, fflags);
+		if (0 != error)
+			return (error);
+	}
+	/* Wait other fd message end. */
+	while (0 != vm_dev_own(&fd->devs[dev])) {
+		error = vm_fd_cond_wait(fd, fflags);
+		if (0 != error)
+			return (error);
+	}
+	vm_dev_flush(&fd->devs[dev], 1);
+	fs->dev = &fd->devs[dev];
+
+	return (0);
+}
+
+static void
+vm_fd_fullsize_end(vm_fullsize_p fs) {
+	static const uint8_t eox = MIDI_SYSEX_EOX;
+
+	if (NULL == fs->dev)
+		return;
+	if (0 != fs->last &&
+	    MIDI_SYSEX_EOX != fs->last) { /* Truncated. */
+		vm_write_all(fs->dev->fd, &eox, 1);
+	}
+	vm_dev_release(fs->dev);
+	fs->dev = NULL;
+}
+
+/* Send payload part, rest of payload after SYSEX end is skipped.
+ * fd->mtx is unlocked while write(): slow port may take seconds. */
+static void
+vm_fd_fullsize_send(vm_fd_p fd, vm_fullsize_p fs, const uint8_t *buf,
+    size_t size) {
+	const uint8_t *eox;
+
+	fs->left -= size;
+	if (NULL == fs->dev)
+		return;
+	if (0 == fs->last &&
+	    MIDI_SYSEX != buf[0]) { /* Not SYSEX. */
+		vm_fd_fullsize_end(fs);
+		return;
+	}
+	eox = memchr(buf, MIDI_SYSEX_EOX, size);
+	if (NULL != eox) {
+		size = (size_t)((eox - buf) + 1);
+	}
+	pthread_mutex_unlock(&fd->mtx);
+	vm_write_all(fs->dev->fd, buf, size);
+	pthread_mutex_lock(&fd->mtx);
+	fs->last = buf[(size - 1)];
+	if (NULL != eox || 0 == fs->left) {
+		vm_fd_fullsize_end(fs);
+	}
+}
+
+
 /* Returns 1 if the directory entry should be included in the diff, else 0. */
 static int
 scandir_filter_cb(const struct dirent *de) {
@@ -335,91 +1332,377 @@ scandir_filter_cb(const struct dirent *de) {
 }
 
 static int
-vm_open(struct cuse_dev *pdev, int fflags) {
-	int rc;
-	vm_fd_p fd;
+vm_dev_name_match(const char *d_name, const char **inc_lst,
+    const size_t inc_lst_cnt) {
+
+	for (size_t i = 0; i < inc_lst_cnt; i ++) {
+		if (0 == strncmp(d_name, inc_lst[i], strlen(inc_lst[i])))
+			return (1);
+	}
+
+	return (0);
+}
+
+static vm_dev_name_p
+vm_dev_list_find(vm_dev_list_p list, const char *dev_name) {
+
+	if (NULL == list)
+		return (NULL);
+	for (size_t i = 0; i < list->count; i ++) {
+		if (0 == strcmp(list->names[i]->dev_name, dev_name))
+			return (list->names[i]);
+	}
+
+	return (NULL);
+}
+
+/* Build new output devices list.
+ * Only new devices are opened, to get description: busy or not ready
+ * one gets default description and is listed anyway. */
+static int
+vm_seq_dev_scan(vm_seq_dev_p sdev) {
+	int rc, dfd;
+	vm_dev_list_p list, old;
+	vm_dev_name_p name;
 	struct midi_info mi;
 	struct dirent **dirp = NULL;
-	const char **inc_lst = (const char**)cuse_dev_get_priv0(pdev);
-	const size_t inc_lst_cnt = (size_t)cuse_dev_get_priv1(pdev);
-	void *tptr;
+	char dev_name[PATH_MAX], descr[VM_DEV_DESCR_SZ];
 
-	fd = calloc(1, sizeof(vm_fd_t));
+	pthread_mutex_lock(&sdev->scan_mtx);
+	rc = scandir("/dev", &dirp, scandir_filter_cb, alphasort);
+	if (-1 == rc) {
+		rc = errno;
+		pthread_mutex_unlock(&sdev->scan_mtx);
+		return (rc);
+	}
+	list = malloc(sizeof(vm_dev_list_t) +
+	    ((size_t)rc * sizeof(vm_dev_name_p)));
+	if (NULL == list) {
+		for (size_t i = 0; i < (size_t)rc; i ++) {
+			free(dirp[i]);
+		}
+		free(dirp);
+		pthread_mutex_unlock(&sdev->scan_mtx);
+		return (ENOMEM);
+	}
+	list->count = 0;
+	old = sdev->devs; /* Changed only here. */
+	for (size_t i = 0; i < (size_t)rc; i ++) {
+		if (0 == vm_dev_name_match(dirp[i]->d_name, sdev->inc_lst,
+		    sdev->inc_lst_cnt))
+			goto next;
+		snprintf(dev_name, sizeof(dev_name), "/dev/%s",
+		    dirp[i]->d_name);
+		name = vm_dev_list_find(old, dev_name);
+		if (NULL == name) {
+			/* Busy or not ready device is listed too:
+			 * it is opened again on first use. */
+			dfd = open(dev_name, O_RDWR);
+			if (-1 != dfd &&
+			    0 == ioctl(dfd, SNDCTL_MIDI_INFO, &mi)) {
+				strlcpy(descr, mi.name, sizeof(descr));
+			} else {
+				snprintf(descr, sizeof(descr),
+				    "H/W MIDI: %s", dirp[i]->d_name);
+			}
+			if (-1 != dfd) {
+				close(dfd);
+			}
+			name = vm_dev_name_get(dev_name, descr);
+			if (NULL == name)
+				goto next;
+		}
+		list->names[list->count ++] = name;
+next:
+		free(dirp[i]);
+	}
+	free(dirp);
+
+	pthread_mutex_lock(&sdev->mtx);
+	sdev->devs = list;
+	pthread_mutex_unlock(&sdev->mtx);
+	pthread_mutex_unlock(&sdev->scan_mtx);
+	free(old);
+
+	return (0);
+}
+
+#if defined(__linux__)
+static int
+vm_seq_dev_notify_open(void) {
+	int fd;
+
+	fd = inotify_init1((IN_NONBLOCK | IN_CLOEXEC));
+	if (-1 == fd)
+		return (-1);
+	if (-1 == inotify_add_watch(fd, "/dev", (IN_CREATE | IN_DELETE))) {
+		close(fd);
+		return (-1);
+	}
+
+	return (fd);
+}
+
+/* Return 1 if matched device created or destroyed, -1 on error. */
+static int
+vm_seq_dev_notify_read(vm_seq_dev_p sdev) {
+	int ret = 0;
+	ssize_t rc;
+	const struct inotify_event *ie;
+	uint8_t buf[4096] __aligned(__alignof__(struct inotify_event));
+
+	rc = read(sdev->notify_fd, buf, sizeof(buf));
+	if (0 >= rc)
+		return (((-1 == rc && (EAGAIN == errno || EINTR == errno)) ?
+		    0 : -1));
+	for (size_t off = 0; off < (size_t)rc;
+	    off += (sizeof(struct inotify_event) + ie->len)) {
+		ie = (const struct inotify_event*)&buf[off];
+		if (0 != ie->len &&
+		    0 != vm_dev_name_match(ie->name, sdev->inc_lst,
+		    sdev->inc_lst_cnt)) {
+			ret = 1;
+		}
+	}
+
+	return (ret);
+}
+#else /* devd(8) notifications. */
+static int
+vm_seq_dev_notify_open(void) {
+	int fd;
+	struct sockaddr_un addr;
+
+	fd = socket(PF_LOCAL, (SOCK_SEQPACKET | SOCK_CLOEXEC), 0);
+	if (-1 == fd)
+		return (-1);
+	memset(&addr, 0x00, sizeof(addr));
+	addr.sun_family = AF_LOCAL;
+	strlcpy(addr.sun_path, VM_DEVD_PIPE, sizeof(addr.sun_path));
+	if (0 != connect(fd, (struct sockaddr*)&addr, sizeof(addr))) {
+		close(fd);
+		return (-1);
+	}
+
+	return (fd);
+}
+
+/* Return 1 if matched device created or destroyed, -1 on error.
+ * Message: "!system=DEVFS subsystem=CDEV type=CREATE cdev=umidi0.0". */
+static int
+vm_seq_dev_notify_read(vm_seq_dev_p sdev) {
+	ssize_t rc;
+	const char *cdev;
+	char buf[1024];
+
+	rc = recv(sdev->notify_fd, buf, (sizeof(buf) - 1), 0);
+	if (0 >= rc)
+		return (((-1 == rc && EINTR == errno) ? 0 : -1));
+	buf[rc] = 0;
+	if (NULL == strstr(buf, "system=DEVFS"))
+		return (0);
+	cdev = strstr(buf, " cdev=");
+	if (NULL == cdev)
+		return (0);
+	cdev += 6;
+
+	return (vm_dev_name_match(cdev, sdev->inc_lst, sdev->inc_lst_cnt));
+}
+#endif
+
+static void *
+vm_seq_dev_notify_proc(void *arg) {
+	vm_seq_dev_p sdev = arg;
+	struct pollfd pfd;
+
+	pfd.fd = sdev->notify_fd;
+	pfd.events = POLLIN;
+	while (0 != sdev->running) {
+		pfd.revents = 0;
+		if (0 >= poll(&pfd, 1, VM_NOTIFY_POLL_MS))
+			continue;
+		switch (vm_seq_dev_notify_read(sdev)) {
+		case 0:
+			break;
+		case 1:
+			vm_seq_dev_scan(sdev);
+			break;
+		default: /* devd restarted or other error. */
+			sdev->rescan = 1;
+			return (NULL);
+		}
+	}
+
+	return (NULL);
+}
+
+static void
+vm_seq_dev_free(vm_seq_dev_p sdev) {
+
+	if (NULL == sdev)
+		return;
+	if (-1 != sdev->notify_fd) {
+		sdev->running = 0;
+		pthread_join(sdev->notify_td, NULL);
+		close(sdev->notify_fd);
+	}
+	free(sdev->devs);
+	pthread_mutex_destroy(&sdev->scan_mtx);
+	pthread_mutex_destroy(&sdev->mtx);
+	free(sdev);
+}
+
+static vm_seq_dev_p
+vm_seq_dev_alloc(const char **inc_lst, const size_t inc_lst_cnt) {
+	int error;
+	vm_seq_dev_p sdev;
+
+	sdev = calloc(1, sizeof(vm_seq_dev_t));
+	if (NULL == sdev)
+		return (NULL);
+	sdev->inc_lst = inc_lst;
+	sdev->inc_lst_cnt = inc_lst_cnt;
+	sdev->notify_fd = -1;
+	error = pthread_mutex_init(&sdev->mtx, NULL);
+	if (0 != error)
+		goto err_out;
+	error = pthread_mutex_init(&sdev->scan_mtx, NULL);
+	if (0 != error)
+		goto err_out_mtx;
+	/* Start before scan to not miss devices. */
+	sdev->notify_fd = vm_seq_dev_notify_open();
+	if (-1 != sdev->notify_fd) {
+		sdev->running = 1;
+		if (0 != pthread_create(&sdev->notify_td, NULL,
+		    vm_seq_dev_notify_proc, sdev)) {
+			close(sdev->notify_fd);
+			sdev->notify_fd = -1;
+		}
+	}
+	if (-1 == sdev->notify_fd) {
+		sdev->rescan = 1;
+	}
+	error = vm_seq_dev_scan(sdev);
+	if (0 != error) {
+		vm_seq_dev_free(sdev);
+		errno = error;
+		return (NULL);
+	}
+
+	return (sdev);
+
+err_out_mtx:
+	pthread_mutex_destroy(&sdev->mtx);
+err_out:
+	free(sdev);
+	errno = error;
+	return (NULL);
+}
+
+
+static int
+vm_open(struct cuse_dev *pdev, int fflags) {
+	size_t count;
+	vm_fd_p fd;
+	pthread_condattr_t cattr;
+	vm_seq_dev_p sdev = cuse_dev_get_priv0(pdev);
+
+	fd = obj_pool_alloc(&vm_fd_pool);
 	if (NULL == fd)
 		return (CUSE_ERR_NO_MEMORY);
 	if (0 != pthread_mutex_init(&fd->mtx, NULL)) {
-		free(fd);
+		obj_pool_free(&vm_fd_pool, fd);
+		return (CUSE_ERR_NO_MEMORY);
+	}
+	pthread_condattr_init(&cattr);
+	pthread_condattr_setclock(&cattr, CLOCK_MONOTONIC);
+	if (0 != pthread_cond_init(&fd->cond, &cattr)) {
+		pthread_condattr_destroy(&cattr);
+		pthread_mutex_destroy(&fd->mtx);
+		obj_pool_free(&vm_fd_pool, fd);
 		return (CUSE_ERR_NO_MEMORY);
 	}
+	pthread_condattr_destroy(&cattr);
+	fd->out_lowat = (VM_OUT_Q_EVENTS / 2);
+	fd->disp_timer.udata = fd;
 	fd->open_fflags = fflags;
 	fd->timer_base = 100;
 	fd->timer_tempo = 60;
+	vm_fd_tick_update(fd);
+	vm_clock_init(&fd->clock, &sdev->opts);
+	fd->devs = fd->devs_inline;
 
-	rc = scandir("/dev", &dirp, scandir_filter_cb, alphasort);
-	if (-1 == rc)
-		goto err_out;
-	if (NULL != dirp) {
-		fd->devs = calloc((size_t)rc, sizeof(vm_dev_t));
-		if (NULL == fd->devs)
+	if (0 != sdev->rescan) {
+		vm_seq_dev_scan(sdev);
+	}
+	/* Take names from registry. */
+	pthread_mutex_lock(&sdev->mtx);
+	count = ((NULL != sdev->devs) ? sdev->devs->count : 0);
+	if (VM_DEVS_INLINE < count) {
+		fd->devs = calloc(count, sizeof(vm_dev_t));
+		if (NULL == fd->devs) {
+			pthread_mutex_unlock(&sdev->mtx);
 			goto err_out;
-		for (size_t i = 0; i < (size_t)rc; i ++) {
-			for (size_t j = 0; j < inc_lst_cnt; j ++) {
-				if (dirp[i]->d_name != strnstr(dirp[i]->d_name,
-				    inc_lst[j], dirp[i]->d_namlen))
-					continue;
-				snprintf(fd->devs[fd->devs_count].dev_name,
-				    sizeof(fd->devs[0].dev_name),
-				    "/dev/%s", dirp[i]->d_name);
-				fd->devs[fd->devs_count].fd = open(
-				    fd->devs[fd->devs_count].dev_name, O_RDWR);
-				if (-1 == fd->devs[fd->devs_count].fd)
-					continue;
-				if (0 == ioctl(fd->devs[fd->devs_count].fd,
-				    SNDCTL_MIDI_INFO, &mi)) {
-					strlcpy(fd->devs[fd->devs_count].descr,
-					    mi.name, sizeof(fd->devs[0].descr));
-				} else {
-					snprintf(fd->devs[fd->devs_count].descr,
-					    sizeof(fd->devs[0].descr),
-					    "H/W MIDI: %s", dirp[i]->d_name);
-				}
-				fd->devs_count ++;
-				break;
-			}
-			free(dirp[i]);
-		}
-		free(dirp);
-		tptr = reallocarray(fd->devs, (fd->devs_count + 1), sizeof(vm_dev_t));
-		if (NULL != tptr) { /* Fail not critical, ignore it. */
-			fd->devs = tptr;
 		}
 	}
+	for (size_t i = 0; i < count; i ++) {
+		fd->devs[i].name = sdev->devs->names[i];
+	}
+	pthread_mutex_unlock(&sdev->mtx);
+	/* Opened on first event, see vm_fd_devs_open(). */
+	for (size_t i = 0; i < count; i ++) {
+		fd->devs[i].fd = VM_DEV_FD_NONE;
+		fd->devs[i].clock = &fd->clock;
+	}
+	fd->devs_count = count;
 
 	cuse_dev_set_per_file_handle(pdev, fd);
 
 	return (0);
 
 err_out:
+	pthread_cond_destroy(&fd->cond);
 	pthread_mutex_destroy(&fd->mtx);
-	free(fd);
+	obj_pool_free(&vm_fd_pool, fd);
 	return (CUSE_ERR_NO_MEMORY);
 }
 
 static int
 vm_close(struct cuse_dev *pdev, int fflags __unused) {
 	vm_fd_p fd = cuse_dev_get_per_file_handle(pdev);
+	struct timespec ts, ts_end;
 
 	if (fd == NULL)
 		return (CUSE_ERR_INVALID);
 
+	/* Let dispatcher play queued events. */
+	clock_gettime(CLOCK_MONOTONIC, &ts_end);
+	ts_end.tv_sec += VM_CLOSE_WAIT;
+	pthread_mutex_lock(&fd->mtx);
+	while (0 != VM_FD_OUT_COUNT(fd) || 0 != fd->wait_until) {
+		if (0 != vm_fd_cond_wait(fd, 0))
+			break;
+		clock_gettime(CLOCK_MONOTONIC, &ts);
+		if (timespeccmp(&ts, &ts_end, >))
+			break;
+	}
+	pthread_mutex_unlock(&fd->mtx);
+	vm_disp_fd_remove(fd);
+	vm_fd_devs_flush(fd, 1);
+
+	pthread_cond_destroy(&fd->cond);
 	pthread_mutex_destroy(&fd->mtx);
-	if (NULL != fd->devs) {
-		for (size_t i = 0; i < fd->devs_count; i ++) {
-			close(fd->devs[i].fd);
-		}
+	for (size_t i = 0; i < fd->devs_count; i ++) {
+		free(fd->devs[i].sysex);
+		if (0 > fd->devs[i].fd)
+			continue;
+		vm_dev_abort(&fd->devs[i]);
+		vm_dev_name_close(fd->devs[i].name);
+	}
+	if (fd->devs_inline != fd->devs) {
 		free(fd->devs);
 	}
-	free(fd);
+	obj_pool_free(&vm_fd_pool, fd);
 	cuse_dev_set_per_file_handle(pdev, NULL);
 
 	return (0);
@@ -432,50 +1715,106 @@ vm_read(struct cuse_dev *pdev __unused, int fflags __unused,
 	return (CUSE_ERR_INVALID);
 }
 
+/* Queue events and return, dispatcher play them at time.
+ * Block only while queue is full. */
 static int
-vm_write(struct cuse_dev *pdev, int fflags __unused, const void *peer_ptr,
+vm_write(struct cuse_dev *pdev, int fflags, const void *peer_ptr,
     int len) {
 	vm_fd_p fd = cuse_dev_get_per_file_handle(pdev);
-	int error, retval = 0;
+	int error = 0, dev;
 	uint8_t buf[VM_WRITE_BUF_SZ];
-	size_t buf_size;
+	size_t i, j, size, done, carry = 0, buf_size, ev_size, off, part;
+	vm_fullsize_t fs;
 
 	if (fd == NULL)
 		return (CUSE_ERR_INVALID);
 
 	pthread_mutex_lock(&fd->mtx);
-	if (fd->tx_busy) {
-		pthread_mutex_unlock(&fd->mtx);
-		return (CUSE_ERR_BUSY);
+	if (0 != fd->nonblock) {
+		fflags |= CUSE_FFLAG_NONBLOCK;
+	}
+	while (0 != fd->tx_busy) {
+		error = vm_fd_cond_wait(fd, fflags);
+		if (0 != error) {
+			pthread_mutex_unlock(&fd->mtx);
+			return (error);
+		}
 	}
+	fd->tx_busy = 1;
+	memset(&fs, 0x00, sizeof(fs));
 
-	for (size_t i = 0; i < (size_t)len; i += sizeof(buf)) {
-		fd->tx_busy = 1;
+	done = (size_t)len;
+	for (i = 0; i < (size_t)len; i += size) {
 		pthread_mutex_unlock(&fd->mtx);
-		buf_size = MIN(sizeof(buf), (size_t)((size_t)len - i));
+		size = MIN((sizeof(buf) - carry), (size_t)((size_t)len - i));
 		error = cuse_copy_in((((const uint8_t*)peer_ptr) + i),
-		    &buf, (int)buf_size);
+		    &buf[carry], (int)size);
 		pthread_mutex_lock(&fd->mtx);
-		fd->tx_busy = 0;
 		if (error != 0) {
-			retval = error;
+			done = (i - carry);
 			break;
 		}
 
-		for (size_t j = 0; j < buf_size;) {
-			j += vm_sequencer_event_handle(fd,
-			    (buf + j), (buf_size - j));
+		buf_size = (carry + size);
+		for (j = 0; j < buf_size; j += ev_size) {
+			if (0 != fs.left) { /* SEQ_FULLSIZE payload. */
+				ev_size = MIN(fs.left, (buf_size - j));
+				vm_fd_fullsize_send(fd, &fs, &buf[j], ev_size);
+				continue;
+			}
+			if (SEQ_FULLSIZE == buf[j]) {
+				ev_size = offsetof(struct sysex_info, data);
+				if ((j + ev_size) > buf_size)
+					break;
+				error = vm_fd_fullsize_start(fd, fflags,
+				    &buf[j], &fs);
+				if (0 != error) {
+					done = ((i - carry) + j);
+					goto out;
+				}
+				continue;
+			}
+			ev_size = ((128 <= buf[j]) ? 8 : 4);
+			if ((j + ev_size) > buf_size) /* Rest in next chunk. */
+				break;
+			dev = vm_sequencer_event_dev(&buf[j]);
+			if (0 <= dev &&
+			    fd->devs_count > (size_t)dev) {
+				vm_fd_dev_open(fd, &fd->devs[dev]);
+			}
+			while (ev_size > VM_FD_OUT_FREE(fd)) {
+				vm_disp_fd_kick(fd);
+				error = vm_fd_cond_wait(fd, fflags);
+				if (0 != error) {
+					done = ((i - carry) + j);
+					goto out;
+				}
+			}
+			off = (fd->out_head & (VM_OUT_Q_SZ - 1));
+			part = MIN(ev_size, (VM_OUT_Q_SZ - off));
+			memcpy(&fd->out_q[off], &buf[j], part);
+			memcpy(fd->out_q, &buf[(j + part)], (ev_size - part));
+			fd->out_head += ev_size;
 		}
-		retval += buf_size;
+		/* Move incomplete event to buf start. */
+		carry = (buf_size - j);
+		memmove(buf, &buf[j], carry);
 	}
-
+	/* Incomplete event at write() end is dropped. */
+out:
+	vm_fd_fullsize_end(&fs);
+	vm_disp_fd_kick(fd);
+	fd->tx_busy = 0;
+	pthread_cond_broadcast(&fd->cond);
 	pthread_mutex_unlock(&fd->mtx);
 
-	return (retval);
+	if (0 != done)
+		return ((int)done);
+	return (error);
 }
 
 static int
-vm_ioctl(struct cuse_dev *pdev, int fflags __unused,
+vm_ioctl(struct cuse_dev *pdev, int fflags,
     unsigned long cmd, void *peer_data) {
 	vm_fd_p fd = cuse_dev_get_per_file_handle(pdev);
 	int error = 0, midiunit;
@@ -508,14 +1847,23 @@ vm_ioctl(struct cuse_dev *pdev, int fflags __unused,
 
 	switch (cmd) {
 	case FIOASYNC: /* _IOW('f', 125, int): set/clear async i/o. */
-	case FIONBIO: /* _IOW('f', 126, int): set/clear non-blocking i/o. */
 		/* Not implemented. */
 		break;
+	case FIONBIO: /* _IOW('f', 126, int): set/clear non-blocking i/o. */
+		fd->nonblock = (0 != data.ival);
+		break;
 	case FIONREAD: /* _IOR('f', 127, int): get # bytes to read. */
 		data.ival = 0;
 		break;
+#ifdef FIONSPACE
+	case FIONSPACE: /* _IOR('f', 118, int): get space in send queue. */
+		/* Report how many bytes write() accept without blocking. */
+		data.ival = (int)VM_FD_OUT_FREE(fd);
+		break;
+#endif
 	case FIONWRITE: /* _IOR('f', 119, int): get # bytes (yet) to write. */
-		data.ival = VM_WRITE_BUF_SZ;
+		/* Queued events bytes that are not played yet. */
+		data.ival = (int)VM_FD_OUT_COUNT(fd);
 		break;
 	case SNDCTL_TMR_TIMEBASE: /* Set timer base. */
 		event[1] = TMR_TIMERBASE;
@@ -546,16 +1894,35 @@ vm_ioctl(struct cuse_dev *pdev, int fflags __unused,
 		break;
 	case SNDCTL_SEQ_RESET: /* SNDCTL_SEQ_PANIC == SNDCTL_SEQ_RESET */
 	case SNDCTL_SEQ_PANIC:
+		/* Drop queued events. */
+		fd->out_tail = fd->out_head;
+		fd->wait_until = 0;
+		fd->prev_deadline = 0;
+		pthread_mutex_lock(&vm_disp.mtx);
+		vm_disp_fd_cancel_locked(fd);
+		pthread_mutex_unlock(&vm_disp.mtx);
+		pthread_cond_broadcast(&fd->cond);
 		memset(&mevt, 0x00, sizeof(mevt));
 		mevt.type = MIDI_SYSTEM_RESET;
+		/* Not opened devices are skipped. */
 		for (size_t i = 0; i < fd->devs_count; i ++) {
+			fd->devs[i].sysex_used = 0;
+			vm_dev_abort(&fd->devs[i]);
 			vm_backend_event_write(fd, i, &mevt);
 		}
 		break;
-	case SNDCTL_SEQ_SYNC:
+	case SNDCTL_SEQ_SYNC: /* Wait until all queued events played. */
 		if (0 == (FWRITE & fd->open_fflags))
 			break;
-		/* Not implemented. */
+		if (0 != fd->nonblock) {
+			fflags |= CUSE_FFLAG_NONBLOCK;
+		}
+		vm_disp_fd_kick(fd);
+		while (0 != VM_FD_OUT_COUNT(fd) || 0 != fd->wait_until) {
+			error = vm_fd_cond_wait(fd, fflags);
+			if (0 != error)
+				break;
+		}
 		break;
 	case SNDCTL_SYNTH_INFO:
 		midiunit = data.synthinfo.device;
@@ -563,8 +1930,8 @@ vm_ioctl(struct cuse_dev *pdev, int fflags __unused,
 			goto err_out;
 		memset(&data, 0x00, len);
 		/* Lookup from app dsp dev list by num. */
-		snprintf(data.synthinfo.name, sizeof(data.synthinfo.name),
-		    "%s", fd->devs[midiunit].descr);
+		vm_dev_name_descr_get(fd->devs[midiunit].name,
+		    data.synthinfo.name, sizeof(data.synthinfo.name));
 		data.synthinfo.device = midiunit;
 		data.synthinfo.synth_type = SYNTH_TYPE_MIDI;
 		//fluid_settings_getint(fd->settings, "synth.chorus.nr",
@@ -575,7 +1942,9 @@ vm_ioctl(struct cuse_dev *pdev, int fflags __unused,
 			goto err_out;
 		data.ival = (int)fd->timer_base;
 		break;
-	//case SNDCTL_SEQ_GETOUTCOUNT:
+	case SNDCTL_SEQ_GETOUTCOUNT: /* Free events in queue. */
+		data.ival = (int)VM_FD_OUT_FREE_EVENTS(fd);
+		break;
 	//case SNDCTL_SEQ_GETINCOUNT:
 	//case SNDCTL_SEQ_PERCMODE:
 	//case SNDCTL_FM_LOAD_INSTR:
@@ -595,13 +1964,18 @@ vm_ioctl(struct cuse_dev *pdev, int fflags __unused,
 			goto err_out;
 		memset(&data, 0x00, len);
 		/* Lookup from app dsp dev list by num. */
-		snprintf(data.mi.name, sizeof(data.mi.name),
-		    "%s", fd->devs[midiunit].descr);
+		vm_dev_name_descr_get(fd->devs[midiunit].name,
+		    data.mi.name, sizeof(data.mi.name));
 		data.mi.device = midiunit;
 		data.mi.dev_type = 0x01; /* From sequencer.c. */
 		break;
-	case SNDCTL_SEQ_TRESHOLD:
-		/* Not implemented. */
+	case SNDCTL_SEQ_TRESHOLD: /* Free events to report write ready. */
+		if (1 > data.ival) {
+			data.ival = 1;
+		} else if (VM_OUT_Q_EVENTS <= data.ival) {
+			data.ival = (VM_OUT_Q_EVENTS - 1);
+		}
+		fd->out_lowat = (size_t)data.ival;
 		break;
 	//case SNDCTL_SYNTH_MEMAVL:
 	case SNDCTL_FM_4OP_ENABLE:
@@ -610,7 +1984,25 @@ vm_ioctl(struct cuse_dev *pdev, int fflags __unused,
 		/* Patch manager and fm are ded, ded, ded. */
 		goto err_out;
 	case SNDCTL_SEQ_OUTOFBAND:
+		if (0 != fd->nonblock) {
+			fflags |= CUSE_FFLAG_NONBLOCK;
+		}
+		while (0 != fd->tx_busy) { /* Wait for writer. */
+			error = vm_fd_cond_wait(fd, fflags);
+			if (0 != error)
+				break;
+		}
+		if (0 != error)
+			break;
+		fd->tx_busy = 1;
+		midiunit = vm_sequencer_event_dev((const uint8_t*)&data);
+		if (0 <= midiunit &&
+		    fd->devs_count > (size_t)midiunit) {
+			vm_fd_dev_open(fd, &fd->devs[midiunit]);
+		}
 		vm_sequencer_event_handle(fd, (const uint8_t*)&data, len);
+		fd->tx_busy = 0;
+		pthread_cond_broadcast(&fd->cond);
 		break;
 	case SNDCTL_SEQ_GETTIME:
 		data.ival = (int)vm_time_get(fd);
@@ -621,6 +2013,7 @@ err_out:
 		error = CUSE_ERR_INVALID;
 		break;
 	}
+	vm_fd_devs_flush(fd, 0); /* SNDCTL_SEQ_OUTOFBAND, SNDCTL_SEQ_RESET. */
 	pthread_mutex_unlock(&fd->mtx);
 
 	if (0 == error &&
@@ -640,9 +2033,12 @@ vm_poll(struct cuse_dev *pdev, int fflags __unused, int events) {
 		return (retval);
 
 	pthread_mutex_lock(&fd->mtx);
-	if (0 != (CUSE_POLL_WRITE & events) &&
-	    0 == fd->tx_busy) {
-		retval |= CUSE_POLL_WRITE;
+	if (0 != (CUSE_POLL_WRITE & events)) {
+		if (VM_FD_OUT_FREE_EVENTS(fd) >= fd->out_lowat) {
+			retval |= CUSE_POLL_WRITE;
+		} else { /* Dispatcher will call cuse_poll_wakeup(). */
+			fd->poll_wait = 1;
+		}
 	}
 	pthread_mutex_unlock(&fd->mtx);
 
@@ -661,23 +2057,78 @@ static const struct cuse_methods vm_methods = {
 
 struct cuse_dev *
 vm_dev_oss_sequencer_create(const char *dname, const char **inc_lst,
-    const size_t inc_lst_cnt) {
+    const size_t inc_lst_cnt, vm_seq_dev_options_p dev_opts) {
+	int error;
+	vm_seq_dev_p sdev;
 	struct cuse_dev *pdev;
 
-	pdev = cuse_dev_create(&vm_methods,
-	    inc_lst, /* param0 */
-	    (void*)inc_lst_cnt, /* param1 */
+	sdev = vm_seq_dev_alloc(inc_lst, inc_lst_cnt);
+	if (NULL == sdev)
+		return (NULL);
+	if (NULL != dev_opts) {
+		memcpy(&sdev->opts, dev_opts, sizeof(vm_seq_dev_options_t));
+	}
+	error = vm_disp_start(sdev->opts.spin_us);
+	if (0 != error) {
+		vm_seq_dev_free(sdev);
+		errno = error;
+		return (NULL);
+	}
+	pdev = cuse_dev_create(cuse_pool_methods(&vm_methods),
+	    sdev, /* param0 */
+	    NULL, /* param1 */
 	    0 /* root */,
 	    0 /* wheel */,
 	    0666 /* mode */,
 	    "%s", dname);
+	if (NULL == pdev) {
+		vm_disp_stop();
+		vm_seq_dev_free(sdev);
+	}
 	return (pdev);
 }
 
 void
 vm_dev_oss_sequencer_destroy(struct cuse_dev *pdev) {
 
+	vm_seq_dev_p sdev;
+
 	if (NULL == pdev)
 		return;
+	sdev = cuse_dev_get_priv0(pdev);
 	cuse_dev_destroy(pdev);
+	vm_disp_stop();
+	vm_seq_dev_free(sdev);
+}
+
+void
+vm_dev_oss_sequencer_stats_log(struct cuse_dev *pdev) {
+	vm_seq_dev_p sdev;
+	size_t devs, off = 0;
+	uint64_t waits = 0;
+	char hist[256];
+
+	if (NULL == pdev)
+		return;
+	sdev = cuse_dev_get_priv0(pdev);
+	pthread_mutex_lock(&sdev->mtx);
+	devs = ((NULL != sdev->devs) ? sdev->devs->count : 0);
+	pthread_mutex_unlock(&sdev->mtx);
+	/* Not exact, only for stats. */
+	for (size_t i = 0; i < VM_LATE_HIST_CNT; i ++) {
+		waits += vm_disp.late_hist[i];
+		if (i < (VM_LATE_HIST_CNT - 1)) {
+			off += (size_t)snprintf(&hist[off], (sizeof(hist) - off),
+			    ", <%"PRIu64"us: %"PRIu64,
+			    vm_late_hist_us[i], vm_disp.late_hist[i]);
+		} else {
+			off += (size_t)snprintf(&hist[off], (sizeof(hist) - off),
+			    ", more: %"PRIu64, vm_disp.late_hist[i]);
+		}
+		off = MIN(off, (sizeof(hist) - 1)); /* Truncated. */
+	}
+	syslog(LOG_INFO, "Sequencer: output devices: %zu, spin: %"PRIu64" us, "
+	    "waits: %"PRIu64", late max: %"PRIu64" us%s",
+	    devs, (vm_disp.spin_ns / 1000), waits,
+	    (vm_disp.late_max / 1000), hist);
 }
@@ -36,12 +36,30 @@
 #include <cuse.h>
 
 
+/* Called before each output device write, time - fd clock nanoseconds. */
+typedef void (*vm_seq_emit_cb)(void *udata, const uint64_t time,
+    const char *dev_name, const uint8_t *buf, const size_t size);
+
+typedef struct vm_seq_dev_options_s {
+	uint32_t	spin_us; /* Wake up before TMR_WAIT_* end and yield, 0 - disabled. */
+	/* Simulated clock for tests and benchmarks: TMR_WAIT_* end
+	 * instantly, fd clock moved to wait end. */
+	int		sim_clock;
+	vm_seq_emit_cb	emit_cb; /* May be NULL. */
+	void		*emit_udata;
+} vm_seq_dev_options_t, *vm_seq_dev_options_p;
+
+
 struct cuse_dev *
 vm_dev_oss_sequencer_create(const char *dname, const char **inc_lst,
-    const size_t inc_lst_cnt);
+    const size_t inc_lst_cnt, vm_seq_dev_options_p dev_opts);
 
 void
 vm_dev_oss_sequencer_destroy(struct cuse_dev *pdev);
 
+/* Write device and timing statistics to syslog. */
+void
+vm_dev_oss_sequencer_stats_log(struct cuse_dev *pdev);
+
 
 #endif /* __DEV_OSS_SEQUENCER_H__ */
@@ -44,7 +44,9 @@
 #include <getopt.h>
 #include <pwd.h>
 #include <grp.h>
+#include <signal.h>
 
+#include "cuse_pool.h"
 #include "dev_oss_sequencer.h"
 #include "sys_utils.h"
 
@@ -59,8 +61,10 @@
 #define PACKAGE_DESCRIPTION		"Create virtual sequencer device"
 
 #define VIRTUAL_SEQ_DEF_VDEV		"sequencer"
+#define VIRTUAL_SEQ_DEF_MIN_THREADS	2
 
 static volatile int app_running = 1;
+static volatile int app_stats_log = 0;
 
 
 #define CLO_PREFIX_COUNT_MAX	32
@@ -70,9 +74,14 @@ typedef struct command_line_options_s {
 	uid_t		pw_uid;		/* user uid */
 	gid_t		pw_gid;		/* user gid */
 	int		threads;
+	int		min_threads;
+	const char	*cpus;
+	int		workers_rt_prio;
+	int		workers_rt_count;
 	const char	*vdev;
 	const char	*prefix[CLO_PREFIX_COUNT_MAX];
 	size_t		prefix_count;
+	vm_seq_dev_options_t dev_opts;
 } cmd_opts_t, *cmd_opts_p;
 
 
@@ -85,6 +94,11 @@ static struct option long_options[] = {
 	{ "threads",	required_argument,	NULL,	't'	},
 	{ "vdev",	required_argument,	NULL,	'V'	},
 	{ "prefix",	required_argument,	NULL,	'P'	},
+	{ "minthreads",	required_argument,	NULL,	'm'	},
+	{ "cpus",	required_argument,	NULL,	'c'	},
+	{ "wrtprio",	required_argument,	NULL,	'w'	},
+	{ "spin",	required_argument,	NULL,	'S'	},
+	{ "rtthreads",	required_argument,	NULL,	'W'	},
 	{ NULL,		0,			NULL,	0	}
 };
 
@@ -94,9 +108,14 @@ static const char *long_options_descr[] = {
 	"<pid>				PID file name",
 	"<user>			Change uid",
 	"<group>			Change gid",
-	"<cuse_threads>		CUSE threads count. Default: CPU count x2",
+	"<cuse_threads>		CUSE threads max count. Default: CPU count x2",
 	"<virtual_device_name>		New virtual MIDI device base name. Default: " VIRTUAL_SEQ_DEF_VDEV,
 	"<out_device_name_prefix>	Output devices name prefix. Use multiple times if you need more than 1 prefix. Default: midi, umidi",
+	"<cuse_threads>		CUSE threads min count, more started when all busy. Default: 2",
+	"<cpu_list>			Pin CUSE threads to CPUs, example: 0,2-3. Default: any",
+	"<prio>			CUSE threads SCHED_FIFO priority, 0 - disabled. Default: 0",
+	"<usec>			Wake up before timer wait end and yield remaining time, for precise timing, 0 - disabled, 10000 max. Default: 0",
+	"<count>			CUSE threads with -cpus and -wrtprio, other run as usual. Default: minthreads",
 	NULL
 };
 
@@ -112,6 +131,7 @@ cmd_opts_parse(int argc, char **argv, struct option *opts,
 
 	memset(cmd_opts, 0x00, sizeof(cmd_opts_t));
 	cmd_opts->vdev = VIRTUAL_SEQ_DEF_VDEV;
+	cmd_opts->min_threads = VIRTUAL_SEQ_DEF_MIN_THREADS;
 
 	/* Process command line. */
 	/* Generate opts string from long options. */
@@ -181,7 +201,7 @@ restart_opts:
 			cmd_opts->vdev = optarg;
 			break;
 		case 7: /* prefix */
-			if (CLO_PREFIX_COUNT_MAX >= cmd_opts->prefix_count) {
+			if (CLO_PREFIX_COUNT_MAX <= cmd_opts->prefix_count) {
 				fprintf(stderr, "Can not add more prefixies, max count is %i!\n",
 				    CLO_PREFIX_COUNT_MAX);
 				break;
@@ -189,6 +209,21 @@ restart_opts:
 			cmd_opts->prefix[cmd_opts->prefix_count] = optarg;
 			cmd_opts->prefix_count ++;
 			break;
+		case 8: /* minthreads */
+			cmd_opts->min_threads = atoi(optarg);
+			break;
+		case 9: /* cpus */
+			cmd_opts->cpus = optarg;
+			break;
+		case 10: /* wrtprio */
+			cmd_opts->workers_rt_prio = atoi(optarg);
+			break;
+		case 11: /* spin */
+			cmd_opts->dev_opts.spin_us = (uint32_t)MAX(0, atoi(optarg));
+			break;
+		case 12: /* rtthreads */
+			cmd_opts->workers_rt_count = atoi(optarg);
+			break;
 		default:
 			return (EINVAL);
 		}
@@ -208,33 +243,25 @@ signal_handler(int sig) {
 	case SIGKILL:
 		app_running = 0;
 		break;
-	case SIGHUP:
 	case SIGUSR1:
+		app_stats_log = 1;
+		break;
+	case SIGHUP:
 	case SIGUSR2:
 	default:
 		break;
 	}
 }
 
-static void *
-cuse_worker_proc(void *arg __unused) {
-
-	while (0 != app_running) {
-		if (0 != cuse_wait_and_process())
-			break;
-	}
-
-	return (NULL);
-}
-
 
 int
 main(int argc, char **argv) {
 	int error = 0;
 	cmd_opts_t cmd_opts;
 	struct cuse_dev *seq_dev;
-	pthread_t td;
+	cuse_pool_options_t pool_opts;
 	struct timespec rqts = { .tv_sec = 3600, .tv_nsec = 0 };
+	sigset_t sig_set;
 
 	/* Command line processing. */
 	error = cmd_opts_parse(argc, argv, long_options, &cmd_opts);
@@ -273,13 +300,17 @@ main(int argc, char **argv) {
 		signal(SIGTERM, signal_handler);
 		signal(SIGHUP, signal_handler);
 		signal(SIGUSR1, signal_handler);
-		signal(SIGUSR2, signal_handler);
 		signal(SIGPIPE, SIG_IGN);
 	}
+	signal(SIGUSR1, signal_handler);
 	/* PID file. */
 	if (NULL != cmd_opts.pid) {
 		write_pid(cmd_opts.pid);
 	}
+	/* Only main thread handle signals, other threads inherit mask. */
+	sigemptyset(&sig_set);
+	sigaddset(&sig_set, SIGUSR1);
+	pthread_sigmask(SIG_BLOCK, &sig_set, NULL);
 
 	/* CUSE init. */
 	if (0 != cuse_init()) {
@@ -288,23 +319,38 @@ main(int argc, char **argv) {
 	}
 
 	seq_dev = vm_dev_oss_sequencer_create(cmd_opts.vdev,
-	    cmd_opts.prefix, cmd_opts.prefix_count);
+	    cmd_opts.prefix, cmd_opts.prefix_count, &cmd_opts.dev_opts);
 	if (NULL == seq_dev) {
 		errx(EX_SOFTWARE, "Could not create '/dev/%s' - %i: %s",
 		    cmd_opts.vdev, errno, strerror(errno));
 	}
 
 	/* CUSE post init. */
-	for (size_t i = 0; i < (size_t)cmd_opts.threads; i ++) {
-		pthread_create(&td, NULL, &cuse_worker_proc, NULL);
+	memset(&pool_opts, 0x00, sizeof(cuse_pool_options_t));
+	pool_opts.min_threads = (size_t)MAX(1, cmd_opts.min_threads);
+	pool_opts.max_threads = (size_t)cmd_opts.threads;
+	pool_opts.cpus = cmd_opts.cpus;
+	pool_opts.rt_prio = MAX(0, cmd_opts.workers_rt_prio);
+	pool_opts.rt_threads = (size_t)MAX(0, cmd_opts.workers_rt_count);
+	error = cuse_pool_start(&pool_opts);
+	if (0 != error) {
+		errx(EX_SOFTWARE, "Could not start CUSE threads - %i: %s",
+		    error, strerror(error));
 	}
 
+	pthread_sigmask(SIG_UNBLOCK, &sig_set, NULL);
+
 	/* Drop rights. */
 	set_user_and_group(cmd_opts.pw_uid, cmd_opts.pw_gid);
 
 	/* Wait for signals. */
 	while (0 != app_running) {
 		nanosleep(&rqts, NULL); /* Ignore early wakeup and errors. */
+		if (0 != app_stats_log) {
+			app_stats_log = 0;
+			vm_dev_oss_sequencer_stats_log(seq_dev);
+			cuse_pool_stats_log();
+		}
 	}
 
 	vm_dev_oss_sequencer_destroy(seq_dev);